@@ -26,6 +26,7 @@
 #include "qemu/timer.h"
 #include "exec/address-spaces.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
 #include "exec/tb-hash.h"
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
 #include "hw/i386/apic.h"
@@ -207,55 +208,60 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
     tb_free(tb);
 }
 
-static TranslationBlock *tb_find_physical(CPUState *cpu,
-                                          target_ulong pc,
-                                          target_ulong cs_base,
-                                          uint64_t flags)
-{
-    CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+typedef struct TBDesc {
+    target_ulong pc;
+    target_ulong cs_base;
+    CPUArchState *env;
+    tb_page_addr_t phys_page1;
+    uint64_t flags;
+} TBDesc;
 
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const TBDesc *desc = d;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags &&
+        !(atomic_read(&tb->cflags) & CF_INVALID)) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        } else {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
 
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb) {
-            return NULL;
-        }
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2) {
-                    break;
-                }
-            } else {
-                break;
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
             }
         }
-        ptb1 = &tb->phys_hash_next;
     }
+    return false;
+}
 
-    /* Move the TB to the head of the list */
-    *ptb1 = tb->phys_hash_next;
-    tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
-    return tb;
+/* Look the TB up in the hash table.  This takes no lock, the TB may be
+   invalidated by another vCPU as soon as it is returned.  */
+static TranslationBlock *tb_find_physical(CPUState *cpu,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags)
+{
+    tb_page_addr_t phys_pc;
+    TBDesc desc;
+    uint32_t h;
+
+    desc.env = (CPUArchState *)cpu->env_ptr;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.pc = pc;
+    phys_pc = get_page_addr_code(desc.env, pc);
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, flags, cs_base);
+    return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
 }
 
 static TranslationBlock *tb_find_slow(CPUState *cpu,
@@ -264,38 +270,40 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
                                       uint64_t flags)
 {
     TranslationBlock *tb;
+    unsigned int h;
 
     tb = tb_find_physical(cpu, pc, cs_base, flags);
     if (tb) {
         goto found;
     }
 
-#ifdef CONFIG_USER_ONLY
-    /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
-     * taken outside tb_lock.  Since we're momentarily dropping
-     * tb_lock, there's a chance that our desired tb has been
-     * translated.
+    /* mmap_lock is needed by tb_gen_code, and must be taken outside
+     * tb_lock.  Another vCPU may have translated the TB meanwhile.
      */
-    tb_unlock();
+#ifdef CONFIG_USER_ONLY
     mmap_lock();
+#endif
     tb_lock();
     tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        mmap_unlock();
-        goto found;
+    if (!tb) {
+        /* if no translated code available, then translate it now */
+        tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+        tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
     }
-#endif
-
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
+    tb_unlock();
 #ifdef CONFIG_USER_ONLY
     mmap_unlock();
 #endif
 
 found:
     /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    h = tb_jmp_cache_hash_func(pc);
+    atomic_set(&cpu->tb_jmp_cache[h], tb);
+    /* unless tb_phys_invalidate ran meanwhile, and missed this entry */
+    smp_mb();
+    if (unlikely(atomic_read(&tb->cflags) & CF_INVALID)) {
+        atomic_set(&cpu->tb_jmp_cache[h], NULL);
+    }
     return tb;
 }
 
@@ -318,6 +326,31 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu)
     return tb;
 }
 
+/* Called from generated code at an indirect jump: return the host code
+   of the TB for the current CPU state if it is in the jump cache, else
+   the epilogue, which goes back to cpu_exec.  The caller must have
+   stored the new PC.  */
+void *tb_lookup_tc_ptr(CPUState *cpu)
+{
+    CPUArchState *env = (CPUArchState *)cpu->env_ptr;
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN | CPU_LOG_EXEC))) {
+        return tcg_ctx.code_gen_epilogue;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    /* another vCPU may be invalidating the TB, which is harmless as long
+       as the code buffer is not flushed */
+    tb = atomic_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
+    if (likely(tb && tb->pc == pc && tb->cs_base == cs_base &&
+               tb->flags == flags)) {
+        return tb->tc_ptr;
+    }
+    return tcg_ctx.code_gen_epilogue;
+}
+
 static void cpu_handle_debug_exception(CPUState *cpu)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
@@ -408,7 +441,13 @@ int cpu_exec(CPUState *cpu)
                     break;
 #else
                     if (replay_exception()) {
+                        if (qemu_tcg_mttcg_enabled()) {
+                            qemu_mutex_lock_iothread();
+                        }
                         cc->do_interrupt(cpu);
+                        if (qemu_tcg_mttcg_enabled()) {
+                            qemu_mutex_unlock_iothread();
+                        }
                         cpu->exception_index = -1;
                     } else if (!replay_has_interrupt()) {
                         /* give a chance to iothread in replay mode */
@@ -429,6 +468,12 @@ int cpu_exec(CPUState *cpu)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    /* With a thread per vCPU, the state the interrupts
+                       depend on is shared with the devices, under the
+                       global mutex.  It is released on cpu_loop_exit.  */
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_lock_iothread();
+                    }
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -481,6 +526,9 @@ int cpu_exec(CPUState *cpu)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_unlock_iothread();
+                    }
                 }
                 if (unlikely(cpu->exit_request
                              || replay_has_interrupt())) {
@@ -488,7 +536,6 @@ int cpu_exec(CPUState *cpu)
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                tb_lock();
                 tb = tb_find_fast(cpu);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -508,10 +555,11 @@ int cpu_exec(CPUState *cpu)
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1
                     && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    tb_lock();
+                    tb_chain_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
+                                  next_tb & TB_EXIT_MASK, tb);
+                    tb_unlock();
                 }
-                tb_unlock();
                 if (likely(!cpu->exit_request)) {
                     trace_exec_tb(tb, tb->pc);
                     tc_ptr = tb->tc_ptr;
@@ -532,6 +580,16 @@ int cpu_exec(CPUState *cpu)
                          * or cpu->interrupt_request.
                          */
                         smp_rmb();
+                        /* Or the TB ran often enough to be made a
+                         * superblock; its state is current again.
+                         */
+                        tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+                        if ((tb->cflags & CF_COUNT_HOT) &&
+                            atomic_read(&tb->hot_count) == 0) {
+                            tb_lock();
+                            tb_gen_superblock(cpu, tb);
+                            tb_unlock();
+                        }
                         next_tb = 0;
                         break;
                     case TB_EXIT_ICOUNT_EXPIRED:
@@ -590,6 +648,9 @@ int cpu_exec(CPUState *cpu)
 #endif /* buggy compiler */
             cpu->can_do_io = 1;
             tb_lock_reset();
+            if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+                qemu_mutex_unlock_iothread();
+            }
         }
     } /* for(;;) */
 
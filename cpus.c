@@ -872,6 +872,19 @@ static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static unsigned iothread_requesting_mutex;
 
+/* Run each TCG vCPU in its own thread, without the global mutex */
+bool mttcg_enabled;
+
+/* With a thread per vCPU, whatever must not run concurrently with
+   translated code, like a tb_flush, runs in an exclusive section: it
+   waits for the vCPUs in cpu_exec to leave it, and keeps the others
+   from entering.  */
+static QemuMutex tcg_exclusive_lock;
+static QemuCond tcg_exclusive_cond;
+static QemuCond tcg_exclusive_resume;
+static bool tcg_exclusive_active;
+static int tcg_exclusive_pending;
+
 static QemuThread io_thread;
 
 /* cpu creation */
@@ -888,6 +901,9 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&tcg_exclusive_lock);
+    qemu_cond_init(&tcg_exclusive_cond);
+    qemu_cond_init(&tcg_exclusive_resume);
 
     qemu_thread_get_self(&io_thread);
 }
@@ -1104,6 +1120,21 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 }
 
 static void tcg_exec_all(void);
+static void qemu_cpu_kick_no_halt(void);
+
+/* A single thread takes the vCPUs in turn, moving to the next one when
+   kicked: kick it periodically, so that a vCPU spinning on a lock held
+   by another does not keep it from running.  */
+#define TCG_KICK_PERIOD (NANOSECONDS_PER_SECOND / 10)
+
+static QEMUTimer *tcg_kick_timer;
+
+static void tcg_kick_timer_cb(void *opaque)
+{
+    timer_mod(tcg_kick_timer,
+              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + TCG_KICK_PERIOD);
+    qemu_cpu_kick_no_halt();
+}
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
@@ -1131,6 +1162,13 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
         }
     }
 
+    if (CPU_NEXT(first_cpu) && !tcg_kick_timer) {
+        tcg_kick_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, tcg_kick_timer_cb,
+                                      NULL);
+        timer_mod(tcg_kick_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + TCG_KICK_PERIOD);
+    }
+
     /* process any pending work */
     atomic_mb_set(&exit_request, 1);
 
@@ -1150,6 +1188,109 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static void tcg_exec_start(CPUState *cpu)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    while (tcg_exclusive_active) {
+        qemu_cond_wait(&tcg_exclusive_resume, &tcg_exclusive_lock);
+    }
+    cpu->running = true;
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void tcg_exec_end(CPUState *cpu)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    cpu->running = false;
+    /* Only the vCPUs running when the section started are waited for,
+       the others cannot start until it ends.  */
+    if (tcg_exclusive_active && --tcg_exclusive_pending == 0) {
+        qemu_cond_signal(&tcg_exclusive_cond);
+    }
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+/* Must be called without the global mutex, which the vCPUs may be
+   waiting for before they can leave cpu_exec.  */
+static void tcg_start_exclusive(void)
+{
+    CPUState *cpu;
+
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    while (tcg_exclusive_active) {
+        qemu_cond_wait(&tcg_exclusive_resume, &tcg_exclusive_lock);
+    }
+    tcg_exclusive_active = true;
+    tcg_exclusive_pending = 0;
+    CPU_FOREACH(cpu) {
+        if (cpu->running) {
+            tcg_exclusive_pending++;
+            cpu_exit(cpu);
+        }
+    }
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&tcg_exclusive_cond, &tcg_exclusive_lock);
+    }
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void tcg_end_exclusive(void)
+{
+    qemu_mutex_lock(&tcg_exclusive_lock);
+    tcg_exclusive_active = false;
+    qemu_cond_broadcast(&tcg_exclusive_resume);
+    qemu_mutex_unlock(&tcg_exclusive_lock);
+}
+
+static void qemu_mttcg_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
+static int tcg_cpu_exec(CPUState *cpu);
+
+/* A thread per vCPU: the global mutex is only taken around device
+   accesses and the updates of the state shared with the devices.  */
+static void *qemu_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            qemu_mutex_unlock_iothread();
+            if (tb_flush_pending()) {
+                tcg_start_exclusive();
+                tb_flush_exclusive(cpu);
+                tcg_end_exclusive();
+            }
+            tcg_exec_start(cpu);
+            r = tcg_cpu_exec(cpu);
+            tcg_exec_end(cpu);
+            qemu_mutex_lock_iothread();
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_mttcg_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1185,7 +1326,9 @@ static void qemu_cpu_kick_no_halt(void)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (tcg_enabled()) {
+    if (tcg_enabled() && qemu_tcg_mttcg_enabled()) {
+        cpu_exit(cpu);
+    } else if (tcg_enabled()) {
         qemu_cpu_kick_no_halt();
     } else {
         qemu_cpu_kick_thread(cpu);
@@ -1221,7 +1364,7 @@ void qemu_mutex_lock_iothread(void)
     /* In the simple case there is no need to bump the VCPU thread out of
      * TCG code execution.
      */
-    if (!tcg_enabled() || qemu_in_vcpu_thread() ||
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() || qemu_in_vcpu_thread() ||
         !first_cpu || !first_cpu->created) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
@@ -1267,7 +1410,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1304,13 +1447,29 @@ void resume_all_vcpus(void)
 /* For temporary buffers for forming a name */
 #define VCPU_THREAD_NAME_SIZE 16
 
-static void qemu_tcg_init_vcpu(CPUState *cpu)
+static QemuCond *tcg_halt_cond;
+static QemuThread *tcg_cpu_thread;
+
+static void qemu_tcg_start_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
-    static QemuCond *tcg_halt_cond;
-    static QemuThread *tcg_cpu_thread;
 
-    tcg_cpu_address_space_init(cpu, cpu->as);
+    if (qemu_tcg_mttcg_enabled()) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name, qemu_mttcg_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
 
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
@@ -1335,6 +1494,12 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
     }
 }
 
+static void qemu_tcg_init_vcpu(CPUState *cpu)
+{
+    tcg_cpu_address_space_init(cpu, cpu->as);
+    qemu_tcg_start_vcpu(cpu);
+}
+
 static void qemu_kvm_start_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
@@ -1381,6 +1546,52 @@ void qemu_init_vcpu(CPUState *cpu)
     }
 }
 
+/* Only the thread calling fork() survives in the child, start new vcpu
+ * threads there.  The vcpus must be stopped.
+ */
+void qemu_cpus_after_fork(void)
+{
+    CPUState *cpu;
+
+    assert(tcg_enabled());
+    tcg_cpu_thread = NULL;
+    CPU_FOREACH(cpu) {
+        cpu->created = false;
+        cpu->stopped = true;
+        cpu->running = false;
+        cpu->thread_kicked = false;
+    }
+    CPU_FOREACH(cpu) {
+        qemu_tcg_start_vcpu(cpu);
+    }
+}
+
+void qemu_tcg_configure(const char *threads, Error **errp)
+{
+    if (!strcmp(threads, "single")) {
+        mttcg_enabled = false;
+    } else if (!strcmp(threads, "multi")) {
+#ifndef TARGET_SUPPORTS_MTTCG
+        error_setg(errp, "multi-threaded TCG is not supported "
+                   "for this target");
+        return;
+#endif
+        if (!tcg_enabled()) {
+            error_setg(errp, "-tcg-threads multi requires TCG");
+            return;
+        }
+        if (use_icount) {
+            error_setg(errp, "-tcg-threads multi is incompatible with "
+                       "-icount");
+            return;
+        }
+        mttcg_enabled = true;
+    } else {
+        error_setg(errp, "invalid -tcg-threads mode '%s', "
+                   "expected 'single' or 'multi'", threads);
+    }
+}
+
 void cpu_stop_current(void)
 {
     if (current_cpu) {
@@ -1487,6 +1698,7 @@ static int tcg_cpu_exec(CPUState *cpu)
 
 static void tcg_exec_all(void)
 {
+    static CPUState *last_cpu;
     int r;
 
     /* Account partial waits to QEMU_CLOCK_VIRTUAL.  */
@@ -1502,6 +1714,12 @@ static void tcg_exec_all(void)
                           (cpu->singlestep_enabled & SSTEP_NOTIMER) == 0);
 
         if (cpu_can_run(cpu)) {
+            /* the cross page jumps were chained for the TLB of the
+               previous vCPU */
+            if (cpu != last_cpu) {
+                tb_reset_cross_page_jumps(0, -1);
+                last_cpu = cpu;
+            }
             r = tcg_cpu_exec(cpu);
             if (r == EXCP_DEBUG) {
                 cpu_handle_guest_debug(cpu);
@@ -1665,6 +1883,33 @@ exit:
     fclose(f);
 }
 
+void qmp_x_tb_profile(bool enable, Error **errp)
+{
+    if (!tcg_enabled()) {
+        error_setg(errp, "TB profiling requires TCG");
+        return;
+    }
+    tb_profile_enable(first_cpu, enable);
+}
+
+void qmp_x_tb_profile_dump(const char *filename, Error **errp)
+{
+    FILE *f;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "TB profiling requires TCG");
+        return;
+    }
+
+    f = fopen(filename, "w");
+    if (!f) {
+        error_setg_file_open(errp, errno, filename);
+        return;
+    }
+    dump_tb_profile(f, fprintf, 0);
+    fclose(f);
+}
+
 void qmp_inject_nmi(Error **errp)
 {
 #if defined(TARGET_I386)
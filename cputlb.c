@@ -23,6 +23,7 @@
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "exec/cpu_ldst.h"
+#include "qemu/main-loop.h"
 
 #include "exec/cputlb.h"
 
@@ -36,22 +37,109 @@
 /* statistics */
 int tlb_flush_count;
 
+/* A copy of the TLB of an address space that is not currently live,
+   see tlb_set_asid().  CPUState::tlb_banks points to CPU_TLB_BANKS of
+   them; it is outside CPUArchState so that target resets, which clear
+   the TLB part of CPUArchState, do not lose it.  */
+struct CPUTLBBank {
+    int asid;                   /* -1 if the bank is unused */
+    unsigned int stamp;         /* for LRU replacement */
+    target_ulong vtlb_index;
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];
+    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];
+    CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];
+};
+typedef struct CPUTLBBank CPUTLBBank;
+
+/* Forget the TLBs saved by tlb_set_asid.  */
+static void tlb_flush_banks(CPUState *cpu)
+{
+    int b;
+
+    if (cpu->tlb_banks) {
+        for (b = 0; b < CPU_TLB_BANKS; b++) {
+            cpu->tlb_banks[b].asid = -1;
+        }
+    }
+}
+
+/* Forget the regions covered by large pages.  */
+static void tlb_clear_large_pages(CPUArchState *env)
+{
+    int r;
+
+    for (r = 0; r < CPU_TLB_LARGE_REGIONS; r++) {
+        env->tlb_flush_addr[r] = -1;
+        env->tlb_flush_mask[r] = 0;
+    }
+}
+
+/* Return true if addr is in a region covered by large pages.  */
+static bool tlb_hit_large_page(CPUArchState *env, target_ulong addr)
+{
+    int r;
+
+    for (r = 0; r < CPU_TLB_LARGE_REGIONS; r++) {
+        if (env->tlb_flush_addr[r] != (target_ulong)-1 &&
+            (addr & env->tlb_flush_mask[r]) == env->tlb_flush_addr[r]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Flush the live TLB entries that were not added with PAGE_GLOBAL.  */
+static void tlb_flush_nonglobal(CPUArchState *env)
+{
+    int mmu_idx, i;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            if (!env->iotlb[mmu_idx][i].global) {
+                memset(&env->tlb_table[mmu_idx][i], -1, sizeof(CPUTLBEntry));
+            }
+        }
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            if (!env->iotlb_v[mmu_idx][i].global) {
+                memset(&env->tlb_v_table[mmu_idx][i], -1,
+                       sizeof(CPUTLBEntry));
+            }
+        }
+    }
+}
+
+static void tlb_flush_async(void *opaque)
+{
+    tlb_flush(opaque, 1);
+}
+
+/* With a thread per vCPU, the TLB of another vCPU may be in use: it is
+ * flushed by its own thread, which does it before running code again.
+ * Such flushes are rare, so they drop the whole TLB.
+ */
+static bool tlb_flush_remote(CPUState *cpu)
+{
+    if (qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_async, cpu);
+        return true;
+    }
+    return false;
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
- * If flush_global is false, flush (at least) all tlb entries not
- * marked global.
- *
- * Since QEMU doesn't currently implement a global/not-global flag
- * for tlb entries, at the moment tlb_flush() will also flush all
- * tlb entries in the flush_global == false case. This is OK because
- * CPU architectures generally permit an implementation to drop
- * entries from the TLB at any time, so flushing more entries than
- * required is only an efficiency issue, not a correctness issue.
+ * If flush_global is false, flush all tlb entries not marked global,
+ * i.e. not added with PAGE_GLOBAL.  Large pages are still tracked
+ * in that case, as some of them may have been kept.
  */
 void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
 
+    if (tlb_flush_remote(cpu)) {
+        return;
+    }
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
@@ -59,13 +147,19 @@ void tlb_flush(CPUState *cpu, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+    if (flush_global) {
+        memset(env->tlb_table, -1, sizeof(env->tlb_table));
+        memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+        env->vtlb_index = 0;
+        tlb_clear_large_pages(env);
+    } else {
+        tlb_flush_nonglobal(env);
+    }
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    tb_reset_cross_page_jumps(0, -1);
 
-    env->vtlb_index = 0;
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
+    env->tlb_asid = -1;
+    tlb_flush_banks(cpu);
     tlb_flush_count++;
 }
 
@@ -99,7 +193,9 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
     printf("\n");
 #endif
 
+    tlb_flush_banks(cpu);
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    tb_reset_cross_page_jumps(0, -1);
 }
 
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
@@ -122,23 +218,47 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
+/* Flush the page at addr from the saved TLBs of other address spaces.  */
+static void tlb_flush_page_banks(CPUState *cpu, target_ulong addr,
+                                 int mmu_idx)
+{
+    int i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int b, k;
+
+    if (!cpu->tlb_banks) {
+        return;
+    }
+    for (b = 0; b < CPU_TLB_BANKS; b++) {
+        CPUTLBBank *bank = &cpu->tlb_banks[b];
+
+        if (bank->asid < 0) {
+            continue;
+        }
+        tlb_flush_entry(&bank->tlb_table[mmu_idx][i], addr);
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&bank->tlb_v_table[mmu_idx][k], addr);
+        }
+    }
+}
+
 void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
     CPUArchState *env = cpu->env_ptr;
     int i;
     int mmu_idx;
 
+    if (tlb_flush_remote(cpu)) {
+        return;
+    }
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
     /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
+    if (tlb_hit_large_page(env, addr)) {
 #if defined(DEBUG_TLB)
-        printf("tlb_flush_page: forced full flush ("
-               TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-               env->tlb_flush_addr, env->tlb_flush_mask);
+        printf("tlb_flush_page: flushing large page region\n");
 #endif
-        tlb_flush(cpu, 1);
+        tlb_flush_range(cpu, addr, TARGET_PAGE_SIZE);
         return;
     }
     /* must reset current TB so that interrupts cannot modify the
@@ -149,6 +269,7 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        tlb_flush_page_banks(cpu, addr, mmu_idx);
     }
 
     /* check whether there are entries that need to be flushed in the vtlb */
@@ -160,6 +281,7 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     }
 
     tb_flush_jmp_cache(cpu, addr);
+    tb_reset_cross_page_jumps(addr, addr | ~TARGET_PAGE_MASK);
 }
 
 void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
@@ -174,11 +296,9 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
     printf("tlb_flush_page_by_mmu_idx: " TARGET_FMT_lx, addr);
 #endif
     /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
+    if (tlb_hit_large_page(env, addr)) {
 #if defined(DEBUG_TLB)
-        printf(" forced full flush ("
-               TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-               env->tlb_flush_addr, env->tlb_flush_mask);
+        printf(" forced full flush\n");
 #endif
         v_tlb_flush_by_mmuidx(cpu, argp);
         va_end(argp);
@@ -203,6 +323,7 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
 #endif
 
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        tlb_flush_page_banks(cpu, addr, mmu_idx);
 
         /* check whether there are vltb entries that need to be flushed */
         for (k = 0; k < CPU_VTLB_SIZE; k++) {
@@ -216,6 +337,190 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
 #endif
 
     tb_flush_jmp_cache(cpu, addr);
+    tb_reset_cross_page_jumps(addr, addr | ~TARGET_PAGE_MASK);
+}
+
+/* Above this many pages, tlb_flush_range walks the whole TLB.  */
+#define TLB_FLUSH_RANGE_PAGES 16
+
+static inline bool tlb_hit_range(target_ulong tlb_addr, target_ulong start,
+                                 target_ulong last)
+{
+    return !(tlb_addr & TLB_INVALID_MASK) &&
+           (tlb_addr & TARGET_PAGE_MASK) - start <= last - start;
+}
+
+static void tlb_flush_entry_range(CPUTLBEntry *tlb_entry, target_ulong start,
+                                  target_ulong last)
+{
+    if (tlb_hit_range(tlb_entry->addr_read, start, last) ||
+        tlb_hit_range(tlb_entry->addr_write, start, last) ||
+        tlb_hit_range(tlb_entry->addr_code, start, last)) {
+        memset(tlb_entry, -1, sizeof(*tlb_entry));
+    }
+}
+
+static void tlb_flush_table_range(CPUTLBEntry (*table)[CPU_TLB_SIZE],
+                                  CPUTLBEntry (*v_table)[CPU_VTLB_SIZE],
+                                  target_ulong start, target_ulong last)
+{
+    int mmu_idx, i;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            tlb_flush_entry_range(&table[mmu_idx][i], start, last);
+        }
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_flush_entry_range(&v_table[mmu_idx][i], start, last);
+        }
+    }
+}
+
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len)
+{
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong start, last;
+    bool large = false, widened;
+    int r, b;
+
+    if (len == 0 || tlb_flush_remote(cpu)) {
+        return;
+    }
+    start = addr & TARGET_PAGE_MASK;
+    last = (addr + len - 1) | ~TARGET_PAGE_MASK;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_range: " TARGET_FMT_lx "-" TARGET_FMT_lx "\n",
+           start, last);
+#endif
+    /* Extend the range to the large page regions it overlaps.  They are
+       flushed entirely, so they need not be tracked any more.  */
+    do {
+        widened = false;
+        for (r = 0; r < CPU_TLB_LARGE_REGIONS; r++) {
+            target_ulong raddr = env->tlb_flush_addr[r];
+            target_ulong rlast = raddr | ~env->tlb_flush_mask[r];
+
+            if (raddr != (target_ulong)-1 && raddr <= last && start <= rlast) {
+                start = MIN(start, raddr);
+                last = MAX(last, rlast);
+                env->tlb_flush_addr[r] = -1;
+                env->tlb_flush_mask[r] = 0;
+                large = widened = true;
+            }
+        }
+    } while (widened);
+
+    if (!large &&
+        (last - start) >> TARGET_PAGE_BITS < TLB_FLUSH_RANGE_PAGES) {
+        for (addr = start; addr - start <= last - start;
+             addr += TARGET_PAGE_SIZE) {
+            tlb_flush_page(cpu, addr);
+        }
+        return;
+    }
+
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    tlb_flush_table_range(env->tlb_table, env->tlb_v_table, start, last);
+    if (cpu->tlb_banks) {
+        for (b = 0; b < CPU_TLB_BANKS; b++) {
+            CPUTLBBank *bank = &cpu->tlb_banks[b];
+
+            if (bank->asid >= 0) {
+                tlb_flush_table_range(bank->tlb_table, bank->tlb_v_table,
+                                      start, last);
+            }
+        }
+    }
+
+    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    tb_reset_cross_page_jumps(start, last);
+}
+
+/* Switching address space is cheap if the target keeps its TLB entries
+ * tagged: the live table of the old address space is saved in a bank and
+ * the one of the new address space, if still around, is restored.  The
+ * banks are kept coherent by tlb_flush_page and tlb_reset_dirty and are
+ * dropped by any wider flush.  Another vCPU's TLB is simply flushed,
+ * which makes it valid for any address space.  tlb_reset_dirty may still
+ * come from another thread, so the tables are switched under
+ * tlb_bank_lock.
+ */
+void tlb_set_asid(CPUState *cpu, int asid)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBBank *bank, *victim;
+    int b;
+
+    if (tlb_flush_remote(cpu) || asid == env->tlb_asid) {
+        return;
+    }
+    if (asid < 0) {
+        tlb_flush(cpu, 1);
+        return;
+    }
+
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    qemu_mutex_lock(&cpu->tlb_bank_lock);
+    if (!cpu->tlb_banks) {
+        cpu->tlb_banks = g_new(CPUTLBBank, CPU_TLB_BANKS);
+        for (b = 0; b < CPU_TLB_BANKS; b++) {
+            cpu->tlb_banks[b].asid = -1;
+        }
+    }
+
+    bank = NULL;
+    victim = NULL;
+    for (b = 0; b < CPU_TLB_BANKS; b++) {
+        CPUTLBBank *p = &cpu->tlb_banks[b];
+
+        if (p->asid == asid) {
+            bank = p;
+        } else if (!victim || (victim->asid >= 0 &&
+                               (p->asid < 0 || p->stamp < victim->stamp))) {
+            victim = p;
+        }
+    }
+
+#if defined(DEBUG_TLB)
+    printf("tlb_set_asid: %d -> %d (%s)\n", env->tlb_asid, asid,
+           bank ? "hit" : "miss");
+#endif
+
+    if (env->tlb_asid >= 0) {
+        victim->asid = env->tlb_asid;
+        victim->stamp = ++env->tlb_bank_stamp;
+        victim->vtlb_index = env->vtlb_index;
+        memcpy(victim->tlb_table, env->tlb_table, sizeof(env->tlb_table));
+        memcpy(victim->tlb_v_table, env->tlb_v_table,
+               sizeof(env->tlb_v_table));
+        memcpy(victim->iotlb, env->iotlb, sizeof(env->iotlb));
+        memcpy(victim->iotlb_v, env->iotlb_v, sizeof(env->iotlb_v));
+    }
+
+    if (bank) {
+        env->vtlb_index = bank->vtlb_index;
+        memcpy(env->tlb_table, bank->tlb_table, sizeof(env->tlb_table));
+        memcpy(env->tlb_v_table, bank->tlb_v_table,
+               sizeof(env->tlb_v_table));
+        memcpy(env->iotlb, bank->iotlb, sizeof(env->iotlb));
+        memcpy(env->iotlb_v, bank->iotlb_v, sizeof(env->iotlb_v));
+        bank->asid = -1;
+    } else {
+        /* global entries are valid in the new address space too */
+        tlb_flush_nonglobal(env);
+    }
+    env->tlb_asid = asid;
+    qemu_mutex_unlock(&cpu->tlb_bank_lock);
+
+    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    tb_reset_cross_page_jumps(0, -1);
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -233,6 +538,92 @@ void tlb_unprotect_code(ram_addr_t ram_addr)
     cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
+#ifdef TARGET_DIRECT_RAM_MMU_IDX
+/* The page of host address host may now be written directly */
+static void tlb_direct_ram_set_dirty(CPUArchState *env, uintptr_t host)
+{
+    CPUDirectRAM *d = &env->direct_ram;
+    uintptr_t ofs = host - d->host;
+
+    if (ofs < d->size) {
+        d->dirty[ofs >> TARGET_PAGE_BITS] = 1;
+    }
+}
+
+static void tlb_direct_ram_reset_dirty(CPUArchState *env, uintptr_t start,
+                                       uintptr_t length)
+{
+    CPUDirectRAM *d = &env->direct_ram;
+    uintptr_t first, last;
+
+    if (start >= d->host + d->size || start + length <= d->host) {
+        return;
+    }
+    first = (MAX(start, d->host) - d->host) >> TARGET_PAGE_BITS;
+    last = (MIN(start + length, d->host + d->size) - 1 - d->host)
+           >> TARGET_PAGE_BITS;
+    memset(d->dirty + first, 0, last - first + 1);
+}
+
+/* Recompute the direct RAM range of the CPU after a change of the memory
+   map or of the watchpoints, which it would bypass */
+void tlb_update_direct_ram(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUDirectRAM *d = &env->direct_ram;
+    MemoryRegion *mr;
+    hwaddr xlat, len = d->max_size;
+    target_ulong size = 0;
+
+    /* readers check size first, so the range goes away before host
+       changes and only comes back once host and dirty are right */
+    atomic_set(&d->size, 0);
+    smp_wmb();
+
+    rcu_read_lock();
+    if (d->max_size && QTAILQ_EMPTY(&cpu->watchpoints)) {
+        mr = address_space_translate(cpu->as, d->paddr, &xlat, &len, true);
+        if (memory_region_is_ram(mr) && !memory_region_is_rom(mr)) {
+            d->host = (uintptr_t)memory_region_get_ram_ptr(mr) + xlat;
+            size = len & TARGET_PAGE_MASK;
+        }
+    }
+    rcu_read_unlock();
+
+    /* the stores find out again which pages are dirty */
+    if (d->dirty) {
+        memset(d->dirty, 0, d->max_size >> TARGET_PAGE_BITS);
+    }
+    smp_wmb();
+    atomic_set(&d->size, size);
+}
+
+/* Let the generated code for mmu_idx TARGET_DIRECT_RAM_MMU_IDX access the
+   addresses with (addr & mask) - base below size at physical address
+   paddr + (addr & mask) - base, without a TLB lookup.  The range is cut
+   to the RAM found at paddr.  */
+void tlb_set_direct_ram(CPUState *cpu, target_ulong mask, target_ulong base,
+                        hwaddr paddr, target_ulong size)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUDirectRAM *d = &env->direct_ram;
+
+    atomic_set(&d->size, 0);
+    smp_wmb();
+    g_free(d->dirty);
+    d->mask = mask;
+    d->base = base;
+    d->paddr = paddr;
+    d->max_size = size & TARGET_PAGE_MASK;
+    d->dirty = g_malloc0(d->max_size >> TARGET_PAGE_BITS);
+    tlb_update_direct_ram(cpu);
+}
+#else
+void tlb_update_direct_ram(CPUState *cpu)
+{
+}
+#endif
+
 static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
 {
     return (tlbe->addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
@@ -246,7 +637,9 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            /* the entry may be in use by another vCPU thread */
+            atomic_set(&tlb_entry->addr_write,
+                       tlb_entry->addr_write | TLB_NOTDIRTY);
         }
     }
 }
@@ -266,9 +659,10 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 {
     CPUArchState *env;
 
-    int mmu_idx;
+    int mmu_idx, b;
 
     env = cpu->env_ptr;
+    qemu_mutex_lock(&cpu->tlb_bank_lock);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         unsigned int i;
 
@@ -282,6 +676,32 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                   start1, length);
         }
     }
+
+    /* the saved TLBs must not bypass the dirty tracking either */
+    for (b = 0; cpu->tlb_banks && b < CPU_TLB_BANKS; b++) {
+        CPUTLBBank *bank = &cpu->tlb_banks[b];
+
+        if (bank->asid < 0) {
+            continue;
+        }
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            unsigned int i;
+
+            for (i = 0; i < CPU_TLB_SIZE; i++) {
+                tlb_reset_dirty_range(&bank->tlb_table[mmu_idx][i],
+                                      start1, length);
+            }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&bank->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
+        }
+    }
+    qemu_mutex_unlock(&cpu->tlb_bank_lock);
+
+#ifdef TARGET_DIRECT_RAM_MMU_IDX
+    tlb_direct_ram_reset_dirty(env, start1, length);
+#endif
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
@@ -311,29 +731,54 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
             tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
         }
     }
+
+#ifdef TARGET_DIRECT_RAM_MMU_IDX
+    if (env->tlb_table[TARGET_DIRECT_RAM_MMU_IDX][i].addr_write == vaddr) {
+        tlb_direct_ram_set_dirty(env, vaddr +
+            env->tlb_table[TARGET_DIRECT_RAM_MMU_IDX][i].addend);
+    }
+#endif
 }
 
-/* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
+/* Our TLB does not support large pages, so remember the areas covered by
+   large pages and flush them as a whole if part of them is invalidated.  */
 static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
                                target_ulong size)
 {
     target_ulong mask = ~(size - 1);
-
-    if (env->tlb_flush_addr == (target_ulong)-1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
-        return;
+    target_ulong best_mask = 0;
+    int r, best = 0;
+
+    for (r = 0; r < CPU_TLB_LARGE_REGIONS; r++) {
+        if (env->tlb_flush_addr[r] != (target_ulong)-1 &&
+            (vaddr & env->tlb_flush_mask[r]) == env->tlb_flush_addr[r] &&
+            (env->tlb_flush_mask[r] & ~mask) == 0) {
+            return;
+        }
     }
-    /* Extend the existing region to include the new page.
+    for (r = 0; r < CPU_TLB_LARGE_REGIONS; r++) {
+        if (env->tlb_flush_addr[r] == (target_ulong)-1) {
+            env->tlb_flush_addr[r] = vaddr & mask;
+            env->tlb_flush_mask[r] = mask;
+            return;
+        }
+    }
+    /* Extend the region that grows least to include the new page.
        This is a compromise between unnecessary flushes and the cost
        of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
-        mask <<= 1;
+    for (r = 0; r < CPU_TLB_LARGE_REGIONS; r++) {
+        target_ulong m = mask & env->tlb_flush_mask[r];
+
+        while (((env->tlb_flush_addr[r] ^ vaddr) & m) != 0) {
+            m <<= 1;
+        }
+        if (r == 0 || m > best_mask) {
+            best = r;
+            best_mask = m;
+        }
     }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
+    env->tlb_flush_addr[best] &= best_mask;
+    env->tlb_flush_mask[best] = best_mask;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
@@ -397,6 +842,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     /* refill the tlb */
     env->iotlb[mmu_idx][index].addr = iotlb - vaddr;
     env->iotlb[mmu_idx][index].attrs = attrs;
+    env->iotlb[mmu_idx][index].global = (prot & PAGE_GLOBAL) != 0;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -420,6 +866,11 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
             te->addr_write = address | TLB_NOTDIRTY;
         } else {
             te->addr_write = address;
+#ifdef TARGET_DIRECT_RAM_MMU_IDX
+            if (address == vaddr) {
+                tlb_direct_ram_set_dirty(env, addend);
+            }
+#endif
         }
     } else {
         te->addr_write = -1;
@@ -588,6 +588,9 @@ static int cpu_get_free_index(Error **errp)
 
 void cpu_exec_exit(CPUState *cpu)
 {
+    g_free(cpu->tlb_banks);
+    cpu->tlb_banks = NULL;
+
     if (cpu->cpu_index == -1) {
         /* cpu_index was never allocated by this @cpu or was already freed. */
         return;
@@ -718,6 +721,7 @@ int cpu_watchpoint_insert(CPUState *cpu, vaddr addr, vaddr len,
     }
 
     tlb_flush_page(cpu, addr);
+    tlb_update_direct_ram(cpu);
 
     if (watchpoint)
         *watchpoint = wp;
@@ -746,6 +750,7 @@ void cpu_watchpoint_remove_by_ref(CPUState *cpu, CPUWatchpoint *watchpoint)
     QTAILQ_REMOVE(&cpu->watchpoints, watchpoint, entry);
 
     tlb_flush_page(cpu, watchpoint->vaddr);
+    tlb_update_direct_ram(cpu);
 
     g_free(watchpoint);
 }
@@ -1985,7 +1990,9 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_page_fast(ram_addr, size);
+        tb_unlock();
     }
     switch (size) {
     case 1:
@@ -2054,6 +2061,8 @@ static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
             wp->hitattrs = attrs;
             if (!cpu->watchpoint_hit) {
                 cpu->watchpoint_hit = wp;
+                /* both ways out longjmp to cpu_exec, which drops it */
+                tb_lock();
                 tb_check_watchpoint(cpu);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
                     cpu->exception_index = EXCP_DEBUG;
@@ -2344,6 +2353,7 @@ static void tcg_commit(MemoryListener *listener)
     d = atomic_rcu_read(&cpuas->as->dispatch);
     cpuas->memory_dispatch = d;
     tlb_flush(cpuas->cpu, 1);
+    tlb_update_direct_ram(cpuas->cpu);
 }
 
 void address_space_init_dispatch(AddressSpace *as)
@@ -2455,7 +2465,9 @@ static void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr,
             cpu_physical_memory_range_includes_clean(addr, length, dirty_log_mask);
     }
     if (dirty_log_mask & (1 << DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_range(addr, addr + length);
+        tb_unlock();
         dirty_log_mask &= ~(1 << DIRTY_MEMORY_CODE);
     }
     cpu_physical_memory_set_dirty_range(addr, length, dirty_log_mask);
@@ -302,6 +302,21 @@ STEXI
 @item info opcount
 @findex opcount
 Show dynamic compiler opcode counters
+ETEXI
+
+    {
+        .name       = "tb_profile",
+        .args_type  = "count:i?",
+        .params     = "[count]",
+        .help       = "show the most executed translation blocks",
+        .mhandler.cmd = hmp_info_tb_profile,
+    },
+
+STEXI
+@item info tb_profile [@var{count}]
+@findex tb_profile
+Show the @var{count} (default 20) most executed translation blocks, see
+@code{tb_profile}.
 ETEXI
 
     {
@@ -941,6 +941,57 @@ STEXI
 Continue an incoming migration using the @var{uri} (that has the same syntax
 as the -incoming option).
 
+ETEXI
+
+    {
+        .name       = "fork_server",
+        .args_type  = "path:s",
+        .params     = "path",
+        .help       = "stop the VM and fork a copy of it for each connection to a UNIX socket",
+        .mhandler.cmd = hmp_fork_server,
+    },
+
+STEXI
+@item fork_server @var{path}
+@findex fork_server
+Stop the VM and listen on the UNIX socket @var{path}.  Each client gets
+a new process forked from this one, resuming the VM.  The client sends
+one line of space separated @var{chardev}=@var{file} pairs to redirect
+the output of file based chardevs of its child, and
+netdev:@var{id}=@var{options} pairs to give its child a new backend for
+a netdev, and reads back its pid.
+ETEXI
+
+    {
+        .name       = "tb_profile",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "start or stop counting translation block executions",
+        .mhandler.cmd = hmp_tb_profile,
+    },
+
+STEXI
+@item tb_profile on|off
+@findex tb_profile
+Start or stop counting how many times each translation block runs.  Both
+discard the translated code, and with it the previous counts.  The
+profile also records the guest instruction count of each block, why its
+translation ended and whether its direct jumps are chained.  Use
+@code{info tb_profile} or @code{tb_profile_dump} to read it.
+ETEXI
+
+    {
+        .name       = "tb_profile_dump",
+        .args_type  = "filename:F",
+        .params     = "filename",
+        .help       = "write the translation block profile to a file",
+        .mhandler.cmd = hmp_tb_profile_dump,
+    },
+
+STEXI
+@item tb_profile_dump @var{filename}
+@findex tb_profile_dump
+Write the profile of all executed translation blocks to @var{filename}.
 ETEXI
 
     {
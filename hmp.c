@@ -1170,6 +1170,35 @@ void hmp_migrate_incoming(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_fork_server(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *path = qdict_get_str(qdict, "path");
+
+    qmp_x_fork_server(path, &err);
+
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_x_tb_profile(qdict_get_bool(qdict, "enable"), &err);
+
+    hmp_handle_error(mon, &err);
+}
+
+void hmp_tb_profile_dump(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    const char *filename = qdict_get_str(qdict, "filename");
+
+    qmp_x_tb_profile_dump(filename, &err);
+
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
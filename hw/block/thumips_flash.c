@@ -23,20 +23,63 @@
 #include "exec/address-spaces.h"
 #include "qemu/host-utils.h"
 #include "hw/sysbus.h"
+#include <sys/mman.h>
+
+/* In RAM backed mode, an image file is expanded once to the bus layout
+ * in a cache file next to it, which every instance maps; see
+ * flash_map_expanded().  A block backend cannot be mapped: the flash is
+ * then split in chunks of private RAM that are expanded from the image
+ * the first time they are read. */
+#define FLASH_CHUNK_SIZE (1024 * 1024)
+
+struct thumips_flash_state;
+
+struct thumips_flash_chunk {
+  struct thumips_flash_state *s;
+  uint32_t offset;
+  MemoryRegion mr;
+};
 
 struct thumips_flash_state {
   uint32_t base;
   uint32_t size;
-  uint8_t *data;
+  /* image source: a block backend, or a private mapping of a file */
+  BlockBackend *blk;
+  const uint8_t *data;
+  uint32_t data_len;
+  bool ram_backed;
+  int be;
   MemoryRegion *mr;
+  struct thumips_flash_chunk *chunks;
 };
 
 static struct thumips_flash_state flash_state;
 
+/* Copy len bytes of the (packed) image at offset, zero past its end */
+static void flash_fetch(struct thumips_flash_state *s, uint32_t offset,
+                        uint8_t *buf, uint32_t len)
+{
+  uint32_t avail = offset < s->data_len ? s->data_len - offset : 0;
+  if(avail > len)
+    avail = len;
+  memset(buf + avail, 0, len - avail);
+  if(!avail)
+    return;
+  if(s->blk){
+    if(blk_pread(s->blk, offset, buf, avail) < 0){
+      fprintf(stderr, "thumips_flash: failed to read image at 0x%x\n", offset);
+      memset(buf, 0, avail);
+    }
+  }else{
+    memcpy(buf, s->data + offset, avail);
+  }
+}
+
 static uint64_t flash_read(void *opaque, hwaddr offset,
                            unsigned size)
 {
   struct thumips_flash_state *s = (struct thumips_flash_state*)opaque;
+  uint8_t buf[2];
   if(size != 4){
     fprintf(stderr, "thumips_flash: must use lw!\n");
     return 0;
@@ -44,7 +87,8 @@ static uint64_t flash_read(void *opaque, hwaddr offset,
   size_t real_off = offset >> 1;
   // if(!(real_off & 0xfff))
   //   fprintf(stderr, "%s real_off=0x%zx\n", __func__, real_off);
-  return *(uint16_t*)(s->data + real_off);
+  flash_fetch(s, real_off, buf, 2);
+  return lduw_he_p(buf);
 }
 
 static void flash_write(void *opaque, hwaddr offset,
@@ -60,35 +104,208 @@ static const MemoryRegionOps flash_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
-void thumips_flash_init(uint32_t base, uint32_t size, const char *filename)
+/* Lay the image out the way the flash bus presents it: every 32-bit
+ * word carries one 16-bit half of the image in its low bits.  */
+static void flash_expand(uint8_t *dst, const uint8_t *src, uint32_t memsize,
+                         int be)
 {
-  FILE *f;
-  uint8_t *data = NULL;
-  uint32_t memsize = size / 2;
-  fprintf(stderr, "qemu-thumips: load ROM %s, base: 0x%08x, size: 0x%08x\n", filename, base, size);
-  data = (uint8_t*)g_malloc(memsize);
-  memset(data, 0, memsize);
-  flash_state.base = base;
-  flash_state.size = size;
-  flash_state.data = data;
-  
-  flash_state.mr = g_new(MemoryRegion, 1);
-  memory_region_init_io(flash_state.mr, NULL, &flash_ops, &flash_state, "thumips_flash", size);
-  memory_region_add_subregion(get_system_memory(), base, flash_state.mr);
+  uint32_t off;
+  for(off = 0; off < memsize; off += 2){
+    if(be)
+      stl_be_p(dst + off * 2, lduw_he_p(src + off));
+    else
+      stl_le_p(dst + off * 2, lduw_he_p(src + off));
+  }
+}
+
+/* First access to a chunk: fill its RAM and let further reads hit it
+ * directly. */
+static uint64_t flash_chunk_read(void *opaque, hwaddr offset,
+                                 unsigned size)
+{
+  struct thumips_flash_chunk *c = (struct thumips_flash_chunk*)opaque;
+  struct thumips_flash_state *s = c->s;
+  uint8_t *ram = memory_region_get_ram_ptr(&c->mr);
+  uint8_t *packed = g_malloc(FLASH_CHUNK_SIZE / 2);
+
+  flash_fetch(s, c->offset / 2, packed, FLASH_CHUNK_SIZE / 2);
+  flash_expand(ram, packed, FLASH_CHUNK_SIZE / 2, s->be);
+  g_free(packed);
+  memory_region_rom_device_set_romd(&c->mr, true);
+
+  ram += offset;
+  switch(size){
+  case 1:
+    return ldub_p(ram);
+  case 2:
+    return s->be ? lduw_be_p(ram) : lduw_le_p(ram);
+  default:
+    return s->be ? ldl_be_p(ram) : ldl_le_p(ram);
+  }
+}
+
+static const MemoryRegionOps flash_chunk_ops = {
+    .read = flash_chunk_read,
+    .write = flash_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
+/* Write the whole flash, expanded, to path; atomically, as other
+ * instances may be looking for it. */
+static bool flash_write_expanded(struct thumips_flash_state *s,
+                                 const char *path)
+{
+  char *tmp = g_strdup_printf("%s.XXXXXX", path);
+  uint8_t *packed = g_malloc(FLASH_CHUNK_SIZE / 2);
+  uint8_t *buf = g_malloc(FLASH_CHUNK_SIZE);
+  bool ok = false;
+  uint32_t off;
+  int fd;
 
-  f = fopen(filename, "rb");
-  if(!f){
+  fd = g_mkstemp(tmp);
+  if(fd < 0)
+    goto out;
+  if(fchmod(fd, 0644) < 0)
+    goto fail;
+  for(off = 0; off < s->size; off += FLASH_CHUNK_SIZE){
+    flash_fetch(s, off / 2, packed, FLASH_CHUNK_SIZE / 2);
+    flash_expand(buf, packed, FLASH_CHUNK_SIZE / 2, s->be);
+    if(qemu_write_full(fd, buf, FLASH_CHUNK_SIZE) != FLASH_CHUNK_SIZE)
+      goto fail;
+  }
+  if(rename(tmp, path) < 0)
+    goto fail;
+  ok = true;
+fail:
+  close(fd);
+  if(!ok)
+    unlink(tmp);
+out:
+  g_free(buf);
+  g_free(packed);
+  g_free(tmp);
+  return ok;
+}
+
+/* Map the expanded image of filename, as laid out on the bus, from its
+ * cache file, made first if missing or older than the image.  Pages are
+ * read in on demand and shared with the other instances through the
+ * page cache. */
+static bool flash_map_expanded(struct thumips_flash_state *s,
+                               const char *filename)
+{
+  char *path = g_strdup_printf("%s.flash-%s", filename, s->be ? "be" : "le");
+  struct stat st, cst;
+  bool ok = false;
+  void *p;
+  int fd;
+
+  if(stat(filename, &st) < 0)
+    goto out;
+  if(stat(path, &cst) < 0 || cst.st_size != s->size ||
+     cst.st_mtime < st.st_mtime){
+    if(!flash_write_expanded(s, path)){
+      fprintf(stderr, "qemu-thumips: cannot write %s\n", path);
+      goto out;
+    }
+  }
+  fd = qemu_open(path, O_RDONLY);
+  if(fd < 0)
+    goto out;
+  /* writable copy-on-write, for incoming migration */
+  p = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  qemu_close(fd);
+  if(p == MAP_FAILED)
+    goto out;
+  memory_region_init_ram_ptr(s->mr, NULL, "thumips_flash", s->size, p);
+  memory_region_set_readonly(s->mr, true);
+  vmstate_register_ram_global(s->mr);
+  ok = true;
+out:
+  g_free(path);
+  return ok;
+}
+
+static void flash_open_file(struct thumips_flash_state *s, const char *filename,
+                            uint32_t memsize)
+{
+  void *p;
+  int fd = qemu_open(filename, O_RDONLY);
+  if(fd < 0){
     perror("qemu-thumips: failed to read file");
     return;
   }
-  fseek(f, 0L, SEEK_END);
-  long sz = ftell(f);
-  fseek(f, 0L, SEEK_SET);
+  off_t sz = lseek(fd, 0, SEEK_END);
   if(sz > memsize){
+    fprintf(stderr, "qemu-thumips: Warning: %s is larger than %uKB\n",
+      filename, memsize>>10);
     sz = memsize;
-    fprintf(stderr, "qemu-thumips: Warning: %s is larger than %ldKB\n",
-      filename, sz>>10);
   }
-  sz = fread(data, sz, 1, f);
-  fclose(f);
+  if(sz > 0){
+    /* pages are read in on demand and shared with the page cache */
+    p = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p == MAP_FAILED){
+      perror("qemu-thumips: failed to map file");
+    }else{
+      s->data = p;
+      s->data_len = sz;
+    }
+  }
+  qemu_close(fd);
+}
+
+/* The image comes from blk if set, from filename otherwise; neither is
+ * read before the guest accesses the flash.  With ram_backed set, guest
+ * loads are served from RAM through the TLB instead of flash_read():
+ * a shared mapping of the expanded image for a file, see
+ * flash_map_expanded(), or ROM devices filled on first access for a
+ * block backend, whose writes still go to flash_write(). */
+void thumips_flash_init(uint32_t base, uint32_t size, BlockBackend *blk,
+                        const char *filename, bool ram_backed, int be)
+{
+  uint32_t memsize = size / 2;
+  uint32_t i;
+  fprintf(stderr, "qemu-thumips: load ROM %s, base: 0x%08x, size: 0x%08x%s\n",
+    blk ? blk_name(blk) : filename, base, size,
+    ram_backed ? " (ram backed)" : "");
+  flash_state.base = base;
+  flash_state.size = size;
+  flash_state.ram_backed = ram_backed;
+  flash_state.be = be;
+
+  if(blk){
+    int64_t sz = blk_getlength(blk);
+    flash_state.blk = blk;
+    flash_state.data_len = sz < 0 ? 0 : MIN(sz, memsize);
+  }else{
+    flash_open_file(&flash_state, filename, memsize);
+  }
+
+  flash_state.mr = g_new(MemoryRegion, 1);
+  if(ram_backed && !blk && flash_map_expanded(&flash_state, filename)){
+    /* the packed image is not needed any more */
+    if(flash_state.data)
+      munmap((void *)flash_state.data, flash_state.data_len);
+    flash_state.data = NULL;
+    flash_state.data_len = 0;
+  }else if(ram_backed){
+    uint32_t nb_chunks = DIV_ROUND_UP(size, FLASH_CHUNK_SIZE);
+    memory_region_init(flash_state.mr, NULL, "thumips_flash", size);
+    flash_state.chunks = g_new0(struct thumips_flash_chunk, nb_chunks);
+    for(i = 0; i < nb_chunks; i++){
+      struct thumips_flash_chunk *c = &flash_state.chunks[i];
+      char *name = g_strdup_printf("thumips_flash.%u", i);
+      c->s = &flash_state;
+      c->offset = i * FLASH_CHUNK_SIZE;
+      memory_region_init_rom_device(&c->mr, NULL, &flash_chunk_ops, c,
+        name, FLASH_CHUNK_SIZE, &error_fatal);
+      vmstate_register_ram_global(&c->mr);
+      memory_region_rom_device_set_romd(&c->mr, false);
+      memory_region_add_subregion(flash_state.mr, c->offset, &c->mr);
+      g_free(name);
+    }
+  }else{
+    memory_region_init_io(flash_state.mr, NULL, &flash_ops, &flash_state, "thumips_flash", size);
+  }
+  memory_region_add_subregion(get_system_memory(), base, flash_state.mr);
 }
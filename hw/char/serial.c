@@ -28,6 +28,7 @@
 #include "qemu/timer.h"
 #include "exec/address-spaces.h"
 #include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
 
 //#define DEBUG_SERIAL
 
@@ -269,6 +270,135 @@ static gboolean serial_xmit(GIOChannel *chan, GIOCondition cond, void *opaque)
     return FALSE;
 }
 
+/* In fast console mode, the bytes written to THR are gathered and written
+   to the chardev in blocks: at most SERIAL_FAST_TX_DELAY_MS after the
+   first one, when the buffer is full, or when the VM stops.  The
+   transmitter is idle for the guest unless the buffer is full and the
+   chardev is not taking it.  Nothing stays buffered once the VM is
+   stopped, so none of this is migrated.  */
+#define SERIAL_FAST_TX_SIZE 4096
+#define SERIAL_FAST_TX_DELAY_MS 10
+
+static void serial_fast_tx_flush(SerialState *s);
+
+static gboolean serial_fast_tx_watch(GIOChannel *chan, GIOCondition cond,
+                                     void *opaque)
+{
+    SerialState *s = opaque;
+
+    s->fast_tx_watch = 0;
+    serial_fast_tx_flush(s);
+    return FALSE;
+}
+
+static void serial_fast_tx_flush(SerialState *s)
+{
+    int ret;
+
+    timer_del(s->fast_tx_timer);
+    if (!s->fast_tx_len || s->fast_tx_watch) {
+        return;
+    }
+
+    ret = qemu_chr_fe_write(s->chr, s->fast_tx_buf, s->fast_tx_len);
+    if (ret > 0) {
+        s->fast_tx_len -= ret;
+        memmove(s->fast_tx_buf, s->fast_tx_buf + ret, s->fast_tx_len);
+        s->fast_tx_retry = 0;
+    }
+    if (s->fast_tx_len) {
+        if (s->fast_tx_retry < MAX_XMIT_RETRY) {
+            s->fast_tx_watch = qemu_chr_fe_add_watch(s->chr,
+                                                     G_IO_OUT | G_IO_HUP,
+                                                     serial_fast_tx_watch, s);
+        }
+        if (s->fast_tx_watch > 0) {
+            s->fast_tx_retry++;
+        } else {
+            /* Give up on what is left, as serial_xmit does */
+            s->fast_tx_watch = 0;
+            s->fast_tx_retry = 0;
+            s->fast_tx_len = 0;
+        }
+    }
+
+    /* A byte held back by a full buffer goes in now */
+    if (s->fast_tx_held && s->fast_tx_len < SERIAL_FAST_TX_SIZE) {
+        s->fast_tx_held = false;
+        s->fast_tx_buf[s->fast_tx_len++] = s->thr;
+        s->lsr |= UART_LSR_THRE | UART_LSR_TEMT;
+        s->thr_ipending = 1;
+        serial_update_irq(s);
+    }
+}
+
+/* Write out everything, the held byte included, waiting for the chardev
+   if need be: at exit, when the VM stops and before it is saved.  */
+static void serial_fast_tx_drain(SerialState *s)
+{
+    timer_del(s->fast_tx_timer);
+    if (s->fast_tx_watch) {
+        g_source_remove(s->fast_tx_watch);
+        s->fast_tx_watch = 0;
+    }
+    s->fast_tx_retry = 0;
+    if (s->fast_tx_len) {
+        qemu_chr_fe_write_all(s->chr, s->fast_tx_buf, s->fast_tx_len);
+        s->fast_tx_len = 0;
+    }
+    if (s->fast_tx_held) {
+        s->fast_tx_held = false;
+        qemu_chr_fe_write_all(s->chr, &s->thr, 1);
+        s->lsr |= UART_LSR_THRE | UART_LSR_TEMT;
+        s->thr_ipending = 1;
+        serial_update_irq(s);
+    }
+}
+
+static void serial_fast_tx_timer(void *opaque)
+{
+    serial_fast_tx_flush(opaque);
+}
+
+static void serial_fast_tx_exit(Notifier *n, void *data)
+{
+    SerialState *s = container_of(n, SerialState, fast_tx_exit);
+
+    serial_fast_tx_drain(s);
+}
+
+static void serial_fast_tx_vm_state_change(void *opaque, int running,
+                                           RunState state)
+{
+    if (!running) {
+        serial_fast_tx_drain(opaque);
+    }
+}
+
+static void serial_fast_tx(SerialState *s)
+{
+    if (s->fast_tx_len == SERIAL_FAST_TX_SIZE) {
+        /* The chardev has not taken the last block yet: keep the byte
+           in THR, the transmitter stays busy until there is room.  */
+        s->fast_tx_held = true;
+        s->thr_ipending = 0;
+        s->lsr &= ~(UART_LSR_THRE | UART_LSR_TEMT);
+        serial_update_irq(s);
+        return;
+    }
+    s->tsr = s->thr;
+    s->fast_tx_buf[s->fast_tx_len++] = s->tsr;
+    if (s->fast_tx_len == SERIAL_FAST_TX_SIZE) {
+        serial_fast_tx_flush(s);
+    } else if (!timer_pending(s->fast_tx_timer) && !s->fast_tx_watch) {
+        timer_mod(s->fast_tx_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                    SERIAL_FAST_TX_DELAY_MS);
+    }
+    if (!s->thr_ipending) {
+        s->thr_ipending = 1;
+        serial_update_irq(s);
+    }
+}
 
 /* Setter for FCR.
    is_load flag means, that value is set while loading VM state
@@ -315,6 +445,11 @@ static void serial_ioport_write_8250(void *opaque, hwaddr addr, uint64_t val,
             serial_update_parameters(s);
         } else {
             s->thr = (uint8_t) val;
+            if (s->fast_tx && !(s->mcr & UART_MCR_LOOP) &&
+                s->tsr_retry <= 0 && fifo8_is_empty(&s->xmit_fifo)) {
+                serial_fast_tx(s);
+                break;
+            }
             if(s->fcr & UART_FCR_FE) {
                 /* xmit overruns overwrite data, so make space if needed */
                 if (fifo8_is_full(&s->xmit_fifo)) {
@@ -661,6 +796,9 @@ static void serial_event(void *opaque, int event)
 static void serial_pre_save(void *opaque)
 {
     SerialState *s = opaque;
+    if (s->fast_tx) {
+        serial_fast_tx_drain(s);
+    }
     s->fcr_vmstate = s->fcr;
 }
 
@@ -869,6 +1007,7 @@ static void serial_reset_8250(void *opaque)
     s->mcr = UART_MCR_OUT2;
     s->scr = 0;
     s->tsr_retry = 0;
+    s->fast_tx_held = false;
     s->char_transmit_time = (get_ticks_per_sec() / 9600) * 10;
     s->poll_msl = 0;
 
@@ -919,6 +1058,21 @@ void serial_exit_core(SerialState *s)
     qemu_unregister_reset(serial_reset, s);
 }
 
+/* Batch the transmitted bytes, for consoles with a lot of output. */
+void serial_enable_fast_tx(SerialState *s)
+{
+    if (s->fast_tx) {
+        return;
+    }
+    s->fast_tx = true;
+    s->fast_tx_buf = g_malloc(SERIAL_FAST_TX_SIZE);
+    s->fast_tx_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                    serial_fast_tx_timer, s);
+    s->fast_tx_exit.notify = serial_fast_tx_exit;
+    qemu_add_exit_notifier(&s->fast_tx_exit);
+    qemu_add_vm_change_state_handler(serial_fast_tx_vm_state_change, s);
+}
+
 /* Change the main reference oscillator frequency. */
 void serial_set_frequency(SerialState *s, uint32_t frequency)
 {
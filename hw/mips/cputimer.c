@@ -24,6 +24,9 @@
 #include "hw/mips/cpudevs.h"
 #include "qemu/timer.h"
 #include "sysemu/kvm.h"
+#include "sysemu/sysemu.h"
+#include "qemu/host-utils.h"
+#include "qemu/main-loop.h"
 
 #define TIMER_PERIOD 10 /* 10 ns period for 100 Mhz frequency */
 
@@ -49,12 +52,25 @@ uint32_t cpu_mips_get_random (CPUMIPSState *env)
     return idx;
 }
 
+/* Stop the inlined Count reads, see cpu_mips_count_fast_start.  Unless
+   Count was changed, the next read still does not go below the values
+   they may have returned.  */
+static void cpu_mips_count_fast_stop(CPUMIPSState *env, bool changed)
+{
+    env->count_fast_limit = 0;
+    if (changed) {
+        env->count_fast_window = 0;
+    }
+}
+
 /* MIPS R4K timer */
 static void cpu_mips_timer_update(CPUMIPSState *env)
 {
     uint64_t now, next;
     uint32_t wait;
 
+    /* The deadline moves */
+    cpu_mips_count_fast_stop(env, false);
     now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
     wait = env->CP0_Compare - env->CP0_Count - (uint32_t)(now / TIMER_PERIOD);
     next = now + (uint64_t)wait * TIMER_PERIOD;
@@ -64,11 +80,112 @@ static void cpu_mips_timer_update(CPUMIPSState *env)
 /* Expire the timer.  */
 static void cpu_mips_timer_expire(CPUMIPSState *env)
 {
-    cpu_mips_timer_update(env);
+    /* Raise the interrupt first: re-arming the timer may warp the icount
+       clock, which must not happen while a halted CPU is about to wake. */
     if (env->insn_flags & ISA_MIPS32R2) {
         env->CP0_Cause |= 1 << CP0Ca_TI;
     }
     qemu_irq_raise(env->irq[(env->CP0_IntCtl >> CP0IntCtl_IPTI) & 0x7]);
+    cpu_mips_timer_update(env);
+}
+
+/* Without icount the virtual clock follows the host clock, which can be
+   slow to read.  Between reads of the real clock, at most COUNT_SYNC_NS
+   apart, Count reads extrapolate the virtual time from the host cycle
+   counter, at a rate calibrated against the real clock.  The real clock
+   is read again as soon as the timer would expire.  */
+#define COUNT_SYNC_NS 1000000
+
+static void cpu_mips_clock_sync(CPUMIPSState *env, int64_t now)
+{
+    int64_t ticks = cpu_get_host_ticks();
+    uint64_t lo, hi;
+
+    if (env->count_cal_ticks == 0 || ticks <= env->count_cal_ticks) {
+        env->count_cal_ns = now;
+        env->count_cal_ticks = ticks;
+    } else if (now - env->count_cal_ns >= COUNT_SYNC_NS) {
+        /* ns per tick, 32.32 fixed point */
+        lo = (uint64_t)(now - env->count_cal_ns) << 32;
+        hi = (uint64_t)(now - env->count_cal_ns) >> 32;
+        divu128(&lo, &hi, ticks - env->count_cal_ticks);
+        env->count_scale = lo;
+    }
+    env->count_sync_ns = now;
+    env->count_sync_ticks = ticks;
+    env->count_sync_limit = 0;
+    if (env->count_scale) {
+        env->count_sync_limit = ((uint64_t)COUNT_SYNC_NS << 32) /
+                                env->count_scale;
+    }
+}
+
+static int64_t cpu_mips_clock_ns(CPUMIPSState *env)
+{
+    int64_t now, ticks;
+
+    if (use_icount) {
+        return qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    }
+
+    ticks = cpu_get_host_ticks() - env->count_sync_ticks;
+    if (ticks >= 0 && ticks < env->count_sync_limit) {
+        now = env->count_sync_ns +
+              ((uint64_t)ticks * env->count_scale >> 32);
+        if ((uint64_t)now >= timer_expire_time_ns(env->timer)) {
+            now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            cpu_mips_clock_sync(env, now);
+        }
+    } else {
+        now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        cpu_mips_clock_sync(env, now);
+    }
+
+    /* An extrapolation slightly ahead of the real clock must not make
+       Count go backwards */
+    if (now < env->count_last_ns) {
+        now = env->count_last_ns;
+    }
+    env->count_last_ns = now;
+    return now;
+}
+
+static void cpu_mips_clock_vm_state_change(void *opaque, int running,
+                                           RunState state)
+{
+    CPUMIPSState *env = opaque;
+
+    /* The virtual clock stood still or was reloaded, start over */
+    if (running) {
+        cpu_mips_count_fast_stop(env, true);
+        env->count_sync_limit = 0;
+        env->count_cal_ticks = 0;
+        env->count_last_ns = 0;
+    }
+}
+
+/* The translator inlines Count reads for as long as a plain extrapolation
+   from the host cycle counter is good: until the real clock is due to be
+   read again and before Count reaches Compare.  count is the value just
+   read.  */
+static void cpu_mips_count_fast_start(CPUMIPSState *env, uint32_t count)
+{
+    uint64_t scale = env->count_scale / TIMER_PERIOD;
+    int64_t ticks = cpu_get_host_ticks();
+    int64_t limit;
+
+    cpu_mips_count_fast_stop(env, true);
+    limit = env->count_sync_ticks + env->count_sync_limit - ticks;
+    if (use_icount || scale == 0 || limit <= 0) {
+        return;
+    }
+    limit = MIN(limit, ((uint64_t)(uint32_t)(env->CP0_Compare - count) << 32)
+                       / scale);
+    env->count_fast_base = count;
+    env->count_fast_ticks = ticks;
+    env->count_fast_scale = scale;
+    env->count_fast_window = limit;
+    env->count_fast_limit = limit;
 }
 
 uint32_t cpu_mips_get_count (CPUMIPSState *env)
@@ -76,19 +193,71 @@ uint32_t cpu_mips_get_count (CPUMIPSState *env)
     if (env->CP0_Cause & (1 << CP0Ca_DC)) {
         return env->CP0_Count;
     } else {
-        uint64_t now;
+        uint64_t now, ticks;
+        uint32_t count, fast;
 
-        now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        /* Same as the inlined read */
+        ticks = cpu_get_host_ticks() - env->count_fast_ticks;
+        if (ticks < env->count_fast_limit) {
+            return env->count_fast_base +
+                   (uint32_t)(ticks * env->count_fast_scale >> 32);
+        }
+
+        now = cpu_mips_clock_ns(env);
         if (timer_pending(env->timer)
             && timer_expired(env->timer, now)) {
-            /* The timer has already expired.  */
+            /* The timer has already expired.  Count is read without the
+               global mutex by a vCPU with a thread of its own.  */
+            bool locked = qemu_mutex_iothread_locked();
+
+            if (!locked) {
+                qemu_mutex_lock_iothread();
+            }
             cpu_mips_timer_expire(env);
+            if (!locked) {
+                qemu_mutex_unlock_iothread();
+            }
         }
 
-        return env->CP0_Count + (uint32_t)(now / TIMER_PERIOD);
+        count = env->CP0_Count + (uint32_t)(now / TIMER_PERIOD);
+        if (env->count_fast_window) {
+            /* the inlined reads may have been a little ahead */
+            fast = env->count_fast_base +
+                   (uint32_t)(MIN(ticks, env->count_fast_window) *
+                              env->count_fast_scale >> 32);
+            if ((int32_t)(count - fast) < 0) {
+                count = fast;
+            }
+        }
+        cpu_mips_count_fast_start(env, count);
+        return count;
     }
 }
 
+/* CPU cycles, as counted by the performance counters */
+uint64_t cpu_mips_get_cycles(CPUMIPSState *env)
+{
+    int64_t now;
+
+    if (use_icount && !CPU(mips_env_get_cpu(env))->can_do_io) {
+        /* Only I/O instructions may read the clock, in between the
+           cycles seen by the counters stand still */
+        return env->perf_cycles;
+    }
+    if (env->timer) {
+        now = cpu_mips_clock_ns(env);
+    } else {
+        now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    }
+    env->perf_cycles = muldiv64(now, env->CCRes, TIMER_PERIOD);
+    return env->perf_cycles;
+}
+
+int64_t cpu_mips_cycles_to_ns(CPUMIPSState *env, uint64_t cycles)
+{
+    return muldiv64(cycles, TIMER_PERIOD, env->CCRes);
+}
+
 void cpu_mips_store_count (CPUMIPSState *env, uint32_t count)
 {
     /*
@@ -96,6 +265,7 @@ void cpu_mips_store_count (CPUMIPSState *env, uint32_t count)
      * So env->timer may be NULL, which is also the case with KVM enabled so
      * treat timer as disabled in that case.
      */
+    cpu_mips_count_fast_stop(env, true);
     if (env->CP0_Cause & (1 << CP0Ca_DC) || !env->timer)
         env->CP0_Count = count;
     else {
@@ -109,12 +279,18 @@ void cpu_mips_store_count (CPUMIPSState *env, uint32_t count)
 
 void cpu_mips_store_compare (CPUMIPSState *env, uint32_t value)
 {
+    int ipti = (env->CP0_IntCtl >> CP0IntCtl_IPTI) & 0x7;
+
     env->CP0_Compare = value;
     if (!(env->CP0_Cause & (1 << CP0Ca_DC)))
         cpu_mips_timer_update(env);
     if (env->insn_flags & ISA_MIPS32R2)
         env->CP0_Cause &= ~(1 << CP0Ca_TI);
-    qemu_irq_lower(env->irq[(env->CP0_IntCtl >> CP0IntCtl_IPTI) & 0x7]);
+    /* The performance counter interrupt may share the line */
+    if (!env->perf_irq ||
+        ipti != ((env->CP0_IntCtl >> CP0IntCtl_IPPC1) & 0x7)) {
+        qemu_irq_lower(env->irq[ipti]);
+    }
 }
 
 void cpu_mips_start_count(CPUMIPSState *env)
@@ -124,6 +300,7 @@ void cpu_mips_start_count(CPUMIPSState *env)
 
 void cpu_mips_stop_count(CPUMIPSState *env)
 {
+    cpu_mips_count_fast_stop(env, true);
     /* Store the current value */
     env->CP0_Count += (uint32_t)(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) /
                                  TIMER_PERIOD);
@@ -149,6 +326,13 @@ static void mips_timer_cb (void *opaque)
     env->CP0_Count--;
 }
 
+static void mips_idle_timer_cb(void *opaque)
+{
+    CPUMIPSState *env = opaque;
+
+    cpu_interrupt(CPU(mips_env_get_cpu(env)), CPU_INTERRUPT_WAKE);
+}
+
 void cpu_mips_clock_init (CPUMIPSState *env)
 {
     /*
@@ -157,5 +341,9 @@ void cpu_mips_clock_init (CPUMIPSState *env)
      */
     if (!kvm_enabled()) {
         env->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, &mips_timer_cb, env);
+        env->idle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                       &mips_idle_timer_cb, env);
+        qemu_add_vm_change_state_handler(cpu_mips_clock_vm_state_change,
+                                         env);
     }
 }
@@ -40,19 +40,99 @@
 #include "exec/address-spaces.h"
 #include "qemu/error-report.h"
 #include "sysemu/qtest.h"
+#include "sysemu/block-backend.h"
+#include "qapi/visitor.h"
+
+typedef struct {
+    MachineState parent;
+    bool direct_boot;
+    bool fast_console;
+    uint32_t virtio_mmio;
+} MipsSimMachineState;
+
+#define TYPE_MIPSSIM_MACHINE MACHINE_TYPE_NAME("mipssim")
+#define MIPSSIM_MACHINE(obj) \
+    OBJECT_CHECK(MipsSimMachineState, (obj), TYPE_MIPSSIM_MACHINE)
+
+/* Size of the argument block passed to a directly booted kernel */
+#define BOOT_PARAMS_SIZE 4096
+
+/* The virtio-mmio transports sit between the flash and the BIOS and
+   share the CPU interrupts left free by the other devices.  The kernel
+   learns about them from its command line, so they require direct
+   boot. */
+#define VIRTIO_MMIO_BASE 0x1f000000
+#define VIRTIO_MMIO_SIZE 0x200
+#define VIRTIO_MMIO_MAX 8
+#define VIRTIO_MMIO_DEFAULT 0
+static const int virtio_mmio_irqs[] = { 3, 5, 6 };
+
+/* With several CPUs, each has a block of registers past the virtio-mmio
+   transports to send it interprocessor interrupts, on its line 6 which
+   virtio-mmio gives up, and to start it: the secondary CPUs are held in
+   reset until their BOOT_PC is written.  */
+#define SMP_BASE 0x1f001000
+#define SMP_SIZE 0x20
+#define SMP_MAX_CPUS 8
+#define SMP_IPI_IRQ 6
+
+enum {
+    SMP_IPI_STATUS = 0x00,  /* pending IPI bits */
+    SMP_IPI_SET    = 0x04,  /* write 1s to raise */
+    SMP_IPI_CLEAR  = 0x08,  /* write 1s to acknowledge */
+    SMP_BOOT_ARG   = 0x0c,  /* passed in a0 to a started CPU */
+    SMP_BOOT_PC    = 0x10,  /* write to start a held CPU there */
+    SMP_NUM_CPUS   = 0x14,
+};
+
+typedef struct SMPCPUState {
+    MIPSCPU *cpu;
+    uint32_t ipi;
+    uint32_t boot_arg;
+    uint32_t boot_pc;
+    bool held;
+} SMPCPUState;
 
 static struct _loaderparams {
     int ram_size;
     const char *kernel_filename;
     const char *kernel_cmdline;
     const char *initrd_filename;
+    bool direct_boot;
+    /* kseg0 address of argv, set up by load_kernel for direct boot */
+    target_ulong argv_addr;
 } loaderparams;
 
 typedef struct ResetData {
     MIPSCPU *cpu;
     uint64_t vector;
+    SMPCPUState *smp;           /* NULL on a single CPU board */
 } ResetData;
 
+/* Build argv = { kernel, cmdline, NULL } at the physical address
+ * params_addr, the way a boot loader would hand it to the kernel. */
+static void write_boot_params(hwaddr params_addr, const char *cmdline)
+{
+    uint8_t *buf = g_malloc0(BOOT_PARAMS_SIZE);
+    uint32_t *argv = (uint32_t *)buf;
+    target_ulong base = cpu_mips_phys_to_kseg0(NULL, params_addr);
+    int kernel_off = 3 * sizeof(uint32_t);
+    int cmdline_off;
+
+    pstrcpy((char *)buf + kernel_off, 256, loaderparams.kernel_filename);
+    cmdline_off = kernel_off + strlen((char *)buf + kernel_off) + 1;
+    pstrcpy((char *)buf + cmdline_off, BOOT_PARAMS_SIZE - cmdline_off,
+            cmdline);
+
+    argv[0] = tswap32(base + kernel_off);
+    argv[1] = tswap32(base + cmdline_off);
+    argv[2] = 0;
+
+    rom_add_blob_fixed("params", buf, BOOT_PARAMS_SIZE, params_addr);
+    loaderparams.argv_addr = base;
+    g_free(buf);
+}
+
 static int64_t load_kernel(void)
 {
     int64_t entry, kernel_high;
@@ -102,6 +182,32 @@ static int64_t load_kernel(void)
             exit(1);
         }
     }
+
+    if (loaderparams.direct_boot) {
+        /* The arguments go in the first page past the kernel and the
+           initrd, which the kernel leaves alone until it parsed them. */
+        hwaddr params_addr = initrd_size > 0 ? initrd_offset + initrd_size
+                                             : kernel_high;
+        char *cmdline;
+
+        params_addr = TARGET_PAGE_ALIGN(params_addr);
+        if (params_addr + BOOT_PARAMS_SIZE > loaderparams.ram_size) {
+            fprintf(stderr, "qemu: memory too small for boot parameters\n");
+            exit(1);
+        }
+        if (initrd_size > 0) {
+            cmdline = g_strdup_printf("rd_start=0x" TARGET_FMT_lx
+                                      " rd_size=%li %s",
+                                      (target_ulong)cpu_mips_phys_to_kseg0(
+                                          NULL, initrd_offset),
+                                      initrd_size,
+                                      loaderparams.kernel_cmdline);
+        } else {
+            cmdline = g_strdup(loaderparams.kernel_cmdline);
+        }
+        write_boot_params(params_addr, cmdline);
+        g_free(cmdline);
+    }
     return entry;
 }
 
@@ -111,10 +217,28 @@ static void main_cpu_reset(void *opaque)
     CPUMIPSState *env = &s->cpu->env;
 
     cpu_reset(CPU(s->cpu));
+    if (s->smp) {
+        s->smp->ipi = 0;
+        s->smp->boot_arg = 0;
+        s->smp->boot_pc = 0;
+        s->smp->held = CPU(s->cpu)->cpu_index != 0;
+        if (s->smp->held) {
+            CPU(s->cpu)->halted = 1;
+            return;
+        }
+    }
     env->active_tc.PC = s->vector & ~(target_ulong)1;
     if (s->vector & 1) {
         env->hflags |= MIPS_HFLAG_M16;
     }
+
+    if (loaderparams.direct_boot) {
+        /* What the boot loader passes: argc, argv, envp, memory size */
+        env->active_tc.gpr[4] = 2;
+        env->active_tc.gpr[5] = (int32_t)loaderparams.argv_addr;
+        env->active_tc.gpr[6] = 0;
+        env->active_tc.gpr[7] = loaderparams.ram_size;
+    }
 }
 
 static void mipsnet_init(int base, qemu_irq irq, NICInfo *nd)
@@ -133,9 +257,128 @@ static void mipsnet_init(int base, qemu_irq irq, NICInfo *nd)
                                 sysbus_mmio_get_region(s, 0));
 }
 
+/* Several transports drive each CPU interrupt line: it is raised as long
+   as one of them is. */
+typedef struct IRQShare {
+    qemu_irq out;
+    uint32_t level;
+} IRQShare;
+
+static void irq_share_set(void *opaque, int n, int level)
+{
+    IRQShare *share = opaque;
+
+    if (level) {
+        share->level |= 1u << n;
+    } else {
+        share->level &= ~(1u << n);
+    }
+    qemu_set_irq(share->out, share->level != 0);
+}
+
+/* Create the transports and return the kernel arguments describing them,
+   for the virtio_mmio driver to probe. */
+static char *virtio_mmio_init(CPUMIPSState *env, int count, int nb_lines)
+{
+    qemu_irq *irqs[ARRAY_SIZE(virtio_mmio_irqs)];
+    GString *args = g_string_new(NULL);
+    int i;
+
+    if (count == 0) {
+        return g_string_free(args, false);
+    }
+    for (i = 0; i < nb_lines; i++) {
+        IRQShare *share = g_new0(IRQShare, 1);
+
+        share->out = env->irq[virtio_mmio_irqs[i]];
+        irqs[i] = qemu_allocate_irqs(irq_share_set, share,
+                                     DIV_ROUND_UP(VIRTIO_MMIO_MAX, nb_lines));
+    }
+
+    /* Each -device picks the free transport created last, so create them
+       from the top to hand them out in address order. */
+    for (i = count - 1; i >= 0; i--) {
+        hwaddr base = VIRTIO_MMIO_BASE + i * VIRTIO_MMIO_SIZE;
+
+        sysbus_create_simple("virtio-mmio", base,
+                             irqs[i % nb_lines][i / nb_lines]);
+    }
+    for (i = 0; i < count; i++) {
+        g_string_append_printf(args, " virtio_mmio.device=%d@0x%x:%d",
+                               VIRTIO_MMIO_SIZE,
+                               VIRTIO_MMIO_BASE + i * VIRTIO_MMIO_SIZE,
+                               virtio_mmio_irqs[i % nb_lines]);
+    }
+    return g_string_free(args, false);
+}
+
+static uint64_t smp_read(void *opaque, hwaddr addr, unsigned size)
+{
+    SMPCPUState *cpus = opaque;
+    SMPCPUState *s = &cpus[addr / SMP_SIZE];
+
+    switch (addr % SMP_SIZE) {
+    case SMP_IPI_STATUS:
+        return s->ipi;
+    case SMP_BOOT_ARG:
+        return s->boot_arg;
+    case SMP_BOOT_PC:
+        return s->boot_pc;
+    case SMP_NUM_CPUS:
+        return smp_cpus;
+    default:
+        return 0;
+    }
+}
+
+static void smp_write(void *opaque, hwaddr addr, uint64_t val, unsigned size)
+{
+    SMPCPUState *cpus = opaque;
+    SMPCPUState *s = &cpus[addr / SMP_SIZE];
+    CPUMIPSState *env = &s->cpu->env;
+
+    switch (addr % SMP_SIZE) {
+    case SMP_IPI_SET:
+        s->ipi |= val;
+        break;
+    case SMP_IPI_CLEAR:
+        s->ipi &= ~val;
+        break;
+    case SMP_BOOT_ARG:
+        s->boot_arg = val;
+        return;
+    case SMP_BOOT_PC:
+        s->boot_pc = val;
+        if (s->held) {
+            /* A held CPU does not run, its state can be set from here */
+            s->held = false;
+            env->active_tc.PC = (int32_t)val;
+            env->active_tc.gpr[4] = (int32_t)s->boot_arg;
+            smp_wmb();
+            CPU(s->cpu)->halted = 0;
+            qemu_cpu_kick(CPU(s->cpu));
+        }
+        return;
+    default:
+        return;
+    }
+    qemu_set_irq(env->irq[SMP_IPI_IRQ], s->ipi != 0);
+}
+
+static const MemoryRegionOps smp_ops = {
+    .read = smp_read,
+    .write = smp_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+};
+
 static void
 mips_mipssim_init(MachineState *machine)
 {
+    MipsSimMachineState *mms = MIPSSIM_MACHINE(machine);
     ram_addr_t ram_size = machine->ram_size;
     const char *cpu_model = machine->cpu_model;
     const char *kernel_filename = machine->kernel_filename;
@@ -149,8 +392,16 @@ mips_mipssim_init(MachineState *machine)
     MIPSCPU *cpu;
     CPUMIPSState *env;
     ResetData *reset_info;
+    SMPCPUState *smp = NULL;
     int bios_size;
     DriveInfo *dinfo;
+    char *virtio_args, *kernel_args;
+    int i;
+#ifdef TARGET_WORDS_BIGENDIAN
+    int be = 1;
+#else
+    int be = 0;
+#endif
 
     /* Init CPUs. */
     if (cpu_model == NULL) {
@@ -160,17 +411,33 @@ mips_mipssim_init(MachineState *machine)
         cpu_model = "24Kf";
 #endif
     }
-    cpu = cpu_mips_init(cpu_model);
-    if (cpu == NULL) {
-        fprintf(stderr, "Unable to find CPU definition\n");
-        exit(1);
+    if (smp_cpus > 1) {
+        smp = g_new0(SMPCPUState, smp_cpus);
     }
-    env = &cpu->env;
+    reset_info = g_new0(ResetData, smp_cpus);
+    for (i = 0; i < smp_cpus; i++) {
+        cpu = cpu_mips_init(cpu_model);
+        if (cpu == NULL) {
+            fprintf(stderr, "Unable to find CPU definition\n");
+            exit(1);
+        }
+        env = &cpu->env;
+
+        reset_info[i].cpu = cpu;
+        reset_info[i].vector = env->active_tc.PC;
+        if (smp) {
+            smp[i].cpu = cpu;
+            reset_info[i].smp = &smp[i];
+        }
+        qemu_register_reset(main_cpu_reset, &reset_info[i]);
 
-    reset_info = g_malloc0(sizeof(ResetData));
-    reset_info->cpu = cpu;
-    reset_info->vector = env->active_tc.PC;
-    qemu_register_reset(main_cpu_reset, reset_info);
+        /* Init CPU internal devices, each CPU has its own timer. */
+        cpu_mips_irq_init_cpu(env);
+        cpu_mips_clock_init(env);
+    }
+    /* The devices are wired to the first CPU */
+    cpu = reset_info->cpu;
+    env = &cpu->env;
 
     /* Allocate RAM. */
     memory_region_allocate_system_memory(ram, NULL, "mips_mipssim.ram",
@@ -194,6 +461,14 @@ mips_mipssim_init(MachineState *machine)
     } else {
         bios_size = -1;
     }
+    if (mms->direct_boot && !kernel_filename) {
+        error_report("direct-boot requires a -kernel argument");
+        exit(1);
+    }
+    if (mms->virtio_mmio && !mms->direct_boot) {
+        error_report("virtio-mmio requires direct-boot=on");
+        exit(1);
+    }
     if ((bios_size < 0 || bios_size > BIOS_SIZE) &&
         !kernel_filename && !qtest_enabled()) {
         /* Bail out if we have neither a kernel image nor boot vector code. */
@@ -205,17 +480,31 @@ mips_mipssim_init(MachineState *machine)
         env->active_tc.PC = (target_long)(int32_t)0xbfc00000;
     }
 
+    if (smp) {
+        MemoryRegion *smp_io = g_new(MemoryRegion, 1);
+
+        memory_region_init_io(smp_io, NULL, &smp_ops, smp, "mipssim.smp",
+                              smp_cpus * SMP_SIZE);
+        memory_region_add_subregion(address_space_mem, SMP_BASE, smp_io);
+        virtio_args = virtio_mmio_init(env, mms->virtio_mmio,
+                                       ARRAY_SIZE(virtio_mmio_irqs) - 1);
+    } else {
+        virtio_args = virtio_mmio_init(env, mms->virtio_mmio,
+                                       ARRAY_SIZE(virtio_mmio_irqs));
+    }
+
     if (kernel_filename) {
         loaderparams.ram_size = ram_size;
         loaderparams.kernel_filename = kernel_filename;
-        loaderparams.kernel_cmdline = kernel_cmdline;
+        kernel_args = g_strconcat(kernel_cmdline, virtio_args, NULL);
+        loaderparams.kernel_cmdline = kernel_args;
         loaderparams.initrd_filename = initrd_filename;
+        loaderparams.direct_boot = mms->direct_boot;
         reset_info->vector = load_kernel();
+        loaderparams.kernel_cmdline = NULL;
+        g_free(kernel_args);
     }
-
-    /* Init CPU internal devices. */
-    cpu_mips_irq_init_cpu(env);
-    cpu_mips_clock_init(env);
+    g_free(virtio_args);
 
     /* Register 64 KB of ISA IO space at 0x1fd00000. */
     memory_region_init_alias(isa, NULL, "isa_mmio",
@@ -224,33 +513,140 @@ mips_mipssim_init(MachineState *machine)
 
     /* A single 16450 sits at offset 0x3f8. It is attached to
        MIPS CPU INT2, which is interrupt 4. */
-    if (serial_hds[0])
-        serial_init(0x3f0, env->irq[4], 115200, serial_hds[0],
-                    get_system_io());
+    if (serial_hds[0]) {
+        SerialState *serial = serial_init(0x3f0, env->irq[4], 115200,
+                                          serial_hds[0], get_system_io());
+
+        if (mms->fast_console) {
+            serial_enable_fast_tx(serial);
+        }
+    }
 
     if (nd_table[0].used)
         /* MIPSnet uses the MIPS CPU INT0, which is interrupt 2. */
         mipsnet_init(0x4200, env->irq[2], &nd_table[0]);
 
+    /* The flash holds the kernel image.  It comes from -pflash if
+       given, from the historical default path otherwise. */
     dinfo = drive_get(IF_PFLASH, 0, 0);
+    thumips_flash_init(0x1E000000, 64*1024*1024/8 * 2,
+                       dinfo ? blk_by_legacy_dinfo(dinfo) : NULL,
+                       "../linux-naivemips/vmlinux", true, be);
+}
 
-    thumips_flash_init(0x1E000000, 64*1024*1024/8 * 2, "../linux-naivemips/vmlinux");
+static bool mips_mipssim_get_direct_boot(Object *obj, Error **errp)
+{
+    MipsSimMachineState *mms = MIPSSIM_MACHINE(obj);
 
-    /*
-    if (dinfo != NULL) {
-        if (!pflash_cfi01_register(0x1E000000, NULL, "thinpad.flash", 64*1024*1024/8,
-            blk_by_legacy_dinfo(dinfo), 
-            1024*1024/8, 64, 2, 0x11, 0x22,0x33,0x44,0 )) {
-            fprintf(stderr, "qemu: Error registering flash memory.\n");
-        }
+    return mms->direct_boot;
+}
+
+static void mips_mipssim_set_direct_boot(Object *obj, bool value,
+                                         Error **errp)
+{
+    MipsSimMachineState *mms = MIPSSIM_MACHINE(obj);
+
+    mms->direct_boot = value;
+}
+
+static bool mips_mipssim_get_fast_console(Object *obj, Error **errp)
+{
+    MipsSimMachineState *mms = MIPSSIM_MACHINE(obj);
+
+    return mms->fast_console;
+}
+
+static void mips_mipssim_set_fast_console(Object *obj, bool value,
+                                          Error **errp)
+{
+    MipsSimMachineState *mms = MIPSSIM_MACHINE(obj);
+
+    mms->fast_console = value;
+}
+
+static void mips_mipssim_get_virtio_mmio(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    MipsSimMachineState *mms = MIPSSIM_MACHINE(obj);
+    uint32_t value = mms->virtio_mmio;
+
+    visit_type_uint32(v, &value, name, errp);
+}
+
+static void mips_mipssim_set_virtio_mmio(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    MipsSimMachineState *mms = MIPSSIM_MACHINE(obj);
+    Error *error = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, &value, name, &error);
+    if (error) {
+        error_propagate(errp, error);
+        return;
+    }
+    if (value > VIRTIO_MMIO_MAX) {
+        error_setg(errp, "Machine option 'virtio-mmio=%" PRIu32
+                   "' expects at most %d transports", value, VIRTIO_MMIO_MAX);
+        return;
     }
-    */
+    mms->virtio_mmio = value;
+}
+
+static void mips_mipssim_instance_init(Object *obj)
+{
+    MipsSimMachineState *mms = MIPSSIM_MACHINE(obj);
+
+    mms->direct_boot = false;
+    mms->virtio_mmio = VIRTIO_MMIO_DEFAULT;
+    object_property_add(obj, "virtio-mmio", "uint32",
+                        mips_mipssim_get_virtio_mmio,
+                        mips_mipssim_set_virtio_mmio, NULL, NULL, NULL);
+    object_property_set_description(obj, "virtio-mmio",
+                                    "Number of virtio-mmio transports, "
+                                    "for -device virtio-*-device; needs "
+                                    "direct-boot=on, which describes them "
+                                    "on the kernel command line "
+                                    "(default: none)", NULL);
+    object_property_add_bool(obj, "direct-boot", mips_mipssim_get_direct_boot,
+                             mips_mipssim_set_direct_boot, NULL);
+    object_property_set_description(obj, "direct-boot",
+                                    "Set on to start the -kernel image at "
+                                    "its entry point with the boot arguments "
+                                    "in place, without firmware", NULL);
+
+    mms->fast_console = false;
+    object_property_add_bool(obj, "fast-console",
+                             mips_mipssim_get_fast_console,
+                             mips_mipssim_set_fast_console, NULL);
+    object_property_set_description(obj, "fast-console",
+                                    "Set on to write the serial output "
+                                    "in blocks instead of byte by byte",
+                                    NULL);
 }
 
-static void mips_mipssim_machine_init(MachineClass *mc)
+static void mips_mipssim_class_init(ObjectClass *oc, void *data)
 {
+    MachineClass *mc = MACHINE_CLASS(oc);
+
     mc->desc = "MIPS MIPSsim platform";
     mc->init = mips_mipssim_init;
+    mc->max_cpus = SMP_MAX_CPUS;
+}
+
+static const TypeInfo mips_mipssim_type = {
+    .name = TYPE_MIPSSIM_MACHINE,
+    .parent = TYPE_MACHINE,
+    .instance_size = sizeof(MipsSimMachineState),
+    .instance_init = mips_mipssim_instance_init,
+    .class_init = mips_mipssim_class_init,
+};
+
+static void mips_mipssim_machine_init(void)
+{
+    type_register_static(&mips_mipssim_type);
 }
 
-DEFINE_MACHINE("mipssim", mips_mipssim_machine_init)
+machine_init(mips_mipssim_machine_init)
@@ -2,6 +2,7 @@
 #include "net/net.h"
 #include "trace.h"
 #include "hw/sysbus.h"
+#include "exec/address-spaces.h"
 
 /* MIPSnet register offsets */
 
@@ -17,8 +18,41 @@
 #define MIPSNET_RX_DATA_BUFFER	0x1c
 #define MIPSNET_TX_DATA_BUFFER	0x20
 
+/* Burst extensions, all off after reset.  In wide mode, 32-bit accesses
+   to the data buffers move four bytes, the first one in the least
+   significant bits.  In ring mode, frames received while the guest still
+   reads one are queued, and RXDONE stays set while there is one to read.
+   In DMA mode, frames move through rings of descriptors in guest memory
+   instead of the data buffers. */
+#define MIPSNET_CONFIG		0x24
+# define MIPSNET_CONFIG_WIDE		0x00000001
+# define MIPSNET_CONFIG_RING		0x00000002
+# define MIPSNET_CONFIG_DMA		0x00000004
+#define MIPSNET_RX_PENDING	0x28
+#define MIPSNET_DMA_RX_BASE	0x2c
+#define MIPSNET_DMA_TX_BASE	0x30
+#define MIPSNET_DMA_SIZE	0x34
+#define MIPSNET_DMA_KICK	0x38
+# define MIPSNET_DMA_KICK_TX		0x00000001
+# define MIPSNET_DMA_KICK_RX		0x00000002
+
+#define MIPSNET_IO_SIZE		0x3c
+
+/* A DMA descriptor is two little endian words: the address of the
+   buffer, then its length and the OWN bit.  The guest sets OWN to hand
+   the descriptor to the device, which clears it when done, with the
+   length of the frame for a receive descriptor.  Writing DMA_SIZE, a
+   power of two, restarts both rings at their first descriptor. */
+#define MIPSNET_DESC_SIZE	8
+#define MIPSNET_DESC_LEN_MASK	0x0000ffff
+#define MIPSNET_DESC_OWN	0x80000000
+#define MIPSNET_DMA_MAX_SIZE	256
+
 #define MAX_ETH_FRAME_SIZE	1514
 
+/* Frames queued in ring mode besides the one being read */
+#define MIPSNET_RX_RING_SIZE	16
+
 #define TYPE_MIPS_NET "mipsnet"
 #define MIPS_NET(obj) OBJECT_CHECK(MIPSnetState, (obj), TYPE_MIPS_NET)
 
@@ -33,6 +67,16 @@ typedef struct MIPSnetState {
     uint32_t intctl;
     uint8_t rx_buffer[MAX_ETH_FRAME_SIZE];
     uint8_t tx_buffer[MAX_ETH_FRAME_SIZE];
+    uint32_t config;
+    uint32_t rx_pending;
+    uint32_t rx_ring_head;
+    uint32_t rx_ring_len[MIPSNET_RX_RING_SIZE];
+    uint8_t rx_ring[MIPSNET_RX_RING_SIZE * MAX_ETH_FRAME_SIZE];
+    uint32_t dma_rx_base;
+    uint32_t dma_tx_base;
+    uint32_t dma_size;
+    uint32_t dma_rx_index;
+    uint32_t dma_tx_index;
     MemoryRegion io;
     qemu_irq irq;
     NICState *nic;
@@ -49,6 +93,14 @@ static void mipsnet_reset(MIPSnetState *s)
     s->intctl = 0;
     memset(s->rx_buffer, 0, MAX_ETH_FRAME_SIZE);
     memset(s->tx_buffer, 0, MAX_ETH_FRAME_SIZE);
+    s->config = 0;
+    s->rx_pending = 0;
+    s->rx_ring_head = 0;
+    s->dma_rx_base = 0;
+    s->dma_tx_base = 0;
+    s->dma_size = 0;
+    s->dma_rx_index = 0;
+    s->dma_tx_index = 0;
 }
 
 static void mipsnet_update_irq(MIPSnetState *s)
@@ -65,15 +117,110 @@ static int mipsnet_buffer_full(MIPSnetState *s)
     return 0;
 }
 
+static void mipsnet_dma_read_desc(MIPSnetState *s, hwaddr base,
+                                  uint32_t index, uint32_t *addr,
+                                  uint32_t *ctl)
+{
+    uint8_t desc[MIPSNET_DESC_SIZE];
+
+    address_space_rw(&address_space_memory, base + index * MIPSNET_DESC_SIZE,
+                     MEMTXATTRS_UNSPECIFIED, desc, sizeof(desc), false);
+    *addr = ldl_le_p(desc);
+    *ctl = ldl_le_p(desc + 4);
+}
+
+static void mipsnet_dma_write_ctl(MIPSnetState *s, hwaddr base,
+                                  uint32_t index, uint32_t ctl)
+{
+    uint8_t buf[4];
+
+    stl_le_p(buf, ctl);
+    address_space_rw(&address_space_memory,
+                     base + index * MIPSNET_DESC_SIZE + 4,
+                     MEMTXATTRS_UNSPECIFIED, buf, sizeof(buf), true);
+}
+
+static int mipsnet_dma_rx_ready(MIPSnetState *s)
+{
+    uint32_t addr, ctl;
+
+    if (!s->dma_size) {
+        return 0;
+    }
+    mipsnet_dma_read_desc(s, s->dma_rx_base, s->dma_rx_index, &addr, &ctl);
+    return !!(ctl & MIPSNET_DESC_OWN);
+}
+
+static void mipsnet_dma_receive(MIPSnetState *s, const uint8_t *buf,
+                                size_t size)
+{
+    uint32_t addr, ctl;
+
+    mipsnet_dma_read_desc(s, s->dma_rx_base, s->dma_rx_index, &addr, &ctl);
+    size = MIN(size, ctl & MIPSNET_DESC_LEN_MASK);
+    address_space_rw(&address_space_memory, addr, MEMTXATTRS_UNSPECIFIED,
+                     (uint8_t *)buf, size, true);
+    mipsnet_dma_write_ctl(s, s->dma_rx_base, s->dma_rx_index, size);
+    s->dma_rx_index = (s->dma_rx_index + 1) & (s->dma_size - 1);
+}
+
+static void mipsnet_dma_transmit(MIPSnetState *s)
+{
+    uint32_t addr, ctl, size;
+    int sent = 0;
+
+    while (s->dma_size) {
+        mipsnet_dma_read_desc(s, s->dma_tx_base, s->dma_tx_index, &addr, &ctl);
+        if (!(ctl & MIPSNET_DESC_OWN)) {
+            break;
+        }
+        size = MIN(ctl & MIPSNET_DESC_LEN_MASK, MAX_ETH_FRAME_SIZE);
+        address_space_rw(&address_space_memory, addr, MEMTXATTRS_UNSPECIFIED,
+                         s->tx_buffer, size, false);
+        trace_mipsnet_send(size);
+        qemu_send_packet(qemu_get_queue(s->nic), s->tx_buffer, size);
+        mipsnet_dma_write_ctl(s, s->dma_tx_base, s->dma_tx_index, size);
+        s->dma_tx_index = (s->dma_tx_index + 1) & (s->dma_size - 1);
+        sent = 1;
+    }
+    if (sent) {
+        s->intctl |= MIPSNET_INTCTL_TXDONE;
+        mipsnet_update_irq(s);
+    }
+}
+
 static int mipsnet_can_receive(NetClientState *nc)
 {
     MIPSnetState *s = qemu_get_nic_opaque(nc);
 
+    if (s->config & MIPSNET_CONFIG_DMA) {
+        return mipsnet_dma_rx_ready(s);
+    }
+    if (s->config & MIPSNET_CONFIG_RING) {
+        return !s->rx_count || s->rx_pending < MIPSNET_RX_RING_SIZE;
+    }
     if (s->busy)
         return 0;
     return !mipsnet_buffer_full(s);
 }
 
+/* Move the next queued frame to the receive buffer, once the guest has
+   read the previous one. */
+static void mipsnet_rx_next(MIPSnetState *s)
+{
+    uint32_t head = s->rx_ring_head;
+
+    if (s->rx_count || !s->rx_pending) {
+        return;
+    }
+    memcpy(s->rx_buffer, s->rx_ring + head * MAX_ETH_FRAME_SIZE,
+           s->rx_ring_len[head]);
+    s->rx_count = s->rx_ring_len[head];
+    s->rx_read = 0;
+    s->rx_ring_head = (head + 1) % MIPSNET_RX_RING_SIZE;
+    s->rx_pending--;
+}
+
 static ssize_t mipsnet_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     MIPSnetState *s = qemu_get_nic_opaque(nc);
@@ -82,7 +229,27 @@ static ssize_t mipsnet_receive(NetClientState *nc, const uint8_t *buf, size_t si
     if (!mipsnet_can_receive(nc))
         return 0;
 
-    s->busy = 1;
+    if (s->config & MIPSNET_CONFIG_DMA) {
+        mipsnet_dma_receive(s, buf, size);
+        s->intctl |= MIPSNET_INTCTL_RXDONE;
+        mipsnet_update_irq(s);
+        return size;
+    }
+
+    size = MIN(size, MAX_ETH_FRAME_SIZE);
+    if (s->config & MIPSNET_CONFIG_RING) {
+        if (s->rx_count) {
+            uint32_t tail = (s->rx_ring_head + s->rx_pending) %
+                            MIPSNET_RX_RING_SIZE;
+
+            memcpy(s->rx_ring + tail * MAX_ETH_FRAME_SIZE, buf, size);
+            s->rx_ring_len[tail] = size;
+            s->rx_pending++;
+            return size;
+        }
+    } else {
+        s->busy = 1;
+    }
 
     /* Just accept everything. */
 
@@ -104,6 +271,7 @@ static uint64_t mipsnet_ioport_read(void *opaque, hwaddr addr,
 {
     MIPSnetState *s = opaque;
     int ret = 0;
+    int i, n;
 
     addr &= 0x3f;
     switch (addr) {
@@ -132,13 +300,33 @@ static uint64_t mipsnet_ioport_read(void *opaque, hwaddr addr,
         break;
     case MIPSNET_RX_DATA_BUFFER:
         if (s->rx_count) {
-            s->rx_count--;
-            ret = s->rx_buffer[s->rx_read++];
+            n = size == 4 && (s->config & MIPSNET_CONFIG_WIDE) ? 4 : 1;
+            n = MIN(n, s->rx_count);
+            for (i = 0; i < n; i++) {
+                ret |= s->rx_buffer[s->rx_read++] << (i * 8);
+            }
+            s->rx_count -= n;
+            mipsnet_rx_next(s);
             if (mipsnet_can_receive(s->nic->ncs)) {
                 qemu_flush_queued_packets(qemu_get_queue(s->nic));
             }
         }
         break;
+    case MIPSNET_CONFIG:
+        ret = s->config;
+        break;
+    case MIPSNET_RX_PENDING:
+        ret = s->rx_pending + !!s->rx_count;
+        break;
+    case MIPSNET_DMA_RX_BASE:
+        ret = s->dma_rx_base;
+        break;
+    case MIPSNET_DMA_TX_BASE:
+        ret = s->dma_tx_base;
+        break;
+    case MIPSNET_DMA_SIZE:
+        ret = s->dma_size;
+        break;
     /* Reads as zero. */
     case MIPSNET_TX_DATA_BUFFER:
     default:
@@ -152,6 +340,7 @@ static void mipsnet_ioport_write(void *opaque, hwaddr addr,
                                  uint64_t val, unsigned int size)
 {
     MIPSnetState *s = opaque;
+    int i, n;
 
     addr &= 0x3f;
     trace_mipsnet_write(addr, val);
@@ -171,6 +360,9 @@ static void mipsnet_ioport_write(void *opaque, hwaddr addr,
         } else if (!val) {
             /* ACK testbit interrupt, flag was cleared on read. */
         }
+        if ((s->config & MIPSNET_CONFIG_RING) && s->rx_count) {
+            s->intctl |= MIPSNET_INTCTL_RXDONE;
+        }
         s->busy = !!s->intctl;
         mipsnet_update_irq(s);
         if (mipsnet_can_receive(s->nic->ncs)) {
@@ -178,8 +370,11 @@ static void mipsnet_ioport_write(void *opaque, hwaddr addr,
         }
         break;
     case MIPSNET_TX_DATA_BUFFER:
-        s->tx_buffer[s->tx_written++] = val;
-        if (s->tx_written == s->tx_count) {
+        n = size == 4 && (s->config & MIPSNET_CONFIG_WIDE) ? 4 : 1;
+        for (i = 0; i < n && s->tx_written < s->tx_count; i++) {
+            s->tx_buffer[s->tx_written++] = val >> (i * 8);
+        }
+        if (s->tx_count && s->tx_written == s->tx_count) {
             /* Send buffer. */
             trace_mipsnet_send(s->tx_count);
             qemu_send_packet(qemu_get_queue(s->nic), s->tx_buffer, s->tx_count);
@@ -189,17 +384,100 @@ static void mipsnet_ioport_write(void *opaque, hwaddr addr,
             mipsnet_update_irq(s);
         }
         break;
+    case MIPSNET_CONFIG:
+        s->config = val & (MIPSNET_CONFIG_WIDE | MIPSNET_CONFIG_RING |
+                           MIPSNET_CONFIG_DMA);
+        if (!(s->config & MIPSNET_CONFIG_RING)) {
+            s->rx_pending = 0;
+        }
+        if (mipsnet_can_receive(s->nic->ncs)) {
+            qemu_flush_queued_packets(qemu_get_queue(s->nic));
+        }
+        break;
+    case MIPSNET_DMA_RX_BASE:
+        s->dma_rx_base = val;
+        break;
+    case MIPSNET_DMA_TX_BASE:
+        s->dma_tx_base = val;
+        break;
+    case MIPSNET_DMA_SIZE:
+        s->dma_size = is_power_of_2(val) && val <= MIPSNET_DMA_MAX_SIZE
+                      ? val : 0;
+        s->dma_rx_index = 0;
+        s->dma_tx_index = 0;
+        break;
+    case MIPSNET_DMA_KICK:
+        if (!(s->config & MIPSNET_CONFIG_DMA)) {
+            break;
+        }
+        if (val & MIPSNET_DMA_KICK_TX) {
+            mipsnet_dma_transmit(s);
+        }
+        if ((val & MIPSNET_DMA_KICK_RX) && mipsnet_can_receive(s->nic->ncs)) {
+            qemu_flush_queued_packets(qemu_get_queue(s->nic));
+        }
+        break;
     /* Read-only registers */
     case MIPSNET_DEV_ID:
     case MIPSNET_BUSY:
     case MIPSNET_RX_DATA_COUNT:
     case MIPSNET_INTERRUPT_INFO:
     case MIPSNET_RX_DATA_BUFFER:
+    case MIPSNET_RX_PENDING:
     default:
         break;
     }
 }
 
+static bool mipsnet_burst_needed(void *opaque)
+{
+    MIPSnetState *s = opaque;
+
+    return s->config != 0;
+}
+
+static int mipsnet_burst_post_load(void *opaque, int version_id)
+{
+    MIPSnetState *s = opaque;
+    int i;
+
+    if (s->rx_pending > MIPSNET_RX_RING_SIZE ||
+        s->rx_ring_head >= MIPSNET_RX_RING_SIZE ||
+        (s->dma_size && !is_power_of_2(s->dma_size)) ||
+        s->dma_size > MIPSNET_DMA_MAX_SIZE) {
+        return -EINVAL;
+    }
+    for (i = 0; i < MIPSNET_RX_RING_SIZE; i++) {
+        if (s->rx_ring_len[i] > MAX_ETH_FRAME_SIZE) {
+            return -EINVAL;
+        }
+    }
+    s->dma_rx_index &= s->dma_size - 1;
+    s->dma_tx_index &= s->dma_size - 1;
+    return 0;
+}
+
+static const VMStateDescription vmstate_mipsnet_burst = {
+    .name = "mipsnet/burst",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = mipsnet_burst_needed,
+    .post_load = mipsnet_burst_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(config, MIPSnetState),
+        VMSTATE_UINT32(rx_pending, MIPSnetState),
+        VMSTATE_UINT32(rx_ring_head, MIPSnetState),
+        VMSTATE_UINT32_ARRAY(rx_ring_len, MIPSnetState, MIPSNET_RX_RING_SIZE),
+        VMSTATE_BUFFER(rx_ring, MIPSnetState),
+        VMSTATE_UINT32(dma_rx_base, MIPSnetState),
+        VMSTATE_UINT32(dma_tx_base, MIPSnetState),
+        VMSTATE_UINT32(dma_size, MIPSnetState),
+        VMSTATE_UINT32(dma_rx_index, MIPSnetState),
+        VMSTATE_UINT32(dma_tx_index, MIPSnetState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_mipsnet = {
     .name = "mipsnet",
     .version_id = 0,
@@ -214,6 +492,10 @@ static const VMStateDescription vmstate_mipsnet = {
         VMSTATE_BUFFER(rx_buffer, MIPSnetState),
         VMSTATE_BUFFER(tx_buffer, MIPSnetState),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_mipsnet_burst,
+        NULL
     }
 };
 
@@ -236,7 +518,7 @@ static int mipsnet_sysbus_init(SysBusDevice *sbd)
     MIPSnetState *s = MIPS_NET(dev);
 
     memory_region_init_io(&s->io, OBJECT(dev), &mipsnet_ioport_ops, s,
-                          "mipsnet-io", 36);
+                          "mipsnet-io", MIPSNET_IO_SIZE);
     sysbus_init_mmio(sbd, &s->io);
     sysbus_init_irq(sbd, &s->irq);
 
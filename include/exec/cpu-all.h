@@ -199,6 +199,9 @@ extern intptr_t qemu_host_page_mask;
 /* FIXME: Code that sets/uses this is broken and needs to go away.  */
 #define PAGE_RESERVED  0x0020
 #endif
+/* softmmu: the mapping is shared by all address spaces, so it survives
+   tlb_flush(cpu, 0) and tlb_set_asid() */
+#define PAGE_GLOBAL    0x0040
 
 #if defined(CONFIG_USER_ONLY)
 void page_dump(FILE *f);
@@ -280,6 +283,8 @@ CPUArchState *cpu_copy(CPUArchState *env);
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf);
+void tb_profile_enable(CPUState *cpu, bool enable);
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int max);
 #endif /* !CONFIG_USER_ONLY */
 
 int cpu_memory_rw_debug(CPUState *cpu, target_ulong addr,
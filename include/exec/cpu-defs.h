@@ -59,6 +59,10 @@ typedef uint64_t target_ulong;
 #if !defined(CONFIG_USER_ONLY)
 /* use a fully associative victim tlb of 8 entries */
 #define CPU_VTLB_SIZE 8
+/* number of address spaces whose TLB is kept aside by tlb_set_asid */
+#define CPU_TLB_BANKS 8
+/* number of separately tracked regions mapped by large pages */
+#define CPU_TLB_LARGE_REGIONS 4
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -129,17 +133,46 @@ QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 typedef struct CPUIOTLBEntry {
     hwaddr addr;
     MemTxAttrs attrs;
+    bool global;                /* mapped with PAGE_GLOBAL */
 } CPUIOTLBEntry;
 
+/* Virtual addresses that a target maps linearly onto RAM in some MMU
+ * mode, such as the unmapped segments of MIPS, can be accessed by the
+ * generated code without a TLB lookup.  Such a target defines
+ * TARGET_DIRECT_RAM_MMU_IDX and has a CPUDirectRAM direct_ram in its
+ * CPUArchState, preserved across reset; see tlb_set_direct_ram.
+ *
+ * An address is in the range if (addr & mask) - base is below size, and
+ * then is at that offset from host.  A store also needs the byte of its
+ * page in dirty to be nonzero: then the page is dirty for all clients
+ * and holds no code, and the TLB would not catch the store either.
+ */
+typedef struct CPUDirectRAM {
+    target_ulong mask;
+    target_ulong base;
+    target_ulong size;          /* 0 when disabled */
+    uintptr_t host;
+    uint8_t *dirty;
+    /* requested by the target */
+    hwaddr paddr;
+    target_ulong max_size;
+} CPUDirectRAM;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
     CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
-    target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;                                        \
+    /* Regions covered by large pages, see tlb_add_large_page.  A free   \
+       region has an address of -1. */                                  \
+    target_ulong tlb_flush_addr[CPU_TLB_LARGE_REGIONS];                 \
+    target_ulong tlb_flush_mask[CPU_TLB_LARGE_REGIONS];                 \
     target_ulong vtlb_index;                                            \
+    /* Address space of the live TLB (-1 if unknown), the TLBs of       \
+       recently used address spaces are saved in CPUState::tlb_banks */ \
+    int tlb_asid;                                                       \
+    unsigned int tlb_bank_stamp;                                        \
 
 #else
 
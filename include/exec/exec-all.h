@@ -78,6 +78,7 @@ void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base, int flags,
                               int cflags);
+void *tb_lookup_tc_ptr(CPUState *cpu);
 void cpu_exec_init(CPUState *cpu, Error **errp);
 void QEMU_NORETURN cpu_loop_exit(CPUState *cpu);
 void QEMU_NORETURN cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc);
@@ -98,13 +99,11 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr);
 /**
  * tlb_flush:
  * @cpu: CPU whose TLB should be flushed
- * @flush_global: ignored
+ * @flush_global: whether entries marked global should be flushed too
  *
- * Flush the entire TLB for the specified CPU.
- * The flush_global flag is in theory an indicator of whether the whole
- * TLB should be flushed, or only those entries not marked global.
- * In practice QEMU does not implement any global/not global flag for
- * TLB entries, and the argument is ignored.
+ * Flush the entire TLB for the specified CPU.  If @flush_global is
+ * false, the entries added with PAGE_GLOBAL in their protection flags
+ * are kept.
  */
 void tlb_flush(CPUState *cpu, int flush_global);
 /**
@@ -126,6 +125,29 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...);
  * MMU indexes.
  */
 void tlb_flush_by_mmuidx(CPUState *cpu, ...);
+/**
+ * tlb_flush_range:
+ * @cpu: CPU whose TLB should be flushed
+ * @addr: virtual address of the start of the range
+ * @len: length of the range in bytes
+ *
+ * Flush the pages overlapping the range from the TLB of the specified
+ * CPU, for all MMU indexes.  Large ranges cost a single walk of the TLB
+ * instead of a tlb_flush_page() call per page.
+ */
+void tlb_flush_range(CPUState *cpu, target_ulong addr, target_ulong len);
+/**
+ * tlb_set_asid:
+ * @cpu: CPU whose TLB should be switched
+ * @asid: identifier of the new address space, or -1 if unknown
+ *
+ * Switch the TLB of the specified CPU to another address space.  The
+ * current contents are kept aside and restored when @asid is switched
+ * back to, as long as no flush got in between.  Only useful for targets
+ * whose TLB entries are tagged with an address space identifier; others
+ * just call tlb_flush().
+ */
+void tlb_set_asid(CPUState *cpu, int asid);
 void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
@@ -152,12 +174,21 @@ static inline void tlb_flush_page_by_mmuidx(CPUState *cpu,
 static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
 }
+
+static inline void tlb_flush_range(CPUState *cpu, target_ulong addr,
+                                   target_ulong len)
+{
+}
+
+static inline void tlb_set_asid(CPUState *cpu, int asid)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* Estimated block size for TB allocation.  */
 /* ??? The following is based on a 2015 survey of x86_64 host output.
@@ -190,11 +221,12 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_COUNT_HOT   0x80000 /* Count down hot_count, see tb_gen_superblock */
+#define CF_SUPERBLOCK  0x100000 /* Follow direct branches on the page */
+#define CF_INVALID     0x200000 /* Not in the physical hash table */
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* original tb when cflags has CF_NOCACHE */
     struct TranslationBlock *orig_tb;
     /* first and second physical page containing code. The lower bit
@@ -216,30 +248,96 @@ struct TranslationBlock {
        jmp_first */
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
+    /* bit n is set if jump n leaves the page but its target is mapped
+       the same way in every context, so that chaining it needs no
+       tracking (see tb_chain_jump) */
+    uint8_t jmp_fixed;
+
+    /* TB profiler data, see tb_profile_enable */
+    uint8_t end_reason;         /* TB_END_*, why translation stopped */
+    uint64_t exec_count;        /* only counted while profiling */
+    /* executions left before the TB is made a superblock */
+    uint32_t hot_count;
+
+    /* hash of the guest code, for the persistent translation cache */
+    uint64_t src_hash;
+};
+
+/* Reasons for the translator to end a TB, for the TB profiler */
+enum {
+    TB_END_UNKNOWN,             /* not recorded by the target */
+    TB_END_BRANCH,              /* branch or jump */
+    TB_END_PAGE,                /* next insn is on another page */
+    TB_END_FULL,                /* TCG op buffer full */
+    TB_END_MAX_INSNS,           /* insn count limit, e.g. for icount */
+    TB_END_IO,                  /* last insn may do I/O (CF_LAST_IO) */
+    TB_END_STOP,                /* CPU state change, e.g. CP0 write */
+    TB_END_EXCP,                /* exception, syscall, eret, wait */
+    TB_END_DEBUG,               /* single-stepping or breakpoint */
+    TB_END_NB
 };
 
 #include "qemu/thread.h"
+#include "qemu/qht.h"
 
 typedef struct TBContext TBContext;
 
+/* maximum number of tracked cross page jumps; beyond that, they are not
+   chained */
+#define TB_CROSS_PAGE_JMPS 512
+
+typedef struct TBCrossPageJump {
+    TranslationBlock *tb;
+    int n;
+    target_ulong page;          /* virtual page of the destination */
+} TBCrossPageJump;
+
+/* maximum number of regions the code buffer and the TBs are split in,
+   see tb_evict_region */
+#define TB_REGIONS 8
+
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* the valid TBs, by tb_hash_func of their physical address */
+    struct qht htable;
     int nb_tbs;
+    /* code regions: TBs and bytes of code used in each, the current
+       region's code ends at code_gen_ptr instead */
+    int nb_regions;
+    int region_max_tbs;
+    int cur_region;
+    int region_nb_tbs[TB_REGIONS];
+    size_t region_code_size[TB_REGIONS];
+    /* jumps chained to a TB on another virtual page; they are only
+       valid as long as that page keeps its mapping */
+    TBCrossPageJump cross_page_jmps[TB_CROSS_PAGE_JMPS];
+    int nb_cross_page_jmps;
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_evict_count;
+    int tb_evicted_count;
     int tb_phys_invalidate_count;
+    int superblock_count;
 
     int tb_invalidated_flag;
+
+    /* generate code counting TB executions */
+    bool profile;
 };
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
+bool tb_flush_pending(void);
+void tb_flush_exclusive(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+void tb_chain_jump(TranslationBlock *tb, int n, TranslationBlock *tb_next);
+void tb_gen_superblock(CPUState *cpu, TranslationBlock *tb);
+int64_t tb_hotness(CPUState *cpu, target_ulong pc, target_ulong cs_base,
+                   uint64_t flags);
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -256,8 +354,9 @@ void ppc_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr);
 #elif defined(__i386__) || defined(__x86_64__)
 static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
 {
-    /* patch the branch destination */
-    stl_le_p((void*)jmp_addr, addr - (jmp_addr + 4));
+    /* patch the branch destination, which other vCPU threads may be
+       executing: the displacement is aligned, see tcg_out_op */
+    atomic_set((int32_t *)jmp_addr, addr - (jmp_addr + 4));
     /* no need to flush icache explicitly */
 }
 #elif defined(__s390x__)
@@ -381,9 +480,15 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
 
 void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length);
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr);
+void tlb_update_direct_ram(CPUState *cpu);
+#ifdef TARGET_DIRECT_RAM_MMU_IDX
+void tlb_set_direct_ram(CPUState *cpu, target_ulong mask, target_ulong base,
+                        hwaddr paddr, target_ulong size);
+#endif
 
 /* exec.c */
 void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr);
+void tb_reset_cross_page_jumps(target_ulong start, target_ulong last);
 
 MemoryRegionSection *
 address_space_translate_for_iotlb(CPUState *cpu, hwaddr addr, hwaddr *xlat,
@@ -21,6 +21,30 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tcg_ctx.tb_ctx.profile) {
+        TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+        TCGv_i64 execs = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(execs, ptr, 0);
+        tcg_gen_addi_i64(execs, execs, 1);
+        tcg_gen_st_i64(execs, ptr, 0);
+        tcg_temp_free_i64(execs);
+        tcg_temp_free_ptr(ptr);
+    }
+
+    if (tb->cflags & CF_COUNT_HOT) {
+        TCGv_ptr ptr = tcg_const_ptr(&tb->hot_count);
+        TCGv_i32 left = tcg_temp_new_i32();
+
+        /* Back to cpu_exec when it reaches zero, see tb_gen_superblock */
+        tcg_gen_ld_i32(left, ptr, 0);
+        tcg_gen_subi_i32(left, left, 1);
+        tcg_gen_st_i32(left, ptr, 0);
+        tcg_gen_brcondi_i32(TCG_COND_EQ, left, 0, exitreq_label);
+        tcg_temp_free_i32(left);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
     }
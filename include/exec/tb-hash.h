@@ -43,9 +43,24 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
            | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* Hash of a TB in tb_ctx.htable: everything but the physical address
+   goes in too, so the TBs for the same code in other modes do not end
+   up in the same bucket.  */
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags, target_ulong cs_base)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h = phys_pc;
+
+    h = h * 0x9e3779b97f4a7c15ULL + pc;
+    h = h * 0x9e3779b97f4a7c15ULL + flags;
+    h = h * 0x9e3779b97f4a7c15ULL + cs_base;
+    /* final mix of MurmurHash3: each bit of h affects all the others */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
 #endif
@@ -29,6 +29,10 @@ pflash_t *pflash_cfi02_register(hwaddr base,
 
 MemoryRegion *pflash_cfi01_get_memory(pflash_t *fl);
 
+/* thumips_flash.c */
+void thumips_flash_init(uint32_t base, uint32_t size, BlockBackend *blk,
+                        const char *filename, bool ram_backed, int be);
+
 /* nand.c */
 DeviceState *nand_init(BlockBackend *blk, int manf_id, int chip_id);
 void nand_setpins(DeviceState *dev, uint8_t cle, uint8_t ale,
@@ -73,6 +73,16 @@ struct SerialState {
 
     QEMUTimer *modem_status_poll;
     MemoryRegion io;
+
+    /* fast console mode, see serial_enable_fast_tx */
+    bool fast_tx;
+    uint8_t *fast_tx_buf;
+    int fast_tx_len;
+    guint fast_tx_watch;            /* retrying the chardev write */
+    int fast_tx_retry;
+    bool fast_tx_held;              /* THR waits for room in the buffer */
+    QEMUTimer *fast_tx_timer;
+    Notifier fast_tx_exit;
 };
 
 extern const VMStateDescription vmstate_serial;
@@ -81,6 +91,7 @@ extern const MemoryRegionOps serial_io_ops;
 void serial_realize_core(SerialState *s, Error **errp);
 void serial_exit_core(SerialState *s);
 void serial_set_frequency(SerialState *s, uint32_t frequency);
+void serial_enable_fast_tx(SerialState *s);
 
 /* legacy pre qom */
 SerialState *serial_init(int base, qemu_irq irq, int baudbase,
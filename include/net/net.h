@@ -194,6 +194,8 @@ void hmp_host_net_add(Monitor *mon, const QDict *qdict);
 void hmp_host_net_remove(Monitor *mon, const QDict *qdict);
 void netdev_add(QemuOpts *opts, Error **errp);
 void qmp_netdev_add(QDict *qdict, QObject **ret, Error **errp);
+void netdev_replace_after_fork(const char *id, const char *optstr,
+                               Error **errp);
 
 int net_hub_id_for_client(NetClientState *nc, int *id);
 NetClientState *net_hub_port_find(int hub_id);
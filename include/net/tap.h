@@ -34,6 +34,7 @@ int tap_enable(NetClientState *nc);
 int tap_disable(NetClientState *nc);
 
 int tap_get_fd(NetClientState *nc);
+void tap_forget_down_script(NetClientState *nc);
 
 struct vhost_net;
 struct vhost_net *tap_get_vhost_net(NetClientState *nc);
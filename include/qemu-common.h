@@ -328,6 +328,10 @@ typedef struct PCIHostDeviceAddress {
 
 void tcg_exec_init(unsigned long tb_size);
 bool tcg_enabled(void);
+extern const char *tb_cache_path;
+extern unsigned int tb_superblock_threshold;
+void tb_cache_load(void);
+void tb_cache_save(void);
 
 void cpu_exec_init_all(void);
 
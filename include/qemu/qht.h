@@ -0,0 +1,82 @@
+/*
+ * Scalable hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "qemu/thread.h"
+
+struct qht_map;
+
+/*
+ * A hash table of pointers, with the hash of each pointer supplied by the
+ * caller.  Each head bucket fills a cache line and holds a few entries,
+ * further entries go to buckets chained to it.
+ *
+ * Lookups take no lock: they run in an RCU read-side critical section,
+ * and retry when a writer changed the bucket meanwhile, which the
+ * sequence number of the head bucket tells.  Insertions and removals
+ * only lock the head bucket of their hash.  With QHT_MODE_AUTO_RESIZE,
+ * the table doubles its number of head buckets when too many buckets had
+ * to be chained; the old buckets are freed once no lookup can use them.
+ */
+struct qht {
+    struct qht_map *map;
+    QemuMutex lock;             /* serializes the changes of map */
+    unsigned int mode;
+    unsigned int resizes;
+};
+
+#define QHT_MODE_AUTO_RESIZE 0x1
+
+struct qht_stats {
+    size_t head_buckets;
+    size_t used_head_buckets;   /* with at least one entry */
+    size_t entries;
+    size_t chain_buckets;       /* head and chained buckets with entries */
+    size_t max_chain;           /* buckets with entries in a chain */
+    unsigned int resizes;
+};
+
+/* Return true if obj is the one looked up, described by userp */
+typedef bool (*qht_lookup_func_t)(const void *obj, const void *userp);
+typedef void (*qht_iter_func_t)(struct qht *ht, void *p, uint32_t hash,
+                                void *userp);
+
+/* Make a table sized for n_elems entries */
+void qht_init(struct qht *ht, size_t n_elems, unsigned int mode);
+void qht_destroy(struct qht *ht);
+
+/* Insert p, not NULL.  Return false if p is already in the table.  */
+bool qht_insert(struct qht *ht, void *p, uint32_t hash);
+
+/* Return the entry with this hash that func accepts, or NULL.  Must be
+   called in an RCU read-side critical section, which func may leave with
+   a longjmp: the lookup holds no lock.  */
+void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash);
+
+/* Remove p.  Return false if p was not in the table.  */
+bool qht_remove(struct qht *ht, const void *p, uint32_t hash);
+
+/* Remove all the entries; qht_reset_size also sizes the table for
+   n_elems entries */
+void qht_reset(struct qht *ht);
+void qht_reset_size(struct qht *ht, size_t n_elems);
+
+/* Size the table for n_elems entries, keeping the entries */
+void qht_resize(struct qht *ht, size_t n_elems);
+
+/* Call func on each entry, with insertions and removals held off.  func
+   must not change the table.  */
+void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp);
+
+void qht_statistics(struct qht *ht, struct qht_stats *stats);
+
+#endif /* QEMU_QHT_H */
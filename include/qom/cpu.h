@@ -240,6 +240,10 @@ struct kvm_run;
  *      only have a single AddressSpace
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
  * @current_tb: Currently executing TB.
+ * @tlb_banks: Saved TLBs of other address spaces, allocated on first use
+ *             and kept across resets; see tlb_set_asid.
+ * @tlb_bank_lock: Lock to keep tlb_reset_dirty from other threads out of
+ *                 tlb_set_asid while it saves and restores banks.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -290,6 +294,8 @@ struct CPUState {
     void *env_ptr; /* CPUArchState */
     struct TranslationBlock *current_tb;
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    struct CPUTLBBank *tlb_banks;
+    QemuMutex tlb_bank_lock;
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -348,6 +354,20 @@ extern struct CPUTailQ cpus;
 
 extern __thread CPUState *current_cpu;
 
+/**
+ * qemu_tcg_mttcg_enabled:
+ * Check whether we are running with a host thread per TCG vCPU,
+ * see -tcg-threads.
+ *
+ * Returns: %true if each vCPU runs in its own thread, %false otherwise.
+ */
+#ifdef CONFIG_USER_ONLY
+#define qemu_tcg_mttcg_enabled() false
+#else
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+#endif
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
@@ -349,6 +349,9 @@ void qemu_chr_accept_input(CharDriverState *s);
 int qemu_chr_add_client(CharDriverState *s, int fd);
 CharDriverState *qemu_chr_find(const char *name);
 bool chr_is_ringbuf(const CharDriverState *chr);
+void qemu_chr_detach_after_fork(void);
+void qemu_chr_redirect_output(CharDriverState *chr, const char *path,
+                              Error **errp);
 
 QemuOpts *qemu_chr_parse_compat(const char *label, const char *filename);
 
@@ -0,0 +1,256 @@
+/*
+ * Fork server: serve copy-on-write copies of a stopped VM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "block/block.h"
+#include "block/thread-pool.h"
+#include "net/net.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/sockets.h"
+#include "exec/cpu-common.h"
+#include "migration/migration.h"
+#include "sysemu/block-backend.h"
+#include "sysemu/char.h"
+#include "sysemu/cpus.h"
+#include "sysemu/kvm.h"
+#include "sysemu/sysemu.h"
+#include "qmp-commands.h"
+
+/*
+ * Once started, the VM stays stopped in this process.  Each connection
+ * to the listening socket forks a child that resumes the VM; RAM and
+ * device state are shared copy-on-write, so starting a child costs no
+ * more than copying the page tables.
+ *
+ * The client sends a single line of space separated requests:
+ *  - "chardev=path" makes a file based chardev of the child write to path;
+ *  - "netdev:id=options" gives the child a backend of its own for the
+ *    netdev id, made from the -netdev options, e.g.
+ *    netdev:net0=tap,ifname=tap5,script=no,downscript=no.  The other
+ *    network backends stay shared with the parent.
+ * The reply is the pid of the child, or -1.  The child drops the
+ * sockets and input descriptors it inherited from the parent, so it has
+ * no monitor.
+ *
+ * The block backends are shared as well, and the children must not all
+ * write to the same image: each child reopens the writable ones
+ * read-only and puts a temporary qcow2 overlay of its own on top.  This
+ * includes the overlays of snapshot=on drives.
+ *
+ * Only the thread calling fork() lives on in the child.  The children
+ * start the vCPU, RCU and thread pool threads again, but iothreads and
+ * the threads of other host backends are gone; devices must not depend
+ * on them.
+ */
+
+#define FORK_REQUEST_MAX 4096
+
+typedef struct ForkClient {
+    int fd;
+    size_t len;
+    char buf[FORK_REQUEST_MAX];
+    QLIST_ENTRY(ForkClient) next;
+} ForkClient;
+
+static int fork_server_fd = -1;
+static QLIST_HEAD(, ForkClient) fork_clients =
+    QLIST_HEAD_INITIALIZER(fork_clients);
+
+#ifndef _WIN32
+static void fork_client_close(ForkClient *c)
+{
+    qemu_set_fd_handler(c->fd, NULL, NULL, NULL);
+    closesocket(c->fd);
+    QLIST_REMOVE(c, next);
+    g_free(c);
+}
+
+/* Give the child a private overlay on top of each writable drive */
+static void fork_child_snapshot_drives(void)
+{
+    BlockBackend *blk = NULL;
+    Error *err = NULL;
+
+    while ((blk = blk_next(blk))) {
+        BlockDriverState *bs = blk_bs(blk);
+        int flags;
+
+        if (!bs || bdrv_is_read_only(bs)) {
+            continue;
+        }
+        flags = bdrv_get_flags(bs);
+        if (bdrv_reopen(bs, flags & ~BDRV_O_RDWR, &err) < 0 ||
+            bdrv_append_temp_snapshot(bs, (flags | BDRV_O_TEMPORARY) &
+                                          ~BDRV_O_SNAPSHOT, &err) < 0) {
+            error_report("fork-server: cannot snapshot drive '%s': %s",
+                         blk_name(blk), error_get_pretty(err));
+            exit(1);
+        }
+    }
+}
+
+static void fork_child_setup(char *request)
+{
+    char *p, *tok, *saveptr = NULL;
+    Error *err = NULL;
+
+    rcu_after_fork();
+    thread_pool_after_fork(aio_get_thread_pool(qemu_get_aio_context()));
+    qemu_chr_detach_after_fork();
+    fork_child_snapshot_drives();
+
+    for (p = request; (tok = strtok_r(p, " \t", &saveptr)); p = NULL) {
+        char *path = strchr(tok, '=');
+        CharDriverState *chr;
+
+        if (!path) {
+            error_report("fork-server: invalid request '%s'", tok);
+            continue;
+        }
+        *path++ = '\0';
+        if (strstart(tok, "netdev:", NULL)) {
+            netdev_replace_after_fork(tok + strlen("netdev:"), path, &err);
+            if (err) {
+                error_report_err(err);
+                err = NULL;
+            }
+            continue;
+        }
+        chr = qemu_chr_find(tok);
+        if (!chr) {
+            error_report("fork-server: chardev '%s' not found", tok);
+            continue;
+        }
+        qemu_chr_redirect_output(chr, path, &err);
+        if (err) {
+            error_report_err(err);
+            err = NULL;
+        }
+    }
+
+    qemu_cpus_after_fork();
+    vm_start();
+}
+
+static void fork_client_read(void *opaque)
+{
+    ForkClient *c = opaque;
+    char request[FORK_REQUEST_MAX];
+    char reply[32];
+    char *eol;
+    ssize_t n;
+    pid_t pid;
+
+    n = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (n <= 0) {
+        fork_client_close(c);
+        return;
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+    eol = strchr(c->buf, '\n');
+    if (!eol) {
+        if (c->len == sizeof(c->buf) - 1) {
+            error_report("fork-server: request too long");
+            fork_client_close(c);
+        }
+        return;
+    }
+    *eol = '\0';
+    pstrcpy(request, sizeof(request), c->buf);
+
+    /* reap the children that are done */
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        ForkClient *next;
+
+        QLIST_FOREACH_SAFE(c, &fork_clients, next, next) {
+            fork_client_close(c);
+        }
+        qemu_set_fd_handler(fork_server_fd, NULL, NULL, NULL);
+        closesocket(fork_server_fd);
+        fork_server_fd = -1;
+        fork_child_setup(request);
+        return;
+    }
+    if (pid < 0) {
+        error_report("fork-server: fork failed: %s", strerror(errno));
+    }
+
+    /* a few bytes always fit in the buffer of a new socket */
+    snprintf(reply, sizeof(reply), "%d\n", (int)pid);
+    if (write(c->fd, reply, strlen(reply)) < 0) {
+        /* the client went away, the child runs anyway */
+    }
+    fork_client_close(c);
+}
+
+static void fork_server_accept(void *opaque)
+{
+    ForkClient *c;
+    int fd;
+
+    fd = qemu_accept(fork_server_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    qemu_set_nonblock(fd);
+    c = g_new0(ForkClient, 1);
+    c->fd = fd;
+    QLIST_INSERT_HEAD(&fork_clients, c, next);
+    qemu_set_fd_handler(fd, fork_client_read, NULL, c);
+}
+
+/* Guest RAM is allocated with MADV_DONTFORK, which would leave the
+   children without it */
+static int fork_server_share_ram(const char *block_name, void *host_addr,
+                                 ram_addr_t offset, ram_addr_t length,
+                                 void *opaque)
+{
+    qemu_madvise(host_addr, length, QEMU_MADV_DOFORK);
+    return 0;
+}
+#endif
+
+void qmp_x_fork_server(const char *path, Error **errp)
+{
+#ifdef _WIN32
+    error_setg(errp, "fork server is not supported on this host");
+#else
+    if (fork_server_fd >= 0) {
+        error_setg(errp, "fork server already running");
+        return;
+    }
+    if (!tcg_enabled()) {
+        error_setg(errp, "fork server requires TCG");
+        return;
+    }
+    /* what cannot be snapshotted cannot be duplicated by fork either */
+    if (qemu_savevm_state_blocked(errp)) {
+        return;
+    }
+
+    fork_server_fd = unix_listen(path, NULL, 0, errp);
+    if (fork_server_fd < 0) {
+        fork_server_fd = -1;
+        return;
+    }
+
+    vm_stop(RUN_STATE_PAUSED);
+    qemu_ram_foreach_block(fork_server_share_ram, NULL);
+    qemu_set_fd_handler(fork_server_fd, fork_server_accept, NULL, NULL);
+#endif
+}
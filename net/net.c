@@ -27,6 +27,7 @@
 #include "clients.h"
 #include "hub.h"
 #include "net/slirp.h"
+#include "net/tap.h"
 #include "net/eth.h"
 #include "util.h"
 
@@ -1163,6 +1164,72 @@ out:
     error_propagate(errp, local_err);
 }
 
+#ifndef _WIN32
+/* In a child of the fork server, give the NIC or hub port connected to
+ * the backend id a backend of its own, made from the -netdev options
+ * optstr.  The inherited backend is closed without undoing its host
+ * setup, which still serves the parent.
+ */
+void netdev_replace_after_fork(const char *id, const char *optstr,
+                               Error **errp)
+{
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    NetClientState *nc, *peer;
+    QemuOpts *opts;
+    char *str;
+    int queues;
+
+    nc = qemu_find_netdev(id);
+    if (!nc) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", id);
+        return;
+    }
+    queues = qemu_find_net_clients_except(id, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    if (queues != 1) {
+        error_setg(errp, "Device '%s' has several queues", id);
+        return;
+    }
+
+    peer = nc->peer;
+    if (peer) {
+        peer->peer = NULL;
+        nc->peer = NULL;
+    }
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP) {
+        tap_forget_down_script(nc);
+    }
+    qemu_del_net_client(nc);
+    opts = qemu_opts_find(qemu_find_opts_err("netdev", NULL), id);
+    if (opts) {
+        qemu_opts_del(opts);
+    }
+
+    str = g_strdup_printf("%s,id=%s", optstr, id);
+    opts = qemu_opts_parse_noisily(qemu_find_opts("netdev"), str, true);
+    g_free(str);
+    if (!opts) {
+        error_setg(errp, "Invalid options for netdev '%s'", id);
+        return;
+    }
+    if (net_client_init(opts, 1, errp) < 0) {
+        qemu_opts_del(opts);
+        return;
+    }
+
+    nc = qemu_find_netdev(id);
+    if (peer) {
+        nc->peer = peer;
+        peer->peer = nc;
+        if (peer->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+            qemu_get_nic(peer)->conf->peers.ncs[0] = nc;
+        }
+    }
+}
+#endif
+
 void qmp_netdev_del(const char *id, Error **errp)
 {
     NetClientState *nc;
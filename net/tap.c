@@ -330,6 +330,15 @@ int tap_get_fd(NetClientState *nc)
     return s->fd;
 }
 
+/* The interface belongs to whoever set it up, e.g. the parent of a fork
+   server child: do not run the down script when closing it */
+void tap_forget_down_script(NetClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP);
+    s->down_script[0] = '\0';
+}
+
 /* fd support */
 
 static NetClientInfo net_tap_info = {
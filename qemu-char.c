@@ -4334,6 +4334,86 @@ void qmp_chardev_remove(const char *id, Error **errp)
     qemu_chr_delete(chr);
 }
 
+#ifndef _WIN32
+static void tcp_chr_detach(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (s->reconnect_timer) {
+        g_source_remove(s->reconnect_timer);
+        s->reconnect_timer = 0;
+    }
+    s->reconnect_time = 0;
+    if (s->listen_fd >= 0) {
+        if (s->listen_tag) {
+            g_source_remove(s->listen_tag);
+            s->listen_tag = 0;
+        }
+        if (s->listen_chan) {
+            g_io_channel_unref(s->listen_chan);
+            s->listen_chan = NULL;
+        }
+        closesocket(s->listen_fd);
+        s->listen_fd = -1;
+    }
+    if (s->fd >= 0) {
+        tcp_chr_disconnect(chr);
+    }
+}
+
+static bool chr_is_fd(CharDriverState *chr)
+{
+    return chr->chr_close == fd_chr_close ||
+           chr->chr_close == qemu_chr_close_stdio;
+}
+
+/* After fork(), the child must leave the descriptors it shares with the
+ * parent alone: sockets are closed and fd based input is no longer read.
+ */
+void qemu_chr_detach_after_fork(void)
+{
+    CharDriverState *chr;
+
+    QTAILQ_FOREACH(chr, &chardevs, next) {
+        if (chr->chr_close == tcp_chr_close) {
+            tcp_chr_detach(chr);
+        } else if (chr_is_fd(chr)) {
+            FDCharDriver *s = chr->opaque;
+
+            remove_fd_in_watch(chr);
+            if (s->fd_in) {
+                g_io_channel_unref(s->fd_in);
+                s->fd_in = NULL;
+            }
+        }
+    }
+}
+
+/* Make a file based chardev write to path from now on */
+void qemu_chr_redirect_output(CharDriverState *chr, const char *path,
+                              Error **errp)
+{
+    FDCharDriver *s;
+    int fd;
+
+    if (!chr_is_fd(chr)) {
+        error_setg(errp, "Chardev '%s' is not file based", chr->label);
+        return;
+    }
+    s = chr->opaque;
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) {
+        error_setg_file_open(errp, errno, path);
+        return;
+    }
+    if (dup2(fd, g_io_channel_unix_get_fd(s->fd_out)) < 0) {
+        error_setg_errno(errp, errno, "Failed to redirect chardev '%s'",
+                         chr->label);
+    }
+    close(fd);
+}
+#endif
+
 static void register_types(void)
 {
     register_char_driver("null", CHARDEV_BACKEND_KIND_NULL, NULL,
@@ -3304,7 +3304,45 @@ DEF("tb-size", HAS_ARG, QEMU_OPTION_tb_size, \
 STEXI
 @item -tb-size @var{n}
 @findex -tb-size
-Set TB size.
+Set TB size.  A buffer of 2 MB or more is split in up to 8 regions;
+once full, only the oldest region is evicted to make room for new code.
+ETEXI
+
+DEF("tb-cache", HAS_ARG, QEMU_OPTION_tb_cache, \
+    "-tb-cache file  keep the translated code in file across runs\n", QEMU_ARCH_ALL)
+STEXI
+@item -tb-cache @var{file}
+@findex -tb-cache
+Save the translated code to @var{file} on exit and reuse it on the next
+run of the same executable with the same machine configuration, for the
+guest code that did not change.  Only supported on x86_64 hosts.
+ETEXI
+
+DEF("tb-superblocks", HAS_ARG, QEMU_OPTION_tb_superblocks, \
+    "-tb-superblocks n\n" \
+    "                translate again the TBs run n times, as superblocks\n", \
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-superblocks @var{n}
+@findex -tb-superblocks
+Once a translated block has run @var{n} times, translate it again as a
+superblock that goes on past its direct branches, along the path taken
+most, as long as the code stays on the same page.  The default of 0
+disables superblocks.  Only supported by some targets, and not with
+@option{-icount}.
+ETEXI
+
+DEF("tcg-threads", HAS_ARG, QEMU_OPTION_tcg_threads, \
+    "-tcg-threads single|multi\n" \
+    "                run all TCG vCPUs in one thread (default), or each in\n" \
+    "                a host thread of its own\n", QEMU_ARCH_ALL)
+STEXI
+@item -tcg-threads single|multi
+@findex -tcg-threads
+With @option{multi}, each vCPU runs translated code in a host thread of
+its own, concurrently with the others, instead of all of them taking turns
+in a single thread.  Only supported by some targets, and not with
+@option{-icount}.
 ETEXI
 
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
@@ -694,6 +694,87 @@ Notes:
 (2) The uri format is the same as for -incoming
 
 EQMP
+    {
+        .name       = "x-fork-server",
+        .args_type  = "path:s",
+        .mhandler.cmd_new = qmp_marshal_x_fork_server,
+    },
+
+SQMP
+x-fork-server
+-------------
+
+Stop the VM and fork a copy of it for each connection to a UNIX socket.
+
+Arguments:
+
+- "path": the UNIX socket to listen on (json-string)
+
+Each client sends one line of space separated "chardev=file" pairs, to
+make file based chardevs of its child write to another file, and
+"netdev:id=options" pairs, to give its child a backend of its own for a
+netdev, e.g. "netdev:net0=tap,ifname=tap5,script=no,downscript=no".  It
+reads back the pid of the child.
+
+The children write to temporary overlays of their own instead of the
+writable drives.  Iothreads and other host threads do not survive the
+fork.
+
+Example:
+
+-> { "execute": "x-fork-server", "arguments": { "path": "/tmp/fork.sock" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "x-tb-profile",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_x_tb_profile,
+    },
+
+SQMP
+x-tb-profile
+------------
+
+Start or stop counting the executions of each translation block.  The
+translated code is discarded in both cases.
+
+Arguments:
+
+- "enable": true to start counting, false to stop (json-bool)
+
+Example:
+
+-> { "execute": "x-tb-profile", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "x-tb-profile-dump",
+        .args_type  = "filename:s",
+        .mhandler.cmd_new = qmp_marshal_x_tb_profile_dump,
+    },
+
+SQMP
+x-tb-profile-dump
+-----------------
+
+Write the translation block profile to a file.
+
+Arguments:
+
+- "filename": the file to write to (json-string)
+
+Example:
+
+-> { "execute": "x-tb-profile-dump",
+     "arguments": { "filename": "/tmp/tb-profile.txt" } }
+<- { "return": {} }
+
+EQMP
+
     {
         .name       = "migrate-set-cache-size",
         .args_type  = "value:o",
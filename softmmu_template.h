@@ -66,6 +66,14 @@
 # define SSUFFIX    glue(s, SUFFIX)
 #endif
 
+/* Lets the target account for data accesses that leave the inline TLB
+   lookup of the generated code */
+#if defined(TARGET_SLOW_PATH_HOOK) && !defined(SOFTMMU_CODE_ACCESS)
+#define SLOW_PATH_HOOK(is_write) TARGET_SLOW_PATH_HOOK(env, is_write)
+#else
+#define SLOW_PATH_HOOK(is_write) do { } while (0)
+#endif
+
 #ifdef SOFTMMU_CODE_ACCESS
 #define READ_ACCESS_TYPE MMU_INST_FETCH
 #define ADDR_READ addr_code
@@ -159,8 +167,16 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
     }
 
     cpu->mem_io_vaddr = addr;
-    memory_region_dispatch_read(mr, physaddr, &val, 1 << SHIFT,
-                                iotlbentry->attrs);
+    if (qemu_mutex_iothread_locked()) {
+        memory_region_dispatch_read(mr, physaddr, &val, 1 << SHIFT,
+                                    iotlbentry->attrs);
+    } else {
+        /* a vCPU thread of its own, see -tcg-threads */
+        qemu_mutex_lock_iothread();
+        memory_region_dispatch_read(mr, physaddr, &val, 1 << SHIFT,
+                                    iotlbentry->attrs);
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 #endif
@@ -176,6 +192,7 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
+    SLOW_PATH_HOOK(false);
 
     /* If the TLB entry is for a different page, reload and try again.  */
     if ((addr & TARGET_PAGE_MASK)
@@ -260,6 +277,7 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
+    SLOW_PATH_HOOK(false);
 
     /* If the TLB entry is for a different page, reload and try again.  */
     if ((addr & TARGET_PAGE_MASK)
@@ -366,8 +384,16 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
 
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
-    memory_region_dispatch_write(mr, physaddr, val, 1 << SHIFT,
-                                 iotlbentry->attrs);
+    if (qemu_mutex_iothread_locked()) {
+        memory_region_dispatch_write(mr, physaddr, val, 1 << SHIFT,
+                                     iotlbentry->attrs);
+    } else {
+        /* a vCPU thread of its own, see -tcg-threads */
+        qemu_mutex_lock_iothread();
+        memory_region_dispatch_write(mr, physaddr, val, 1 << SHIFT,
+                                     iotlbentry->attrs);
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
@@ -380,6 +406,7 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
+    SLOW_PATH_HOOK(true);
 
     /* If the TLB entry is for a different page, reload and try again.  */
     if ((addr & TARGET_PAGE_MASK)
@@ -460,6 +487,7 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
 
     /* Adjust the given return address.  */
     retaddr -= GETPC_ADJ;
+    SLOW_PATH_HOOK(true);
 
     /* If the TLB entry is for a different page, reload and try again.  */
     if ((addr & TARGET_PAGE_MASK)
@@ -551,6 +579,7 @@ void probe_write(CPUArchState *env, target_ulong addr, int mmu_idx,
 #endif /* !defined(SOFTMMU_CODE_ACCESS) */
 
 #undef READ_ACCESS_TYPE
+#undef SLOW_PATH_HOOK
 #undef SHIFT
 #undef DATA_TYPE
 #undef SUFFIX
@@ -54,6 +54,9 @@ typedef struct MIPSCPUClass {
 /**
  * MIPSCPU:
  * @env: #CPUMIPSState
+ * @page_walker: Whether to implement the hardware page table walker,
+ *               on the models that have one.
+ * @idle_detect: Whether to halt in idle loops, see helper_idle_loop().
  *
  * A MIPS CPU.
  */
@@ -63,6 +66,9 @@ typedef struct MIPSCPU {
     /*< public >*/
 
     CPUMIPSState env;
+
+    bool page_walker;
+    bool idle_detect;
 } MIPSCPU;
 
 static inline MIPSCPU *mips_env_get_cpu(CPUMIPSState *env)
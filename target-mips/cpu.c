@@ -22,6 +22,7 @@
 #include "kvm_mips.h"
 #include "qemu-common.h"
 #include "sysemu/kvm.h"
+#include "hw/qdev-properties.h"
 
 
 static void mips_cpu_set_pc(CPUState *cs, vaddr value)
@@ -64,6 +65,14 @@ static bool mips_cpu_has_work(CPUState *cs)
         }
     }
 
+    /* A CPU halted in an idle loop wakes up for any interrupt, the loop
+       may be waiting with interrupts disabled, or when its idle_timer
+       expires. */
+    if (env->idle_halted &&
+        (cs->interrupt_request & (CPU_INTERRUPT_HARD | CPU_INTERRUPT_WAKE))) {
+        has_work = true;
+    }
+
     /* MIPS-MT has the ability to halt the CPU.  */
     if (env->CP0_Config3 & (1 << CP0C3_MT)) {
         /* The QEMU model will issue an _WAKE request whenever the CPUs
@@ -113,6 +122,13 @@ static void mips_cpu_realizefn(DeviceState *dev, Error **errp)
     CPUState *cs = CPU(dev);
     MIPSCPUClass *mcc = MIPS_CPU_GET_CLASS(dev);
 
+#ifndef CONFIG_USER_ONLY
+    if (tcg_enabled()) {
+        /* kseg1 is folded onto kseg0, both map the first 512MB */
+        tlb_set_direct_ram(cs, ~(target_ulong)0x20000000,
+                           (target_ulong)(int32_t)0x80000000, 0, 0x20000000);
+    }
+#endif
     cpu_reset(cs);
     qemu_init_vcpu(cs);
 
@@ -133,6 +149,14 @@ static void mips_cpu_initfn(Object *obj)
     }
 }
 
+static Property mips_cpu_properties[] = {
+    /* Optional R6 style hardware page table walker, see Config3.PW; only
+       the models with mips_def_t.page_walker accept it */
+    DEFINE_PROP_BOOL("page-walker", MIPSCPU, page_walker, false),
+    DEFINE_PROP_BOOL("idle-detect", MIPSCPU, idle_detect, false),
+    DEFINE_PROP_END_OF_LIST()
+};
+
 static void mips_cpu_class_init(ObjectClass *c, void *data)
 {
     MIPSCPUClass *mcc = MIPS_CPU_CLASS(c);
@@ -141,6 +165,7 @@ static void mips_cpu_class_init(ObjectClass *c, void *data)
 
     mcc->parent_realize = dc->realize;
     dc->realize = mips_cpu_realizefn;
+    dc->props = mips_cpu_properties;
 
     mcc->parent_reset = cc->reset;
     cc->reset = mips_cpu_reset;
@@ -5,6 +5,12 @@
 
 #define ALIGNED_ONLY
 
+/* The helpers may run in a thread per vCPU, see -tcg-threads */
+#define TARGET_SUPPORTS_MTTCG
+
+/* The translator follows branches with CF_SUPERBLOCK, see -tb-superblocks */
+#define TARGET_SUPPORTS_SUPERBLOCKS
+
 #define CPUArchState struct CPUMIPSState
 
 #include "config.h"
@@ -36,6 +42,12 @@ struct r4k_tlb_t {
 };
 
 #if !defined(CONFIG_USER_ONLY)
+/* Size of the VPN-keyed lookup index kept alongside the r4k TLB, and
+   number of distinct PageMask values it can index at once.  Entries
+   using further PageMask values go to an extra, linearly scanned chain. */
+#define MIPS_TLB_HASH_SIZE 256
+#define MIPS_TLB_MASKS 8
+
 typedef struct CPUMIPSTLBContext CPUMIPSTLBContext;
 struct CPUMIPSTLBContext {
     uint32_t nb_tlb;
@@ -50,6 +62,14 @@ struct CPUMIPSTLBContext {
     union {
         struct {
             r4k_tlb_t tlb[MIPS_TLB_MAX];
+            /* Lookup index over tlb[].  Links hold an entry number plus
+               one, so that a zeroed context is an empty index.  The last
+               bucket chains the entries with an unindexed PageMask. */
+            uint8_t hash[MIPS_TLB_HASH_SIZE + 1];
+            uint8_t hash_next[MIPS_TLB_MAX];
+            uint16_t hash_bucket[MIPS_TLB_MAX];
+            uint32_t masks[MIPS_TLB_MASKS];
+            uint8_t mask_refs[MIPS_TLB_MASKS];
         } r4k;
     } mmu;
 };
@@ -130,7 +150,9 @@ struct CPUMIPSFPUContext {
 };
 
 #define NB_MMU_MODES 3
-#define TARGET_INSN_START_EXTRA_WORDS 2
+/* hflags & MIPS_HFLAG_BMASK, btarget and the index of the insn in its
+   TB, see restore_state_to_opc */
+#define TARGET_INSN_START_EXTRA_WORDS 3
 
 typedef struct CPUMIPSMVPContext CPUMIPSMVPContext;
 struct CPUMIPSMVPContext {
@@ -296,7 +318,25 @@ struct CPUMIPSState {
 #define CP0PG_XIE 30
 #define CP0PG_ELPA 29
 #define CP0PG_IEC 27
+    target_ulong CP0_PWBase;
+    target_ulong CP0_PWField;
+#define CP0PF_GDI  24
+#define CP0PF_UDI  18
+#define CP0PF_MDI  12
+#define CP0PF_PTI  6
+#define CP0PF_PTEI 0
+    target_ulong CP0_PWSize;
+#define CP0PS_PS   30
+#define CP0PS_GDW  24
+#define CP0PS_UDW  18
+#define CP0PS_MDW  12
+#define CP0PS_PTW  6
+#define CP0PS_PTEW 0
     int32_t CP0_Wired;
+    int32_t CP0_PWCtl;
+#define CP0PC_PWEN   31
+#define CP0PC_HUGEPG 6
+#define CP0PC_PSN    0
     int32_t CP0_SRSConf0_rw_bitmask;
     int32_t CP0_SRSConf0;
 #define CP0SRSC0_M	31
@@ -435,6 +475,7 @@ struct CPUMIPSState {
 #define CP0C3_MSAP  28
 #define CP0C3_BP 27
 #define CP0C3_BI 26
+#define CP0C3_PW 24
 #define CP0C3_IPLW 21
 #define CP0C3_MMAR 18
 #define CP0C3_MCU  17
@@ -510,7 +551,16 @@ struct CPUMIPSState {
 #define CP0DB_DBp  1
 #define CP0DB_DSS  0
     target_ulong CP0_DEPC;
-    int32_t CP0_Performance0;
+#define MIPS_PERF_COUNTERS 2
+    uint32_t CP0_PerfCtl[MIPS_PERF_COUNTERS];
+#define CP0PfC_M     31
+#define CP0PfC_EVENT 5
+#define CP0PfC_IE    4
+#define CP0PfC_U     3
+#define CP0PfC_S     2
+#define CP0PfC_K     1
+#define CP0PfC_EXL   0
+    uint32_t CP0_PerfCnt[MIPS_PERF_COUNTERS];
     uint64_t CP0_TagLo;
     int32_t CP0_DataLo;
     int32_t CP0_TagHi;
@@ -526,7 +576,7 @@ struct CPUMIPSState {
 #define EXCP_INST_NOTAVAIL 0x2 /* No valid instruction word for BadInstr */
     uint32_t hflags;    /* CPU State */
     /* TMASK defines different execution modes */
-#define MIPS_HFLAG_TMASK  0x75807FF
+#define MIPS_HFLAG_TMASK  0xF5807FF
 #define MIPS_HFLAG_MODE   0x00007 /* execution modes                    */
     /* The KSU flags must be the lowest bits in hflags. The flag order
        must be the same as defined for CP0 Status. This allows to use
@@ -575,6 +625,7 @@ struct CPUMIPSState {
 #define MIPS_HFLAG_MSA   0x1000000
 #define MIPS_HFLAG_FRE   0x2000000 /* FRE enabled */
 #define MIPS_HFLAG_ELPA  0x4000000
+#define MIPS_HFLAG_PERF  0x8000000 /* Count instructions                */
     target_ulong btarget;        /* Jump / branch target               */
     target_ulong bcond;          /* Branch condition (if needed)       */
 
@@ -584,17 +635,53 @@ struct CPUMIPSState {
     uint32_t CP0_TCStatus_rw_bitmask; /* Read/write bits in CP0_TCStatus */
     int insn_flags; /* Supported instruction set */
 
+    /* Idle loop detection, see helper_idle_loop */
+    target_ulong idle_loop_pc;
+    uint32_t idle_loop_count;
+    bool idle_halted;
+
+    /* Virtual clock extrapolated from host ticks, see cpu_mips_clock_ns */
+    int64_t count_sync_ns;
+    int64_t count_sync_ticks;
+    int64_t count_sync_limit;
+    int64_t count_cal_ns;
+    int64_t count_cal_ticks;
+    int64_t count_last_ns;
+    uint64_t count_scale;
+    /* Count reads inlined by the translator, see cpu_mips_count_fast_start:
+       while host ticks - count_fast_ticks < count_fast_limit, Count is
+       count_fast_base + ((ticks * count_fast_scale) >> 32) */
+    int64_t count_fast_ticks;
+    uint64_t count_fast_limit;
+    uint64_t count_fast_window;
+    uint64_t count_fast_scale;
+    uint32_t count_fast_base;
+
+    /* Performance counters, see perf_helper.c */
+    bool perf_counters;         /* the model implements them */
+    uint64_t perf_insns;        /* instructions run while counted */
+    uint64_t perf_insns_irq;    /* perf_insns value that overflows a counter */
+    uint64_t perf_snap[MIPS_PERF_COUNTERS];
+    uint64_t perf_cycles;       /* last value of cpu_mips_get_cycles */
+    uint32_t perf_active;       /* counters counting in the current mode */
+    uint32_t perf_events;       /* events counted in the current mode */
+    bool perf_enabled;
+    bool perf_irq;
+
     CPU_COMMON
 
     /* Fields from here on are preserved across CPU reset. */
     CPUMIPSMVPContext *mvp;
 #if !defined(CONFIG_USER_ONLY)
     CPUMIPSTLBContext *tlb;
+    CPUDirectRAM direct_ram;    /* kseg0 and kseg1 */
 #endif
 
     const mips_def_t *cpu_model;
     void *irq[8];
     QEMUTimer *timer; /* Internal timer */
+    QEMUTimer *idle_timer; /* Wakes up a CPU halted in an idle loop */
+    QEMUTimer *perf_timer; /* Cycle counter overflow */
 };
 
 #include "cpu-qom.h"
@@ -633,6 +720,9 @@ extern uint32_t cpu_rddsp(uint32_t mask_num, CPUMIPSState *env);
 #define MMU_MODE1_SUFFIX _super
 #define MMU_MODE2_SUFFIX _user
 #define MMU_USER_IDX 2
+/* In kernel mode, the generated code accesses the RAM behind kseg0 and
+   kseg1 without the TLB */
+#define TARGET_DIRECT_RAM_MMU_IDX 0
 static inline int cpu_mmu_index (CPUMIPSState *env, bool ifetch)
 {
     return env->hflags & MIPS_HFLAG_KSU;
@@ -764,14 +854,48 @@ void cpu_mips_store_compare (CPUMIPSState *env, uint32_t value);
 void cpu_mips_start_count(CPUMIPSState *env);
 void cpu_mips_stop_count(CPUMIPSState *env);
 
+uint64_t cpu_mips_get_cycles(CPUMIPSState *env);
+int64_t cpu_mips_cycles_to_ns(CPUMIPSState *env, uint64_t cycles);
+
 /* mips_int.c */
 void cpu_mips_soft_irq(CPUMIPSState *env, int irq, int level);
 
+/* perf_helper.c */
+#if !defined(CONFIG_USER_ONLY)
+enum {
+    MIPS_PERF_CYCLES = 0,
+    MIPS_PERF_INSNS = 1,
+    MIPS_PERF_TLB_REFILLS = 2,
+    MIPS_PERF_EXCEPTIONS = 3,
+    MIPS_PERF_SLOW_LOADS = 4,
+    MIPS_PERF_SLOW_STORES = 5,
+};
+
+void cpu_mips_perf_update(CPUMIPSState *env);
+void cpu_mips_perf_count(CPUMIPSState *env, int event);
+
+static inline void cpu_mips_perf_event(CPUMIPSState *env, int event)
+{
+    if (unlikely(env->perf_events & (1 << event))) {
+        cpu_mips_perf_count(env, event);
+    }
+}
+
+/* Called by softmmu_template.h for every data access taking the slow path */
+#define TARGET_SLOW_PATH_HOOK(env, is_write)                              \
+    cpu_mips_perf_event(env, (is_write) ? MIPS_PERF_SLOW_STORES           \
+                                        : MIPS_PERF_SLOW_LOADS)
+#endif
+
 /* helper.c */
 int mips_cpu_handle_mmu_fault(CPUState *cpu, vaddr address, int rw,
                               int mmu_idx);
 #if !defined(CONFIG_USER_ONLY)
 void r4k_invalidate_tlb (CPUMIPSState *env, int idx, int use_extra);
+void r4k_tlb_index_add(CPUMIPSState *env, int idx);
+void r4k_tlb_index_remove(CPUMIPSState *env, int idx);
+void r4k_tlb_index_rebuild(CPUMIPSState *env);
+int r4k_tlb_lookup(CPUMIPSState *env, target_ulong address, uint8_t ASID);
 hwaddr cpu_mips_translate_address (CPUMIPSState *env, target_ulong address,
 		                               int rw);
 #endif
@@ -780,6 +904,9 @@ target_ulong exception_resume_pc (CPUMIPSState *env);
 /* op_helper.c */
 extern unsigned int ieee_rm[];
 int ieee_ex_to_mips(int xcpt);
+#if !defined(CONFIG_USER_ONLY)
+void cpu_mips_idle_end(CPUMIPSState *env);
+#endif
 
 static inline void restore_rounding_mode(CPUMIPSState *env)
 {
@@ -958,18 +1085,53 @@ static inline void compute_hflags(CPUMIPSState *env)
             env->hflags |= MIPS_HFLAG_ELPA;
         }
     }
+#if !defined(CONFIG_USER_ONLY)
+    if (env->perf_enabled) {
+        cpu_mips_perf_update(env);
+    }
+#endif
 }
 
 #ifndef CONFIG_USER_ONLY
 static inline void cpu_mips_tlb_flush(CPUMIPSState *env, int flush_global)
 {
     MIPSCPU *cpu = mips_env_get_cpu(env);
+    int i;
 
-    /* Flush qemu's TLB and discard all shadowed entries.  */
+    /* Flush qemu's TLB and discard all shadowed entries.  Global
+       entries are kept unless flush_global is set, so the pages of
+       shadowed entries must be flushed one by one then.  */
+    if (!flush_global) {
+        while (env->tlb->tlb_in_use > env->tlb->nb_tlb) {
+            i = --env->tlb->tlb_in_use;
+            r4k_tlb_index_remove(env, i);
+            r4k_invalidate_tlb(env, i, 0);
+        }
+    }
     tlb_flush(CPU(cpu), flush_global);
+    for (i = env->tlb->nb_tlb; i < env->tlb->tlb_in_use; i++) {
+        r4k_tlb_index_remove(env, i);
+    }
     env->tlb->tlb_in_use = env->tlb->nb_tlb;
 }
 
+/* Called when the ASID in CP0_EntryHi changes.  */
+static inline void cpu_mips_tlb_set_asid(CPUMIPSState *env, uint8_t asid)
+{
+    MIPSCPU *cpu = mips_env_get_cpu(env);
+    int i;
+
+    /* Shadowed entries only stand for the address space they were
+       discarded in, drop them before it can be reused.  The entries
+       of qemu's TLB are kept per ASID and don't need a flush.  */
+    while (env->tlb->tlb_in_use > env->tlb->nb_tlb) {
+        i = --env->tlb->tlb_in_use;
+        r4k_tlb_index_remove(env, i);
+        r4k_invalidate_tlb(env, i, 0);
+    }
+    tlb_set_asid(CPU(cpu), asid);
+}
+
 /* Called for updates to CP0_Status.  */
 static inline void sync_c0_status(CPUMIPSState *env, CPUMIPSState *cpu, int tc)
 {
@@ -66,47 +66,186 @@ int fixed_mmu_map_address (CPUMIPSState *env, hwaddr *physical, int *prot,
 }
 
 /* MIPS32/MIPS64 R4000-style MMU emulation */
-int r4k_map_address (CPUMIPSState *env, hwaddr *physical, int *prot,
-                     target_ulong address, int rw, int access_type)
+
+/* The guest TLB is indexed by the VPN of each entry, masked with its own
+   PageMask.  A lookup probes one bucket for every PageMask value in use,
+   which keeps the cost of a qemu TLB miss independent of the TLB size. */
+static inline unsigned int r4k_tlb_hash(target_ulong tag, uint32_t pagemask)
 {
-    uint8_t ASID = env->CP0_EntryHi & 0xFF;
+    target_ulong vpn2 = tag >> (TARGET_PAGE_BITS + 1);
+
+    return (vpn2 ^ (vpn2 >> 8) ^ (pagemask >> (TARGET_PAGE_BITS + 1))) &
+           (MIPS_TLB_HASH_SIZE - 1);
+}
+
+void r4k_tlb_index_add(CPUMIPSState *env, int idx)
+{
+    r4k_tlb_t *tlb = &env->tlb->mmu.r4k.tlb[idx];
+    target_ulong mask;
+    int bucket = MIPS_TLB_HASH_SIZE;
+    int i, free = -1;
+
+    r4k_tlb_index_remove(env, idx);
+
+    for (i = 0; i < MIPS_TLB_MASKS; i++) {
+        if (env->tlb->mmu.r4k.mask_refs[i] == 0) {
+            if (free < 0) {
+                free = i;
+            }
+        } else if (env->tlb->mmu.r4k.masks[i] == tlb->PageMask) {
+            break;
+        }
+    }
+    if (i == MIPS_TLB_MASKS && free >= 0) {
+        i = free;
+        env->tlb->mmu.r4k.masks[i] = tlb->PageMask;
+    }
+    if (i < MIPS_TLB_MASKS) {
+        env->tlb->mmu.r4k.mask_refs[i]++;
+        /* 1k pages are not supported. */
+        mask = tlb->PageMask | ~(TARGET_PAGE_MASK << 1);
+        bucket = r4k_tlb_hash(tlb->VPN & ~mask, tlb->PageMask);
+    }
+
+    env->tlb->mmu.r4k.hash_next[idx] = env->tlb->mmu.r4k.hash[bucket];
+    env->tlb->mmu.r4k.hash[bucket] = idx + 1;
+    env->tlb->mmu.r4k.hash_bucket[idx] = bucket + 1;
+}
+
+void r4k_tlb_index_remove(CPUMIPSState *env, int idx)
+{
+    r4k_tlb_t *tlb = &env->tlb->mmu.r4k.tlb[idx];
+    uint8_t *link;
+    int bucket = env->tlb->mmu.r4k.hash_bucket[idx] - 1;
     int i;
 
+    if (bucket < 0) {
+        return;
+    }
+    link = &env->tlb->mmu.r4k.hash[bucket];
+    while (*link != idx + 1) {
+        link = &env->tlb->mmu.r4k.hash_next[*link - 1];
+    }
+    *link = env->tlb->mmu.r4k.hash_next[idx];
+    env->tlb->mmu.r4k.hash_bucket[idx] = 0;
+
+    if (bucket == MIPS_TLB_HASH_SIZE) {
+        return;
+    }
+    for (i = 0; i < MIPS_TLB_MASKS; i++) {
+        if (env->tlb->mmu.r4k.mask_refs[i] &&
+            env->tlb->mmu.r4k.masks[i] == tlb->PageMask) {
+            env->tlb->mmu.r4k.mask_refs[i]--;
+            break;
+        }
+    }
+}
+
+/* Recreate the index from scratch, e.g. after the entries were loaded
+   from a snapshot. */
+void r4k_tlb_index_rebuild(CPUMIPSState *env)
+{
+    int i;
+
+    memset(env->tlb->mmu.r4k.hash, 0, sizeof(env->tlb->mmu.r4k.hash));
+    memset(env->tlb->mmu.r4k.hash_bucket, 0,
+           sizeof(env->tlb->mmu.r4k.hash_bucket));
+    memset(env->tlb->mmu.r4k.mask_refs, 0,
+           sizeof(env->tlb->mmu.r4k.mask_refs));
     for (i = 0; i < env->tlb->tlb_in_use; i++) {
-        r4k_tlb_t *tlb = &env->tlb->mmu.r4k.tlb[i];
-        /* 1k pages are not supported. */
-        target_ulong mask = tlb->PageMask | ~(TARGET_PAGE_MASK << 1);
-        target_ulong tag = address & ~mask;
-        target_ulong VPN = tlb->VPN & ~mask;
+        r4k_tlb_index_add(env, i);
+    }
+}
+
+/* Return the lowest numbered TLB entry matching ADDRESS and ASID, or -1. */
+int r4k_tlb_lookup(CPUMIPSState *env, target_ulong address, uint8_t ASID)
+{
+    int best = -1;
+    int i, bucket;
+    uint8_t link;
+
+    for (i = 0; i <= MIPS_TLB_MASKS; i++) {
+        if (i < MIPS_TLB_MASKS) {
+            target_ulong mask, tag;
+
+            if (env->tlb->mmu.r4k.mask_refs[i] == 0) {
+                continue;
+            }
+            mask = env->tlb->mmu.r4k.masks[i] | ~(TARGET_PAGE_MASK << 1);
+            tag = address & ~mask;
 #if defined(TARGET_MIPS64)
-        tag &= env->SEGMask;
+            tag &= env->SEGMask;
 #endif
+            bucket = r4k_tlb_hash(tag, env->tlb->mmu.r4k.masks[i]);
+        } else {
+            bucket = MIPS_TLB_HASH_SIZE;
+        }
 
-        /* Check ASID, virtual page number & size */
-        if ((tlb->G == 1 || tlb->ASID == ASID) && VPN == tag && !tlb->EHINV) {
-            /* TLB match */
-            int n = !!(address & mask & ~(mask >> 1));
-            /* Check access rights */
-            if (!(n ? tlb->V1 : tlb->V0)) {
-                return TLBRET_INVALID;
-            }
-            if (rw == MMU_INST_FETCH && (n ? tlb->XI1 : tlb->XI0)) {
-                return TLBRET_XI;
-            }
-            if (rw == MMU_DATA_LOAD && (n ? tlb->RI1 : tlb->RI0)) {
-                return TLBRET_RI;
+        for (link = env->tlb->mmu.r4k.hash[bucket]; link;
+             link = env->tlb->mmu.r4k.hash_next[link - 1]) {
+            int idx = link - 1;
+            r4k_tlb_t *tlb = &env->tlb->mmu.r4k.tlb[idx];
+            /* 1k pages are not supported. */
+            target_ulong mask = tlb->PageMask | ~(TARGET_PAGE_MASK << 1);
+            target_ulong tag = address & ~mask;
+            target_ulong VPN = tlb->VPN & ~mask;
+#if defined(TARGET_MIPS64)
+            tag &= env->SEGMask;
+#endif
+
+            /* Shadowed entries past tlb_in_use have been discarded. */
+            if (idx >= env->tlb->tlb_in_use || (best >= 0 && idx > best)) {
+                continue;
             }
-            if (rw != MMU_DATA_STORE || (n ? tlb->D1 : tlb->D0)) {
-                *physical = tlb->PFN[n] | (address & (mask >> 1));
-                *prot = PAGE_READ;
-                if (n ? tlb->D1 : tlb->D0)
-                    *prot |= PAGE_WRITE;
-                return TLBRET_MATCH;
+            /* Check ASID, virtual page number & size */
+            if ((tlb->G == 1 || tlb->ASID == ASID) && VPN == tag &&
+                !tlb->EHINV) {
+                best = idx;
             }
-            return TLBRET_DIRTY;
         }
     }
-    return TLBRET_NOMATCH;
+    return best;
+}
+
+int r4k_map_address (CPUMIPSState *env, hwaddr *physical, int *prot,
+                     target_ulong address, int rw, int access_type)
+{
+    uint8_t ASID = env->CP0_EntryHi & 0xFF;
+    int i = r4k_tlb_lookup(env, address, ASID);
+    r4k_tlb_t *tlb;
+    target_ulong mask;
+    int n;
+
+    if (i < 0) {
+        return TLBRET_NOMATCH;
+    }
+
+    /* TLB match */
+    tlb = &env->tlb->mmu.r4k.tlb[i];
+    /* 1k pages are not supported. */
+    mask = tlb->PageMask | ~(TARGET_PAGE_MASK << 1);
+    n = !!(address & mask & ~(mask >> 1));
+    /* Check access rights */
+    if (!(n ? tlb->V1 : tlb->V0)) {
+        return TLBRET_INVALID;
+    }
+    if (rw == MMU_INST_FETCH && (n ? tlb->XI1 : tlb->XI0)) {
+        return TLBRET_XI;
+    }
+    if (rw == MMU_DATA_LOAD && (n ? tlb->RI1 : tlb->RI0)) {
+        return TLBRET_RI;
+    }
+    if (rw != MMU_DATA_STORE || (n ? tlb->D1 : tlb->D0)) {
+        *physical = tlb->PFN[n] | (address & (mask >> 1));
+        *prot = PAGE_READ;
+        if (n ? tlb->D1 : tlb->D0)
+            *prot |= PAGE_WRITE;
+        if (tlb->G) {
+            *prot |= PAGE_GLOBAL;
+        }
+        return TLBRET_MATCH;
+    }
+    return TLBRET_DIRTY;
 }
 
 static int get_physical_address (CPUMIPSState *env, hwaddr *physical,
@@ -177,7 +316,7 @@ static int get_physical_address (CPUMIPSState *env, hwaddr *physical,
         if (kernel_mode && KX &&
             (address & 0x07FFFFFFFFFFFFFFULL) <= env->PAMask) {
             *physical = address & env->PAMask;
-            *prot = PAGE_READ | PAGE_WRITE;
+            *prot = PAGE_READ | PAGE_WRITE | PAGE_GLOBAL;
         } else {
             ret = TLBRET_BADADDR;
         }
@@ -194,7 +333,7 @@ static int get_physical_address (CPUMIPSState *env, hwaddr *physical,
         /* kseg0 */
         if (kernel_mode) {
             *physical = address - (int32_t)KSEG0_BASE;
-            *prot = PAGE_READ | PAGE_WRITE;
+            *prot = PAGE_READ | PAGE_WRITE | PAGE_GLOBAL;
         } else {
             ret = TLBRET_BADADDR;
         }
@@ -202,7 +341,7 @@ static int get_physical_address (CPUMIPSState *env, hwaddr *physical,
         /* kseg1 */
         if (kernel_mode) {
             *physical = address - (int32_t)KSEG1_BASE;
-            *prot = PAGE_READ | PAGE_WRITE;
+            *prot = PAGE_READ | PAGE_WRITE | PAGE_GLOBAL;
         } else {
             ret = TLBRET_BADADDR;
         }
@@ -224,6 +363,157 @@ static int get_physical_address (CPUMIPSState *env, hwaddr *physical,
     }
     return ret;
 }
+
+/* R6 style hardware page table walker (Config3.PW).  On a refill miss the
+   tables described by PWBase, PWField and PWSize are walked with kernel
+   privileges, and the pair of PTEs found is written to the TLB as the
+   guest's refill handler would do with tlbwr.  Anything the walker cannot
+   handle, such as a miss on a mapped table, leaves the refill exception to
+   the guest. */
+
+static bool pw_read_entry(CPUMIPSState *env, target_ulong vaddr, int shift,
+                          uint64_t *entry)
+{
+    CPUState *cs = CPU(mips_env_get_cpu(env));
+    hwaddr physical;
+    int prot;
+
+    if (get_physical_address(env, &physical, &prot, vaddr, MMU_DATA_LOAD,
+                             ACCESS_INT) != TLBRET_MATCH) {
+        return false;
+    }
+    if (shift == 3) {
+        *entry = ldq_phys(cs->as, physical);
+    } else {
+        *entry = ldl_phys(cs->as, physical);
+    }
+    return true;
+}
+
+/* Rotate a PTE right by PTEI - 2 bits into the EntryLo layout; the two
+   bits that wrap around are XI and RI. */
+static uint64_t pw_entrylo(CPUMIPSState *env, uint64_t pte, int ptei)
+{
+    uint64_t rixi;
+
+    pte >>= ptei - 2;
+    rixi = pte & 3 & (env->CP0_PageGrain >> CP0PG_XIE);
+    return (pte >> 2) | (rixi << CP0EnLo_XI);
+}
+
+static bool pw_walk(CPUMIPSState *env, target_ulong address,
+                    uint64_t *lo0, uint64_t *lo1, int *page_shift)
+{
+    static const int dir_index[] = { CP0PF_GDI, CP0PF_UDI, CP0PF_MDI };
+    static const int dir_width[] = { CP0PS_GDW, CP0PS_UDW, CP0PS_MDW };
+    int ptei = (env->CP0_PWField >> CP0PF_PTEI) & 0x3F;
+    int pti = (env->CP0_PWField >> CP0PF_PTI) & 0x3F;
+    int ptw = (env->CP0_PWSize >> CP0PS_PTW) & 0x3F;
+    int ptew = (env->CP0_PWSize >> CP0PS_PTEW) & 0x3F;
+    int psn = (env->CP0_PWCtl >> CP0PC_PSN) & 0x3F;
+    bool hugepg = (env->CP0_PWCtl >> CP0PC_HUGEPG) & 1;
+    /* log2 of the size of directory pointers and of PTEs */
+    int ptr_shift = (env->CP0_PWSize >> CP0PS_PS) & 1 ? 3 : 2;
+    int pte_shift = ptr_shift + ptew;
+    /* directories hold PTEs too when huge pages are enabled */
+    int dir_shift = hugepg ? pte_shift : ptr_shift;
+    target_ulong base = env->CP0_PWBase;
+    bool has_dir = false;
+    uint64_t entry, pfn_bit;
+    target_ulong idx;
+    int i;
+
+    if (ptew > 1 || pte_shift > 3 || ptei < 2) {
+        return false;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(dir_index); i++) {
+        int di = (env->CP0_PWField >> dir_index[i]) & 0x3F;
+        int dw = (env->CP0_PWSize >> dir_width[i]) & 0x3F;
+
+        if (dw == 0) {
+            continue;
+        }
+        if (di + dw > TARGET_LONG_BITS) {
+            return false;
+        }
+        has_dir = true;
+        idx = extract64(address, di, dw);
+        if (!pw_read_entry(env, base + (idx << dir_shift), dir_shift,
+                           &entry)) {
+            return false;
+        }
+        if (hugepg && ((entry >> psn) & 1)) {
+            /* The entry maps 1 << di bytes as an even/odd pair of pages.
+               Directories with an even index would need two entries. */
+            if (!(di & 1) || di - 1 < TARGET_PAGE_BITS) {
+                return false;
+            }
+            *page_shift = di - 1;
+            pfn_bit = 1ULL << (*page_shift - 12 + 6);
+            *lo0 = pw_entrylo(env, entry, ptei) & ~pfn_bit;
+            *lo1 = *lo0 | pfn_bit;
+            return true;
+        }
+        base = ptr_shift == 2 ? (target_ulong)(int32_t)entry : entry;
+    }
+    if (!has_dir || ptw == 0 || pti + ptw > TARGET_LONG_BITS) {
+        return false;
+    }
+
+    /* Leaf table, read the PTEs of the even and the odd page */
+    idx = extract64(address, pti, ptw) & ~1;
+    if (!pw_read_entry(env, base + (idx << pte_shift), pte_shift, &entry)) {
+        return false;
+    }
+    *lo0 = pw_entrylo(env, entry, ptei);
+    if (!pw_read_entry(env, base + ((idx + 1) << pte_shift), pte_shift,
+                       &entry)) {
+        return false;
+    }
+    *lo1 = pw_entrylo(env, entry, ptei);
+    *page_shift = pti;
+    return true;
+}
+
+static bool page_table_walk_refill(CPUMIPSState *env, target_ulong address)
+{
+    uint32_t mode = env->hflags & MIPS_HFLAG_KSU;
+    target_ulong entryhi = env->CP0_EntryHi;
+    int32_t pagemask = env->CP0_PageMask;
+    uint64_t entrylo0 = env->CP0_EntryLo0;
+    uint64_t entrylo1 = env->CP0_EntryLo1;
+    uint64_t lo0, lo1;
+    int page_shift;
+    target_ulong mask;
+    bool found;
+
+    env->hflags &= ~MIPS_HFLAG_KSU;
+    found = pw_walk(env, address, &lo0, &lo1, &page_shift);
+    env->hflags |= mode;
+
+    /* Only the page sizes PageMask can express */
+    if (!found || page_shift < TARGET_PAGE_BITS || page_shift > 28 ||
+        ((page_shift - TARGET_PAGE_BITS) & 1)) {
+        return false;
+    }
+    qemu_log_mask(CPU_LOG_MMU, "%s address " TARGET_FMT_lx " lo0 %" PRIx64
+                  " lo1 %" PRIx64 " page_shift %d\n",
+                  __func__, address, lo0, lo1, page_shift);
+
+    mask = ((target_ulong)1 << (page_shift + 1)) - 1;
+    env->CP0_EntryHi = (address & ~mask) | (entryhi & 0xFF);
+    env->CP0_PageMask = mask & (TARGET_PAGE_MASK << 1);
+    env->CP0_EntryLo0 = lo0;
+    env->CP0_EntryLo1 = lo1;
+    env->tlb->helper_tlbwr(env);
+
+    env->CP0_EntryHi = entryhi;
+    env->CP0_PageMask = pagemask;
+    env->CP0_EntryLo0 = entrylo0;
+    env->CP0_EntryLo1 = entrylo1;
+    return true;
+}
 #endif
 
 static void raise_mmu_exception(CPUMIPSState *env, target_ulong address,
@@ -255,6 +545,9 @@ static void raise_mmu_exception(CPUMIPSState *env, target_ulong address,
             exception = EXCP_TLBL;
         }
         error_code |= EXCP_TLB_NOMATCH;
+#if !defined(CONFIG_USER_ONLY)
+        cpu_mips_perf_event(env, MIPS_PERF_TLB_REFILLS);
+#endif
         break;
     case TLBRET_INVALID:
         /* TLB match with no valid bit */
@@ -343,6 +636,13 @@ int mips_cpu_handle_mmu_fault(CPUState *cs, vaddr address, int rw,
     access_type = ACCESS_INT;
     ret = get_physical_address(env, &physical, &prot,
                                address, rw, access_type);
+    if (ret == TLBRET_NOMATCH && (env->CP0_Config3 & (1 << CP0C3_PW)) &&
+        (env->CP0_PWCtl & (1 << CP0PC_PWEN)) &&
+        page_table_walk_refill(env, address)) {
+        cpu_mips_perf_event(env, MIPS_PERF_TLB_REFILLS);
+        ret = get_physical_address(env, &physical, &prot,
+                                   address, rw, access_type);
+    }
     qemu_log_mask(CPU_LOG_MMU,
              "%s address=%" VADDR_PRIx " ret %d physical " TARGET_FMT_plx
              " prot %d\n",
@@ -490,10 +790,12 @@ void mips_cpu_do_interrupt(CPUState *cs)
                  " %s exception\n",
                  __func__, env->active_tc.PC, env->CP0_EPC, name);
 //    }
+    cpu_mips_idle_end(env);
     if (cs->exception_index == EXCP_EXT_INTERRUPT &&
         (env->hflags & MIPS_HFLAG_DM)) {
         cs->exception_index = EXCP_DINT;
     }
+    cpu_mips_perf_event(env, MIPS_PERF_EXCEPTIONS);
     offset = 0x180;
     switch (cs->exception_index) {
     case EXCP_DSS:
@@ -762,6 +1064,10 @@ void mips_cpu_do_interrupt(CPUState *cs)
                  env->CP0_Status, env->CP0_Cause, env->CP0_BadVAddr,
                  env->CP0_DEPC);
     }
+    /* The handler runs in another mode */
+    if (env->perf_enabled) {
+        cpu_mips_perf_update(env);
+    }
 #endif
     cs->exception_index = EXCP_NONE;
 }
@@ -791,22 +1097,19 @@ void r4k_invalidate_tlb (CPUMIPSState *env, int idx, int use_extra)
     CPUState *cs;
     r4k_tlb_t *tlb;
     target_ulong addr;
-    target_ulong end;
-    uint8_t ASID = env->CP0_EntryHi & 0xFF;
     target_ulong mask;
 
     tlb = &env->tlb->mmu.r4k.tlb[idx];
-    /* The qemu TLB is flushed when the ASID changes, so no need to
-       flush these entries again.  */
-    if (tlb->G == 0 && tlb->ASID != ASID) {
-        return;
-    }
+    /* Entries of other ASIDs must be flushed as well, the qemu TLB
+       keeps their translations aside until the ASID comes back.  */
 
     if (use_extra && env->tlb->tlb_in_use < MIPS_TLB_MAX) {
         /* For tlbwr, we can shadow the discarded entry into
            a new (fake) TLB entry, as long as the guest can not
            tell that it's there.  */
+        r4k_tlb_index_remove(env, env->tlb->tlb_in_use);
         env->tlb->mmu.r4k.tlb[env->tlb->tlb_in_use] = *tlb;
+        r4k_tlb_index_add(env, env->tlb->tlb_in_use);
         env->tlb->tlb_in_use++;
         return;
     }
@@ -821,11 +1124,7 @@ void r4k_invalidate_tlb (CPUMIPSState *env, int idx, int use_extra)
             addr |= 0x3FFFFF0000000000ULL;
         }
 #endif
-        end = addr | (mask >> 1);
-        while (addr < end) {
-            tlb_flush_page(cs, addr);
-            addr += TARGET_PAGE_SIZE;
-        }
+        tlb_flush_range(cs, addr, (mask >> 1) + 1);
     }
     if (tlb->V1) {
         cs = CPU(cpu);
@@ -835,11 +1134,7 @@ void r4k_invalidate_tlb (CPUMIPSState *env, int idx, int use_extra)
             addr |= 0x3FFFFF0000000000ULL;
         }
 #endif
-        end = addr | mask;
-        while (addr - 1 < end) {
-            tlb_flush_page(cs, addr);
-            addr += TARGET_PAGE_SIZE;
-        }
+        tlb_flush_range(cs, addr, (mask >> 1) + 1);
     }
 }
 #endif
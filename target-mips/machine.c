@@ -9,12 +9,24 @@ static int cpu_post_load(void *opaque, int version_id)
 
     restore_fp_status(env);
     restore_msa_fp_status(env);
+    /* The performance counters were loaded up to date */
+    env->perf_active = 0;
+    env->perf_irq = false;
+    cpu_mips_perf_update(env);
     compute_hflags(env);
     restore_pamask(env);
+    r4k_tlb_index_rebuild(env);
 
     return 0;
 }
 
+static void cpu_pre_save(void *opaque)
+{
+    MIPSCPU *cpu = opaque;
+
+    cpu_mips_perf_update(&cpu->env);
+}
+
 /* FPU state */
 
 static int get_fpr(QEMUFile *f, void *pv, size_t size)
@@ -201,10 +213,18 @@ const VMStateDescription vmstate_tlb = {
 
 /* MIPS CPU state */
 
+/* Before version 9 only the first performance control register was
+   migrated, as CP0_Performance0.  */
+static bool version_before_9(void *opaque, int version_id)
+{
+    return version_id < 9;
+}
+
 const VMStateDescription vmstate_mips_cpu = {
     .name = "cpu",
-    .version_id = 7,
+    .version_id = 9,
     .minimum_version_id = 7,
+    .pre_save = cpu_pre_save,
     .post_load = cpu_post_load,
     .fields = (VMStateField[]) {
         /* Active TC */
@@ -244,7 +264,11 @@ const VMStateDescription vmstate_mips_cpu = {
         VMSTATE_UINTTL(env.CP0_Context, MIPSCPU),
         VMSTATE_INT32(env.CP0_PageMask, MIPSCPU),
         VMSTATE_INT32(env.CP0_PageGrain, MIPSCPU),
+        VMSTATE_UINTTL_V(env.CP0_PWBase, MIPSCPU, 8),
+        VMSTATE_UINTTL_V(env.CP0_PWField, MIPSCPU, 8),
+        VMSTATE_UINTTL_V(env.CP0_PWSize, MIPSCPU, 8),
         VMSTATE_INT32(env.CP0_Wired, MIPSCPU),
+        VMSTATE_INT32_V(env.CP0_PWCtl, MIPSCPU, 8),
         VMSTATE_INT32(env.CP0_SRSConf0, MIPSCPU),
         VMSTATE_INT32(env.CP0_SRSConf1, MIPSCPU),
         VMSTATE_INT32(env.CP0_SRSConf2, MIPSCPU),
@@ -278,7 +302,11 @@ const VMStateDescription vmstate_mips_cpu = {
         VMSTATE_INT32(env.CP0_Framemask, MIPSCPU),
         VMSTATE_INT32(env.CP0_Debug, MIPSCPU),
         VMSTATE_UINTTL(env.CP0_DEPC, MIPSCPU),
-        VMSTATE_INT32(env.CP0_Performance0, MIPSCPU),
+        VMSTATE_UINT32_TEST(env.CP0_PerfCtl[0], MIPSCPU, version_before_9),
+        VMSTATE_UINT32_ARRAY_V(env.CP0_PerfCtl, MIPSCPU, MIPS_PERF_COUNTERS,
+                               9),
+        VMSTATE_UINT32_ARRAY_V(env.CP0_PerfCnt, MIPSCPU, MIPS_PERF_COUNTERS,
+                               9),
         VMSTATE_UINT64(env.CP0_TagLo, MIPSCPU),
         VMSTATE_INT32(env.CP0_DataLo, MIPSCPU),
         VMSTATE_INT32(env.CP0_TagHi, MIPSCPU),
@@ -22,6 +22,8 @@
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
 #include "sysemu/kvm.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
 
 /*****************************************************************************/
 /* Exceptions processing helpers */
@@ -42,6 +44,11 @@ void helper_raise_exception_debug(CPUMIPSState *env)
     do_raise_exception(env, EXCP_DEBUG, 0);
 }
 
+void *helper_lookup_tb_ptr(CPUMIPSState *env)
+{
+    return tb_lookup_tc_ptr(CPU(mips_env_get_cpu(env)));
+}
+
 static void raise_exception(CPUMIPSState *env, uint32_t exception)
 {
     do_raise_exception(env, exception, 0);
@@ -301,17 +308,27 @@ HELPER_LD_ATOMIC(lld, ld, 0x7)
 #endif
 #undef HELPER_LD_ATOMIC
 
-#define HELPER_ST_ATOMIC(name, ld_insn, st_insn, almask)                      \
+/* The store is a compare-and-swap on the host memory when the page is
+   plain RAM in the TLB, so that it is atomic with respect to the other
+   vCPU threads.  */
+#define HELPER_ST_ATOMIC(name, ld_insn, st_insn, almask, bits)                \
 target_ulong helper_##name(CPUMIPSState *env, target_ulong arg1,              \
                            target_ulong arg2, int mem_idx)                    \
 {                                                                             \
     target_long tmp;                                                          \
+    uint##bits##_t *host;                                                     \
                                                                               \
     if (arg2 & almask) {                                                      \
         env->CP0_BadVAddr = arg2;                                             \
         do_raise_exception(env, EXCP_AdES, GETPC());                          \
     }                                                                         \
     if (do_translate_address(env, arg2, 1, GETPC()) == env->lladdr) {         \
+        host = tlb_vaddr_to_host(env, arg2, 1, mem_idx);                      \
+        if (host) {                                                           \
+            uint##bits##_t old = tswap##bits(env->llval);                     \
+                                                                              \
+            return atomic_cmpxchg(host, old, tswap##bits(arg1)) == old;       \
+        }                                                                     \
         tmp = do_##ld_insn(env, arg2, mem_idx, GETPC());                      \
         if (tmp == env->llval) {                                              \
             do_##st_insn(env, arg2, arg1, mem_idx, GETPC());                  \
@@ -320,71 +337,23 @@ target_ulong helper_##name(CPUMIPSState *env, target_ulong arg1,              \
     }                                                                         \
     return 0;                                                                 \
 }
-HELPER_ST_ATOMIC(sc, lw, sw, 0x3)
+HELPER_ST_ATOMIC(sc, lw, sw, 0x3, 32)
 #ifdef TARGET_MIPS64
-HELPER_ST_ATOMIC(scd, ld, sd, 0x7)
+HELPER_ST_ATOMIC(scd, ld, sd, 0x7, 64)
 #endif
 #undef HELPER_ST_ATOMIC
 #endif
 
-#ifdef TARGET_WORDS_BIGENDIAN
-#define GET_LMASK(v) ((v) & 3)
-#define GET_OFFSET(addr, offset) (addr + (offset))
-#else
-#define GET_LMASK(v) (((v) & 3) ^ 3)
-#define GET_OFFSET(addr, offset) (addr - (offset))
-#endif
-
-void helper_swl(CPUMIPSState *env, target_ulong arg1, target_ulong arg2,
-                int mem_idx)
-{
-    do_sb(env, arg2, (uint8_t)(arg1 >> 24), mem_idx, GETPC());
-
-    if (GET_LMASK(arg2) <= 2) {
-        do_sb(env, GET_OFFSET(arg2, 1), (uint8_t)(arg1 >> 16), mem_idx,
-              GETPC());
-    }
-
-    if (GET_LMASK(arg2) <= 1) {
-        do_sb(env, GET_OFFSET(arg2, 2), (uint8_t)(arg1 >> 8), mem_idx,
-              GETPC());
-    }
-
-    if (GET_LMASK(arg2) == 0) {
-        do_sb(env, GET_OFFSET(arg2, 3), (uint8_t)arg1, mem_idx,
-              GETPC());
-    }
-}
-
-void helper_swr(CPUMIPSState *env, target_ulong arg1, target_ulong arg2,
-                int mem_idx)
-{
-    do_sb(env, arg2, (uint8_t)arg1, mem_idx, GETPC());
-
-    if (GET_LMASK(arg2) >= 1) {
-        do_sb(env, GET_OFFSET(arg2, -1), (uint8_t)(arg1 >> 8), mem_idx,
-              GETPC());
-    }
-
-    if (GET_LMASK(arg2) >= 2) {
-        do_sb(env, GET_OFFSET(arg2, -2), (uint8_t)(arg1 >> 16), mem_idx,
-              GETPC());
-    }
-
-    if (GET_LMASK(arg2) == 3) {
-        do_sb(env, GET_OFFSET(arg2, -3), (uint8_t)(arg1 >> 24), mem_idx,
-              GETPC());
-    }
-}
-
 #if defined(TARGET_MIPS64)
 /* "half" load and stores.  We must do the memory access inline,
    or fault handling won't work.  */
 
 #ifdef TARGET_WORDS_BIGENDIAN
 #define GET_LMASK64(v) ((v) & 7)
+#define GET_OFFSET(addr, offset) (addr + (offset))
 #else
 #define GET_LMASK64(v) (((v) & 7) ^ 7)
+#define GET_OFFSET(addr, offset) (addr - (offset))
 #endif
 
 void helper_sdl(CPUMIPSState *env, target_ulong arg1, target_ulong arg2,
@@ -708,6 +677,26 @@ static void sync_c0_entryhi(CPUMIPSState *cpu, int tc)
 }
 
 /* CP0 helpers */
+
+/* Cause and the CP0 timer are shared with the devices, which update them
+   with the global mutex held.  A vCPU only runs without it when it has a
+   thread of its own.  */
+static bool cp0_lock_shared(void)
+{
+    if (qemu_mutex_iothread_locked()) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
+static void cp0_unlock_shared(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 target_ulong helper_mfc0_mvpcontrol(CPUMIPSState *env)
 {
     return env->mvp->CP0_MVPControl;
@@ -1315,6 +1304,21 @@ void helper_mtc0_pagegrain(CPUMIPSState *env, target_ulong arg1)
     restore_pamask(env);
 }
 
+void helper_mtc0_pwfield(CPUMIPSState *env, target_ulong arg1)
+{
+    env->CP0_PWField = arg1 & 0x3FFFFFFF;
+}
+
+void helper_mtc0_pwsize(CPUMIPSState *env, target_ulong arg1)
+{
+#if defined(TARGET_MIPS64)
+    env->CP0_PWSize = arg1 & 0x7FFFFFFF;
+#else
+    /* 32-bit pointers only */
+    env->CP0_PWSize = arg1 & 0x3FFFFFFF;
+#endif
+}
+
 void helper_mtc0_wired(CPUMIPSState *env, target_ulong arg1)
 {
     if (env->insn_flags & ISA_MIPS32R6) {
@@ -1326,6 +1330,13 @@ void helper_mtc0_wired(CPUMIPSState *env, target_ulong arg1)
     }
 }
 
+void helper_mtc0_pwctl(CPUMIPSState *env, target_ulong arg1)
+{
+    /* Dual page huge directory entries are not implemented */
+    env->CP0_PWCtl = arg1 & ((1U << CP0PC_PWEN) | (1 << CP0PC_HUGEPG) |
+                             (0x3F << CP0PC_PSN));
+}
+
 void helper_mtc0_srsconf0(CPUMIPSState *env, target_ulong arg1)
 {
     env->CP0_SRSConf0 |= arg1 & env->CP0_SRSConf0_rw_bitmask;
@@ -1377,7 +1388,10 @@ void helper_mtc0_hwrena(CPUMIPSState *env, target_ulong arg1)
 
 void helper_mtc0_count(CPUMIPSState *env, target_ulong arg1)
 {
+    bool locked = cp0_lock_shared();
+
     cpu_mips_store_count(env, arg1);
+    cp0_unlock_shared(locked);
 }
 
 void helper_mtc0_entryhi(CPUMIPSState *env, target_ulong arg1)
@@ -1409,9 +1423,10 @@ void helper_mtc0_entryhi(CPUMIPSState *env, target_ulong arg1)
     if (env->CP0_Config3 & (1 << CP0C3_MT)) {
         sync_c0_entryhi(env, env->current_tc);
     }
-    /* If the ASID changes, flush qemu's TLB.  */
-    if ((old & 0xFF) != (val & 0xFF))
-        cpu_mips_tlb_flush(env, 1);
+    /* If the ASID changes, switch qemu's TLB.  */
+    if ((old & 0xFF) != (val & 0xFF)) {
+        cpu_mips_tlb_set_asid(env, val & 0xFF);
+    }
 }
 
 void helper_mttc0_entryhi(CPUMIPSState *env, target_ulong arg1)
@@ -1425,7 +1440,10 @@ void helper_mttc0_entryhi(CPUMIPSState *env, target_ulong arg1)
 
 void helper_mtc0_compare(CPUMIPSState *env, target_ulong arg1)
 {
+    bool locked = cp0_lock_shared();
+
     cpu_mips_store_compare(env, arg1);
+    cp0_unlock_shared(locked);
 }
 
 void helper_mtc0_status(CPUMIPSState *env, target_ulong arg1)
@@ -1476,15 +1494,20 @@ void helper_mtc0_srsctl(CPUMIPSState *env, target_ulong arg1)
 
 void helper_mtc0_cause(CPUMIPSState *env, target_ulong arg1)
 {
+    bool locked = cp0_lock_shared();
+
     cpu_mips_store_cause(env, arg1);
+    cp0_unlock_shared(locked);
 }
 
 void helper_mttc0_cause(CPUMIPSState *env, target_ulong arg1)
 {
     int other_tc = env->CP0_VPEControl & (0xff << CP0VPECo_TargTC);
     CPUMIPSState *other = mips_cpu_map_tc(env, &other_tc);
+    bool locked = cp0_lock_shared();
 
     cpu_mips_store_cause(other, arg1);
+    cp0_unlock_shared(locked);
 }
 
 target_ulong helper_mftc0_epc(CPUMIPSState *env)
@@ -1624,7 +1647,7 @@ void helper_mttc0_debug(CPUMIPSState *env, target_ulong arg1)
 
 void helper_mtc0_performance0(CPUMIPSState *env, target_ulong arg1)
 {
-    env->CP0_Performance0 = arg1 & 0x000007ff;
+    env->CP0_PerfCtl[0] = arg1 & 0x000007ff;
 }
 
 void helper_mtc0_taglo(CPUMIPSState *env, target_ulong arg1)
@@ -1873,6 +1896,7 @@ static void r4k_fill_tlb(CPUMIPSState *env, int idx)
         tlb->EHINV = 1;
         return;
     }
+    r4k_tlb_index_remove(env, idx);
     tlb->EHINV = 0;
     tlb->VPN = env->CP0_EntryHi & (TARGET_PAGE_MASK << 1);
 #if defined(TARGET_MIPS64)
@@ -1893,6 +1917,7 @@ static void r4k_fill_tlb(CPUMIPSState *env, int idx)
     tlb->XI1 = (env->CP0_EntryLo1 >> CP0EnLo_XI) & 1;
     tlb->RI1 = (env->CP0_EntryLo1 >> CP0EnLo_RI) & 1;
     tlb->PFN[1] = get_tlb_pfn_from_entrylo(env->CP0_EntryLo1) << 12;
+    r4k_tlb_index_add(env, idx);
 }
 
 void r4k_helper_tlbinv(CPUMIPSState *env)
@@ -1907,7 +1932,7 @@ void r4k_helper_tlbinv(CPUMIPSState *env)
             tlb->EHINV = 1;
         }
     }
-    cpu_mips_tlb_flush(env, 1);
+    cpu_mips_tlb_flush(env, 0);
 }
 
 void r4k_helper_tlbinvf(CPUMIPSState *env)
@@ -1963,46 +1988,18 @@ void r4k_helper_tlbwr(CPUMIPSState *env)
 
 void r4k_helper_tlbp(CPUMIPSState *env)
 {
-    r4k_tlb_t *tlb;
-    target_ulong mask;
-    target_ulong tag;
-    target_ulong VPN;
     uint8_t ASID;
     int i;
 
     ASID = env->CP0_EntryHi & 0xFF;
-    for (i = 0; i < env->tlb->nb_tlb; i++) {
-        tlb = &env->tlb->mmu.r4k.tlb[i];
-        /* 1k pages are not supported. */
-        mask = tlb->PageMask | ~(TARGET_PAGE_MASK << 1);
-        tag = env->CP0_EntryHi & ~mask;
-        VPN = tlb->VPN & ~mask;
-#if defined(TARGET_MIPS64)
-        tag &= env->SEGMask;
-#endif
-        /* Check ASID, virtual page number & size */
-        if ((tlb->G == 1 || tlb->ASID == ASID) && VPN == tag && !tlb->EHINV) {
-            /* TLB match */
-            env->CP0_Index = i;
-            break;
-        }
-    }
-    if (i == env->tlb->nb_tlb) {
+    i = r4k_tlb_lookup(env, env->CP0_EntryHi, ASID);
+    if (i >= 0 && i < env->tlb->nb_tlb) {
+        /* TLB match */
+        env->CP0_Index = i;
+    } else {
         /* No match.  Discard any shadow entries, if any of them match.  */
-        for (i = env->tlb->nb_tlb; i < env->tlb->tlb_in_use; i++) {
-            tlb = &env->tlb->mmu.r4k.tlb[i];
-            /* 1k pages are not supported. */
-            mask = tlb->PageMask | ~(TARGET_PAGE_MASK << 1);
-            tag = env->CP0_EntryHi & ~mask;
-            VPN = tlb->VPN & ~mask;
-#if defined(TARGET_MIPS64)
-            tag &= env->SEGMask;
-#endif
-            /* Check ASID, virtual page number & size */
-            if ((tlb->G == 1 || tlb->ASID == ASID) && VPN == tag) {
-                r4k_mips_tlb_flush_extra (env, i);
-                break;
-            }
+        if (i >= 0) {
+            r4k_mips_tlb_flush_extra (env, i);
         }
 
         env->CP0_Index |= 0x80000000;
@@ -2029,10 +2026,6 @@ void r4k_helper_tlbr(CPUMIPSState *env)
     idx = (env->CP0_Index & ~0x80000000) % env->tlb->nb_tlb;
     tlb = &env->tlb->mmu.r4k.tlb[idx];
 
-    /* If this will change the current ASID, flush qemu's TLB.  */
-    if (ASID != tlb->ASID)
-        cpu_mips_tlb_flush (env, 1);
-
     r4k_mips_tlb_flush_extra(env, env->tlb->nb_tlb);
 
     if (tlb->EHINV) {
@@ -2052,6 +2045,11 @@ void r4k_helper_tlbr(CPUMIPSState *env)
                         ((uint64_t)tlb->XI1 << CP0EnLo_XI) | (tlb->C1 << 3) |
                         get_entrylo_pfn_from_tlb(tlb->PFN[1] >> 12);
     }
+
+    /* If this changed the current ASID, switch qemu's TLB.  */
+    if ((env->CP0_EntryHi & 0xFF) != ASID) {
+        tlb_set_asid(CPU(mips_env_get_cpu(env)), env->CP0_EntryHi & 0xFF);
+    }
 }
 
 void helper_tlbwi(CPUMIPSState *env)
@@ -2221,7 +2219,7 @@ target_ulong helper_rdhwr_ccres(CPUMIPSState *env)
 target_ulong helper_rdhwr_performance(CPUMIPSState *env)
 {
     check_hwrena(env, 4);
-    return env->CP0_Performance0;
+    return (int32_t)env->CP0_PerfCtl[0];
 }
 
 target_ulong helper_rdhwr_xnp(CPUMIPSState *env)
@@ -2260,6 +2258,7 @@ void helper_wait(CPUMIPSState *env)
 {
     CPUState *cs = CPU(mips_env_get_cpu(env));
 
+    env->idle_halted = false;
     cs->halted = 1;
     cpu_reset_interrupt(cs, CPU_INTERRUPT_WAKE);
     /* Last instruction in the block, PC was updated before
@@ -2269,6 +2268,55 @@ void helper_wait(CPUMIPSState *env)
 
 #if !defined(CONFIG_USER_ONLY)
 
+/* Called at the start of each iteration of a loop that, as found by the
+   translator, only waits for an interrupt or for Count to advance.  Once
+   the loop has spun for a while the CPU halts like on a wait instruction
+   but wakes up on any interrupt, even a masked one.  With all CPUs halted,
+   icount warps the virtual clock to the next timer deadline.  A loop
+   polling Count halts for at most IDLE_LOOP_SLICE ns at a time, so that
+   it does not overshoot the value it waits for by more than that. */
+#define IDLE_LOOP_SPINS 64
+#define IDLE_LOOP_SLICE 100000
+
+/* The CPU runs again after an idle loop halt: back in the loop, or in
+   the handler of the interrupt that woke it up */
+void cpu_mips_idle_end(CPUMIPSState *env)
+{
+    if (env->idle_halted) {
+        env->idle_halted = false;
+        timer_del(env->idle_timer);
+        cpu_reset_interrupt(CPU(mips_env_get_cpu(env)), CPU_INTERRUPT_WAKE);
+    }
+}
+
+void helper_idle_loop(CPUMIPSState *env, uint32_t reads_count)
+{
+    CPUState *cs = CPU(mips_env_get_cpu(env));
+
+    cpu_mips_idle_end(env);
+    if (env->idle_loop_pc != env->active_tc.PC) {
+        env->idle_loop_pc = env->active_tc.PC;
+        env->idle_loop_count = 0;
+        return;
+    }
+    if (++env->idle_loop_count < IDLE_LOOP_SPINS) {
+        return;
+    }
+    env->idle_loop_count = 0;
+    if (cs->interrupt_request & CPU_INTERRUPT_HARD) {
+        return;
+    }
+
+    if (reads_count) {
+        timer_mod(env->idle_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + IDLE_LOOP_SLICE);
+    }
+    env->idle_halted = true;
+    cs->halted = 1;
+    /* First instruction in the block, PC was updated before */
+    raise_exception(env, EXCP_HLT);
+}
+
 void mips_cpu_do_unaligned_access(CPUState *cs, vaddr addr,
                                   int access_type, int is_user,
                                   uintptr_t retaddr)
@@ -0,0 +1,260 @@
+/*
+ *  MIPS performance counter emulation helpers for QEMU.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cpu.h"
+#include "exec/helper-proto.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+
+/*
+ * The CPU models with perf_counters, which also set Config1.PC, have
+ * MIPS_PERF_COUNTERS pairs of PerfCtl/PerfCnt registers; for the others
+ * PerfCtl0 is a plain register.  The Event field of PerfCtl selects one of:
+ *
+ *   MIPS_PERF_CYCLES       CPU cycles, at CCRes times the Count rate
+ *   MIPS_PERF_INSNS        instructions
+ *   MIPS_PERF_TLB_REFILLS  TLB refills, by exception or page table walker
+ *   MIPS_PERF_EXCEPTIONS   exceptions and interrupts taken
+ *   MIPS_PERF_SLOW_LOADS   loads that missed the softmmu fast path
+ *   MIPS_PERF_SLOW_STORES  stores that missed the softmmu fast path
+ *
+ * The K, S, U and EXL bits select the modes counted in; perf_active has
+ * a bit for each counter enabled in the current mode.  Rare events are
+ * added to PerfCnt as they happen.  Cycles and instructions are counted
+ * lazily instead: perf_snap is the value of the event source when the
+ * counter was last brought up to date by perf_fold.  Instructions come
+ * from perf_insns, which the TBs translated with MIPS_HFLAG_PERF advance
+ * by their length on entry.
+ *
+ * An enabled counter reaching bit 31 with IE set raises the performance
+ * counter interrupt, which stays up until software clears the bit.  For
+ * instructions the generated code calls helper_perf_insns_irq once
+ * perf_insns reaches perf_insns_irq, for cycles perf_timer fires.
+ */
+
+#define PERF_CNT_OVERFLOW 0x80000000U
+
+static inline int perf_event(uint32_t ctl)
+{
+    return (ctl >> CP0PfC_EVENT) & 0x3f;
+}
+
+static inline bool perf_lazy(int event)
+{
+    return event == MIPS_PERF_CYCLES || event == MIPS_PERF_INSNS;
+}
+
+static uint64_t perf_source(CPUMIPSState *env, int event)
+{
+    return event == MIPS_PERF_CYCLES ? cpu_mips_get_cycles(env)
+                                     : env->perf_insns;
+}
+
+static bool perf_counts_in_mode(CPUMIPSState *env, uint32_t ctl)
+{
+    if ((env->CP0_Status & (1 << CP0St_ERL)) ||
+        (env->hflags & MIPS_HFLAG_DM)) {
+        return false;
+    }
+    if (env->CP0_Status & (1 << CP0St_EXL)) {
+        return ctl & (1 << CP0PfC_EXL);
+    }
+    switch (env->hflags & MIPS_HFLAG_KSU) {
+    case MIPS_HFLAG_UM:
+        return ctl & (1 << CP0PfC_U);
+    case MIPS_HFLAG_SM:
+        return ctl & (1 << CP0PfC_S);
+    default:
+        return ctl & (1 << CP0PfC_K);
+    }
+}
+
+/* Bring the lazily counted events up to date.  Needs the events that
+   were counted, i.e. must come before any change to PerfCtl. */
+static void perf_fold(CPUMIPSState *env)
+{
+    uint64_t now;
+    int i, event;
+
+    for (i = 0; i < MIPS_PERF_COUNTERS; i++) {
+        event = perf_event(env->CP0_PerfCtl[i]);
+        if ((env->perf_active & (1 << i)) && perf_lazy(event)) {
+            now = perf_source(env, event);
+            env->CP0_PerfCnt[i] += now - env->perf_snap[i];
+            env->perf_snap[i] = now;
+        }
+    }
+}
+
+static void perf_set_irq(CPUMIPSState *env, bool level)
+{
+    CPUState *cs = CPU(mips_env_get_cpu(env));
+    int ippci = (env->CP0_IntCtl >> CP0IntCtl_IPPC1) & 0x7;
+    int ipti = (env->CP0_IntCtl >> CP0IntCtl_IPTI) & 0x7;
+    uint32_t can_do_io = cs->can_do_io;
+    bool locked;
+
+    if (level == env->perf_irq) {
+        return;
+    }
+    env->perf_irq = level;
+    if (env->insn_flags & ISA_MIPS32R2) {
+        if (level) {
+            env->CP0_Cause |= 1 << CP0Ca_PCI;
+        } else {
+            env->CP0_Cause &= ~(1 << CP0Ca_PCI);
+        }
+    }
+
+    /* A vCPU with a thread of its own runs without the global mutex */
+    locked = !qemu_mutex_iothread_locked();
+    if (locked) {
+        qemu_mutex_lock_iothread();
+    }
+    if (level) {
+        /* Overflows happen at any instruction, not only at I/O ones as
+           icount wants.  Like any other, the interrupt is taken at the
+           end of the TB, so this does not make icount less precise. */
+        cs->can_do_io = 1;
+        qemu_irq_raise(env->irq[ippci]);
+        cs->can_do_io = can_do_io;
+    } else if (ippci != ipti || ((env->insn_flags & ISA_MIPS32R2) &&
+                                 !(env->CP0_Cause & (1 << CP0Ca_TI)))) {
+        /* Without Cause.TI a pending timer interrupt cannot be told
+           apart, the next write to Compare lowers a shared line */
+        qemu_irq_lower(env->irq[ippci]);
+    }
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+static void perf_timer_cb(void *opaque)
+{
+    cpu_mips_perf_update(opaque);
+}
+
+/* Recompute the counting state after a change of mode or of the counter
+   registers */
+void cpu_mips_perf_update(CPUMIPSState *env)
+{
+    uint64_t insns_irq = UINT64_MAX;
+    uint64_t cycles_irq = UINT64_MAX;
+    bool irq = false;
+    uint32_t ctl, cnt;
+    int i, event;
+
+    perf_fold(env);
+
+    env->perf_active = 0;
+    env->perf_events = 0;
+    env->perf_enabled = false;
+    env->hflags &= ~MIPS_HFLAG_PERF;
+    for (i = 0; i < MIPS_PERF_COUNTERS; i++) {
+        ctl = env->CP0_PerfCtl[i];
+        cnt = env->CP0_PerfCnt[i];
+        event = perf_event(ctl);
+        if ((ctl & (1 << CP0PfC_IE)) && (cnt & PERF_CNT_OVERFLOW)) {
+            irq = true;
+        }
+        if (!env->perf_counters || event > MIPS_PERF_SLOW_STORES) {
+            continue;
+        }
+        if (ctl & ((1 << CP0PfC_U) | (1 << CP0PfC_S) | (1 << CP0PfC_K) |
+                   (1 << CP0PfC_EXL))) {
+            env->perf_enabled = true;
+        }
+        if (!perf_counts_in_mode(env, ctl)) {
+            continue;
+        }
+        env->perf_active |= 1 << i;
+        env->perf_events |= 1 << event;
+        if (!perf_lazy(event)) {
+            continue;
+        }
+
+        env->perf_snap[i] = perf_source(env, event);
+        if (event == MIPS_PERF_INSNS) {
+            env->hflags |= MIPS_HFLAG_PERF;
+        }
+        if ((ctl & (1 << CP0PfC_IE)) && !(cnt & PERF_CNT_OVERFLOW)) {
+            uint64_t when = env->perf_snap[i] + (PERF_CNT_OVERFLOW - cnt);
+
+            if (event == MIPS_PERF_INSNS) {
+                insns_irq = MIN(insns_irq, when);
+            } else {
+                cycles_irq = MIN(cycles_irq, when);
+            }
+        }
+    }
+    env->perf_insns_irq = insns_irq;
+
+    if (cycles_irq != UINT64_MAX) {
+        if (!env->perf_timer) {
+            env->perf_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                           perf_timer_cb, env);
+        }
+        timer_mod(env->perf_timer, cpu_mips_cycles_to_ns(env, cycles_irq));
+    } else if (env->perf_timer) {
+        timer_del(env->perf_timer);
+    }
+
+    perf_set_irq(env, irq);
+}
+
+/* Count an event that happened once, see cpu_mips_perf_event */
+void cpu_mips_perf_count(CPUMIPSState *env, int event)
+{
+    int i;
+
+    for (i = 0; i < MIPS_PERF_COUNTERS; i++) {
+        if ((env->perf_active & (1 << i)) &&
+            perf_event(env->CP0_PerfCtl[i]) == event &&
+            ++env->CP0_PerfCnt[i] == PERF_CNT_OVERFLOW &&
+            (env->CP0_PerfCtl[i] & (1 << CP0PfC_IE))) {
+            perf_set_irq(env, true);
+        }
+    }
+}
+
+void helper_perf_insns_irq(CPUMIPSState *env)
+{
+    cpu_mips_perf_update(env);
+}
+
+void helper_mtc0_perfctl(CPUMIPSState *env, target_ulong arg1, uint32_t sel)
+{
+    uint32_t *ctl = &env->CP0_PerfCtl[sel];
+
+    perf_fold(env);
+    env->perf_active = 0;
+    *ctl = (*ctl & (1U << CP0PfC_M)) | (arg1 & 0x000007ff);
+    cpu_mips_perf_update(env);
+}
+
+void helper_mtc0_perfcnt(CPUMIPSState *env, target_ulong arg1, uint32_t sel)
+{
+    perf_fold(env);
+    env->CP0_PerfCnt[sel] = arg1;
+    cpu_mips_perf_update(env);
+}
+
+target_ulong helper_mfc0_perfcnt(CPUMIPSState *env, uint32_t sel)
+{
+    perf_fold(env);
+    return (int32_t)env->CP0_PerfCnt[sel];
+}
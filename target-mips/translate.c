@@ -30,6 +30,7 @@
 #include "exec/helper-gen.h"
 #include "sysemu/kvm.h"
 #include "exec/semihost.h"
+#include "qemu/error-report.h"
 
 #include "trace-tcg.h"
 
@@ -1418,6 +1419,7 @@ typedef struct DisasContext {
     int bstate;
     target_ulong btarget;
     bool ulri;
+    bool pw;
     int kscrexist;
     bool rxi;
     int ie;
@@ -1427,6 +1429,11 @@ typedef struct DisasContext {
     bool mvh;
     int CP0_LLAddr_shift;
     bool ps;
+    bool perf;
+    /* superblock state: jump slots used, where the trace goes on */
+    int jmp_used;
+    target_ulong trace_pc;
+    CPUState *cs;
 } DisasContext;
 
 enum {
@@ -1605,6 +1612,15 @@ static inline void generate_exception_err(DisasContext *ctx, int excp, int err)
     TCGv_i32 texcp = tcg_const_i32(excp);
     TCGv_i32 terr = tcg_const_i32(err);
     save_cpu_state(ctx, 1);
+    if (ctx->tb->flags & MIPS_HFLAG_PERF) {
+        /* The TB counted this instruction, which does not complete */
+        TCGv_i64 t0 = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(t0, cpu_env, offsetof(CPUMIPSState, perf_insns));
+        tcg_gen_subi_i64(t0, t0, 1);
+        tcg_gen_st_i64(t0, cpu_env, offsetof(CPUMIPSState, perf_insns));
+        tcg_temp_free_i64(t0);
+    }
     gen_helper_raise_exception_err(cpu_env, texcp, terr);
     tcg_temp_free_i32(terr);
     tcg_temp_free_i32(texcp);
@@ -2279,6 +2295,95 @@ static void gen_ld(DisasContext *ctx, uint32_t opc,
     tcg_temp_free(t0);
 }
 
+/* Store the bytes [o, o + n) of the aligned word at addr - k, taken from
+   val >> shift as the big or little-endian word that SWL and SWR build */
+static void gen_st_lr_part(DisasContext *ctx, TCGv addr, TCGv val, int k,
+                           int o, int n, int shift)
+{
+    TCGv t0 = tcg_temp_new();
+    TCGv t1 = tcg_temp_new();
+
+#ifdef TARGET_WORDS_BIGENDIAN
+    shift += 8 * (4 - o - n);
+#else
+    shift += 8 * o;
+#endif
+    tcg_gen_addi_tl(t0, addr, o - k);
+    tcg_gen_shri_tl(t1, val, shift);
+    tcg_gen_qemu_st_tl(t1, t0, ctx->mem_idx,
+                       n == 4 ? MO_TEUL : n == 2 ? MO_TEUW : MO_UB);
+    tcg_temp_free(t1);
+    tcg_temp_free(t0);
+}
+
+/* SWL and SWR only touch the aligned word of their address, so they
+   never cross a page.  Branch on the low bits of the address and store
+   the bytes with at most two aligned stores, the first one at the
+   address itself so that a fault reports it.  */
+static void gen_st_lr(DisasContext *ctx, uint32_t opc, TCGv addr, TCGv val)
+{
+    TCGv t0 = tcg_temp_local_new();
+    TCGv t1 = tcg_temp_local_new();
+    TCGv t2 = tcg_temp_local_new();
+    TCGLabel *l_done = gen_new_label();
+    int k, lmask, lo, hi, n, shift;
+    bool from_addr;
+
+#ifdef TARGET_WORDS_BIGENDIAN
+    from_addr = opc == OPC_SWL;
+#else
+    from_addr = opc == OPC_SWR;
+#endif
+    tcg_gen_mov_tl(t0, addr);
+    tcg_gen_mov_tl(t1, val);
+    tcg_gen_andi_tl(t2, t0, 3);
+    for (k = 0; k < 4; k++) {
+        TCGLabel *l_next = NULL;
+
+        if (k < 3) {
+            l_next = gen_new_label();
+            tcg_gen_brcondi_tl(TCG_COND_NE, t2, k, l_next);
+        }
+#ifdef TARGET_WORDS_BIGENDIAN
+        lmask = k;
+#else
+        lmask = k ^ 3;
+#endif
+        /* the bytes to store, from the address to the end of the word
+           or from the start of the word to the address */
+        lo = from_addr ? k : 0;
+        hi = from_addr ? 3 : k;
+        shift = opc == OPC_SWL ? 8 * lmask : -8 * (3 - lmask);
+
+        /* the largest aligned part at the address */
+        n = 4;
+        while (k % n || k + n - 1 > hi) {
+            n >>= 1;
+        }
+        gen_st_lr_part(ctx, t0, t1, k, k, n, shift);
+        if (lo < k) {
+            /* then an aligned part over the bytes before it, which may
+               store the byte at the address again */
+            n = 1;
+            while (n < k - lo) {
+                n <<= 1;
+            }
+            gen_st_lr_part(ctx, t0, t1, k, lo, n, shift);
+        } else if (k + n - 1 < hi) {
+            gen_st_lr_part(ctx, t0, t1, k, k + n, hi - k - n + 1, shift);
+        }
+
+        if (k < 3) {
+            tcg_gen_br(l_done);
+            gen_set_label(l_next);
+        }
+    }
+    gen_set_label(l_done);
+    tcg_temp_free(t2);
+    tcg_temp_free(t1);
+    tcg_temp_free(t0);
+}
+
 /* Store */
 static void gen_st (DisasContext *ctx, uint32_t opc, int rt,
                     int base, int16_t offset)
@@ -2313,10 +2418,8 @@ static void gen_st (DisasContext *ctx, uint32_t opc, int rt,
         tcg_gen_qemu_st_tl(t1, t0, ctx->mem_idx, MO_8);
         break;
     case OPC_SWL:
-        gen_helper_0e2i(swl, t1, t0, ctx->mem_idx);
-        break;
     case OPC_SWR:
-        gen_helper_0e2i(swr, t1, t0, ctx->mem_idx);
+        gen_st_lr(ctx, opc, t0, t1);
         break;
     }
     tcg_temp_free(t0);
@@ -4184,12 +4287,50 @@ static void gen_trap (DisasContext *ctx, uint32_t opc,
     tcg_temp_free(t1);
 }
 
+/* kseg0 and kseg1 are not mapped through the TLB: in kernel mode their
+   translation is the same for every ASID and never changes. */
+static inline bool is_unmapped_kseg(DisasContext *ctx, target_ulong addr)
+{
+    return (ctx->hflags & MIPS_HFLAG_KSU) == MIPS_HFLAG_KM &&
+           (target_long)addr >= (int32_t)0x80000000UL &&
+           (target_long)addr < (int32_t)0xC0000000UL;
+}
+
+/* Continue at cpu_PC without going back to cpu_exec when the next TB
+   is in the jump cache.  Used for jumps to register, mostly returns.  */
+static inline void gen_lookup_and_goto_ptr(void)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+
+        gen_helper_lookup_tb_ptr(ptr, cpu_env);
+        tcg_gen_goto_ptr(ptr);
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
 static inline void gen_goto_tb(DisasContext *ctx, int n, target_ulong dest)
 {
     TranslationBlock *tb;
     tb = ctx->tb;
-    if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK) &&
-        likely(!ctx->singlestep_enabled)) {
+    if (likely(!ctx->singlestep_enabled)) {
+        /* a superblock may have more exits than jump slots */
+        if (ctx->jmp_used & (1 << n)) {
+            n ^= 1;
+        }
+        if (ctx->jmp_used & (1 << n)) {
+            gen_save_pc(dest);
+            gen_lookup_and_goto_ptr();
+            return;
+        }
+        ctx->jmp_used |= 1 << n;
+        /* a jump to another page is chained too, see tb_chain_jump */
+        if ((tb->pc & TARGET_PAGE_MASK) != (dest & TARGET_PAGE_MASK) &&
+            is_unmapped_kseg(ctx, dest)) {
+            tb->jmp_fixed |= 1 << n;
+        }
         tcg_gen_goto_tb(n);
         gen_save_pc(dest);
         tcg_gen_exit_tb((uintptr_t)tb + n);
@@ -4910,6 +5051,70 @@ static inline void gen_mfc0_unimplemented(DisasContext *ctx, TCGv arg)
         }                                       \
     } while (0)
 
+/* Read Count.  Without icount, the extrapolation of cpu_mips_get_count
+   from the host cycle counter is inlined while it is valid.  */
+static void gen_mfc0_count(DisasContext *ctx, TCGv arg)
+{
+    TCGv_i64 ticks, t0;
+    TCGv count;
+    TCGLabel *slow, *done;
+
+    if (ctx->tb->cflags & CF_USE_ICOUNT) {
+        /* Mark as an IO operation because we read the time.  */
+        gen_io_start();
+        gen_helper_mfc0_count(arg, cpu_env);
+        gen_io_end();
+        /* Reading count may raise the timer interrupt, which is taken
+           at the end of the TB.  With icount the read must be the last
+           instruction of the TB.  */
+        ctx->bstate = BS_STOP;
+        return;
+    }
+
+    ticks = tcg_temp_local_new_i64();
+    t0 = tcg_temp_new_i64();
+    count = tcg_temp_local_new();
+    slow = gen_new_label();
+    done = gen_new_label();
+
+    tcg_gen_host_ticks_i64(ticks);
+    tcg_gen_ld_i64(t0, cpu_env, offsetof(CPUMIPSState, count_fast_ticks));
+    tcg_gen_sub_i64(ticks, ticks, t0);
+    tcg_gen_ld_i64(t0, cpu_env, offsetof(CPUMIPSState, count_fast_limit));
+    tcg_gen_brcond_i64(TCG_COND_GEU, ticks, t0, slow);
+    tcg_gen_ld_i64(t0, cpu_env, offsetof(CPUMIPSState, count_fast_scale));
+    tcg_gen_mul_i64(ticks, ticks, t0);
+    tcg_gen_shri_i64(ticks, ticks, 32);
+    tcg_gen_ld32u_i64(t0, cpu_env, offsetof(CPUMIPSState, count_fast_base));
+    tcg_gen_add_i64(ticks, ticks, t0);
+    tcg_gen_trunc_i64_tl(count, ticks);
+    tcg_gen_ext32s_tl(count, count);
+    tcg_gen_br(done);
+    gen_set_label(slow);
+    /* Reading count may raise the timer interrupt, which is taken at the
+       end of the TB.  */
+    gen_helper_mfc0_count(count, cpu_env);
+    gen_set_label(done);
+    tcg_gen_mov_tl(arg, count);
+
+    tcg_temp_free_i64(ticks);
+    tcg_temp_free_i64(t0);
+    tcg_temp_free(count);
+}
+
+static void gen_mfc0_perfcnt(DisasContext *ctx, TCGv arg, int counter)
+{
+    /* Counting cycles reads the time */
+    if (ctx->tb->cflags & CF_USE_ICOUNT) {
+        gen_io_start();
+    }
+    gen_helper_1e0i(mfc0_perfcnt, arg, counter);
+    if (ctx->tb->cflags & CF_USE_ICOUNT) {
+        gen_io_end();
+        ctx->bstate = BS_STOP;
+    }
+}
+
 static void gen_mfc0(DisasContext *ctx, TCGv arg, int reg, int sel)
 {
     const char *rn = "invalid";
@@ -5108,6 +5313,21 @@ static void gen_mfc0(DisasContext *ctx, TCGv arg, int reg, int sel)
             gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_PageGrain));
             rn = "PageGrain";
             break;
+        case 5:
+            CP0_CHECK(ctx->pw);
+            gen_mfc0_load64(arg, offsetof(CPUMIPSState, CP0_PWBase));
+            rn = "PWBase";
+            break;
+        case 6:
+            CP0_CHECK(ctx->pw);
+            gen_mfc0_load64(arg, offsetof(CPUMIPSState, CP0_PWField));
+            rn = "PWField";
+            break;
+        case 7:
+            CP0_CHECK(ctx->pw);
+            gen_mfc0_load64(arg, offsetof(CPUMIPSState, CP0_PWSize));
+            rn = "PWSize";
+            break;
         default:
             goto cp0_unimplemented;
         }
@@ -5143,6 +5363,11 @@ static void gen_mfc0(DisasContext *ctx, TCGv arg, int reg, int sel)
             gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_SRSConf4));
             rn = "SRSConf4";
             break;
+        case 6:
+            CP0_CHECK(ctx->pw);
+            gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_PWCtl));
+            rn = "PWCtl";
+            break;
         default:
             goto cp0_unimplemented;
         }
@@ -5182,17 +5407,7 @@ static void gen_mfc0(DisasContext *ctx, TCGv arg, int reg, int sel)
     case 9:
         switch (sel) {
         case 0:
-            /* Mark as an IO operation because we read the time.  */
-            if (ctx->tb->cflags & CF_USE_ICOUNT) {
-                gen_io_start();
-	    }
-            gen_helper_mfc0_count(arg, cpu_env);
-            if (ctx->tb->cflags & CF_USE_ICOUNT) {
-                gen_io_end();
-            }
-            /* Break the TB to be able to take timer interrupts immediately
-               after reading count.  */
-            ctx->bstate = BS_STOP;
+            gen_mfc0_count(ctx, arg);
             rn = "Count";
             break;
         /* 6,7 are implementation dependent */
@@ -5423,21 +5638,24 @@ static void gen_mfc0(DisasContext *ctx, TCGv arg, int reg, int sel)
     case 25:
         switch (sel) {
         case 0:
-            gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_Performance0));
+            gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_PerfCtl[0]));
             rn = "Performance0";
             break;
         case 1:
-//            gen_helper_mfc0_performance1(arg);
+            CP0_CHECK(ctx->perf);
+            gen_mfc0_perfcnt(ctx, arg, 0);
             rn = "Performance1";
-//            break;
+            break;
         case 2:
-//            gen_helper_mfc0_performance2(arg);
+            CP0_CHECK(ctx->perf);
+            gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_PerfCtl[1]));
             rn = "Performance2";
-//            break;
+            break;
         case 3:
-//            gen_helper_mfc0_performance3(arg);
+            CP0_CHECK(ctx->perf);
+            gen_mfc0_perfcnt(ctx, arg, 1);
             rn = "Performance3";
-//            break;
+            break;
         case 4:
 //            gen_helper_mfc0_performance4(arg);
             rn = "Performance4";
@@ -5734,6 +5952,21 @@ static void gen_mtc0(DisasContext *ctx, TCGv arg, int reg, int sel)
             rn = "PageGrain";
             ctx->bstate = BS_STOP;
             break;
+        case 5:
+            CP0_CHECK(ctx->pw);
+            tcg_gen_st_tl(arg, cpu_env, offsetof(CPUMIPSState, CP0_PWBase));
+            rn = "PWBase";
+            break;
+        case 6:
+            CP0_CHECK(ctx->pw);
+            gen_helper_mtc0_pwfield(cpu_env, arg);
+            rn = "PWField";
+            break;
+        case 7:
+            CP0_CHECK(ctx->pw);
+            gen_helper_mtc0_pwsize(cpu_env, arg);
+            rn = "PWSize";
+            break;
         default:
             goto cp0_unimplemented;
         }
@@ -5769,6 +6002,11 @@ static void gen_mtc0(DisasContext *ctx, TCGv arg, int reg, int sel)
             gen_helper_mtc0_srsconf4(cpu_env, arg);
             rn = "SRSConf4";
             break;
+        case 6:
+            CP0_CHECK(ctx->pw);
+            gen_helper_mtc0_pwctl(cpu_env, arg);
+            rn = "PWCtl";
+            break;
         default:
             goto cp0_unimplemented;
         }
@@ -6068,21 +6306,37 @@ static void gen_mtc0(DisasContext *ctx, TCGv arg, int reg, int sel)
     case 25:
         switch (sel) {
         case 0:
-            gen_helper_mtc0_performance0(cpu_env, arg);
+            if (!ctx->perf) {
+                gen_helper_mtc0_performance0(cpu_env, arg);
+                rn = "Performance0";
+                break;
+            }
+            save_cpu_state(ctx, 1);
+            gen_helper_0e1i(mtc0_perfctl, arg, 0);
+            /* BS_STOP isn't good enough here, hflags may have changed. */
+            gen_save_pc(ctx->pc + 4);
+            ctx->bstate = BS_EXCP;
             rn = "Performance0";
             break;
         case 1:
-//            gen_helper_mtc0_performance1(arg);
+            CP0_CHECK(ctx->perf);
+            gen_helper_0e1i(mtc0_perfcnt, arg, 0);
             rn = "Performance1";
-//            break;
+            break;
         case 2:
-//            gen_helper_mtc0_performance2(arg);
+            CP0_CHECK(ctx->perf);
+            save_cpu_state(ctx, 1);
+            gen_helper_0e1i(mtc0_perfctl, arg, 1);
+            /* BS_STOP isn't good enough here, hflags may have changed. */
+            gen_save_pc(ctx->pc + 4);
+            ctx->bstate = BS_EXCP;
             rn = "Performance2";
-//            break;
+            break;
         case 3:
-//            gen_helper_mtc0_performance3(arg);
+            CP0_CHECK(ctx->perf);
+            gen_helper_0e1i(mtc0_perfcnt, arg, 1);
             rn = "Performance3";
-//            break;
+            break;
         case 4:
 //            gen_helper_mtc0_performance4(arg);
             rn = "Performance4";
@@ -6370,6 +6624,21 @@ static void gen_dmfc0(DisasContext *ctx, TCGv arg, int reg, int sel)
             gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_PageGrain));
             rn = "PageGrain";
             break;
+        case 5:
+            CP0_CHECK(ctx->pw);
+            tcg_gen_ld_tl(arg, cpu_env, offsetof(CPUMIPSState, CP0_PWBase));
+            rn = "PWBase";
+            break;
+        case 6:
+            CP0_CHECK(ctx->pw);
+            tcg_gen_ld_tl(arg, cpu_env, offsetof(CPUMIPSState, CP0_PWField));
+            rn = "PWField";
+            break;
+        case 7:
+            CP0_CHECK(ctx->pw);
+            tcg_gen_ld_tl(arg, cpu_env, offsetof(CPUMIPSState, CP0_PWSize));
+            rn = "PWSize";
+            break;
         default:
             goto cp0_unimplemented;
         }
@@ -6405,6 +6674,11 @@ static void gen_dmfc0(DisasContext *ctx, TCGv arg, int reg, int sel)
             gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_SRSConf4));
             rn = "SRSConf4";
             break;
+        case 6:
+            CP0_CHECK(ctx->pw);
+            gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_PWCtl));
+            rn = "PWCtl";
+            break;
         default:
             goto cp0_unimplemented;
         }
@@ -6443,17 +6717,7 @@ static void gen_dmfc0(DisasContext *ctx, TCGv arg, int reg, int sel)
     case 9:
         switch (sel) {
         case 0:
-            /* Mark as an IO operation because we read the time.  */
-            if (ctx->tb->cflags & CF_USE_ICOUNT) {
-                gen_io_start();
-            }
-            gen_helper_mfc0_count(arg, cpu_env);
-            if (ctx->tb->cflags & CF_USE_ICOUNT) {
-                gen_io_end();
-            }
-            /* Break the TB to be able to take timer interrupts immediately
-               after reading count.  */
-            ctx->bstate = BS_STOP;
+            gen_mfc0_count(ctx, arg);
             rn = "Count";
             break;
         /* 6,7 are implementation dependent */
@@ -6678,21 +6942,24 @@ static void gen_dmfc0(DisasContext *ctx, TCGv arg, int reg, int sel)
     case 25:
         switch (sel) {
         case 0:
-            gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_Performance0));
+            gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_PerfCtl[0]));
             rn = "Performance0";
             break;
         case 1:
-//            gen_helper_dmfc0_performance1(arg);
+            CP0_CHECK(ctx->perf);
+            gen_mfc0_perfcnt(ctx, arg, 0);
             rn = "Performance1";
-//            break;
+            break;
         case 2:
-//            gen_helper_dmfc0_performance2(arg);
+            CP0_CHECK(ctx->perf);
+            gen_mfc0_load32(arg, offsetof(CPUMIPSState, CP0_PerfCtl[1]));
             rn = "Performance2";
-//            break;
+            break;
         case 3:
-//            gen_helper_dmfc0_performance3(arg);
+            CP0_CHECK(ctx->perf);
+            gen_mfc0_perfcnt(ctx, arg, 1);
             rn = "Performance3";
-//            break;
+            break;
         case 4:
 //            gen_helper_dmfc0_performance4(arg);
             rn = "Performance4";
@@ -6976,6 +7243,21 @@ static void gen_dmtc0(DisasContext *ctx, TCGv arg, int reg, int sel)
             gen_helper_mtc0_pagegrain(cpu_env, arg);
             rn = "PageGrain";
             break;
+        case 5:
+            CP0_CHECK(ctx->pw);
+            tcg_gen_st_tl(arg, cpu_env, offsetof(CPUMIPSState, CP0_PWBase));
+            rn = "PWBase";
+            break;
+        case 6:
+            CP0_CHECK(ctx->pw);
+            gen_helper_mtc0_pwfield(cpu_env, arg);
+            rn = "PWField";
+            break;
+        case 7:
+            CP0_CHECK(ctx->pw);
+            gen_helper_mtc0_pwsize(cpu_env, arg);
+            rn = "PWSize";
+            break;
         default:
             goto cp0_unimplemented;
         }
@@ -7011,6 +7293,11 @@ static void gen_dmtc0(DisasContext *ctx, TCGv arg, int reg, int sel)
             gen_helper_mtc0_srsconf4(cpu_env, arg);
             rn = "SRSConf4";
             break;
+        case 6:
+            CP0_CHECK(ctx->pw);
+            gen_helper_mtc0_pwctl(cpu_env, arg);
+            rn = "PWCtl";
+            break;
         default:
             goto cp0_unimplemented;
         }
@@ -7310,21 +7597,37 @@ static void gen_dmtc0(DisasContext *ctx, TCGv arg, int reg, int sel)
     case 25:
         switch (sel) {
         case 0:
-            gen_helper_mtc0_performance0(cpu_env, arg);
+            if (!ctx->perf) {
+                gen_helper_mtc0_performance0(cpu_env, arg);
+                rn = "Performance0";
+                break;
+            }
+            save_cpu_state(ctx, 1);
+            gen_helper_0e1i(mtc0_perfctl, arg, 0);
+            /* BS_STOP isn't good enough here, hflags may have changed. */
+            gen_save_pc(ctx->pc + 4);
+            ctx->bstate = BS_EXCP;
             rn = "Performance0";
             break;
         case 1:
-//            gen_helper_mtc0_performance1(cpu_env, arg);
+            CP0_CHECK(ctx->perf);
+            gen_helper_0e1i(mtc0_perfcnt, arg, 0);
             rn = "Performance1";
-//            break;
+            break;
         case 2:
-//            gen_helper_mtc0_performance2(cpu_env, arg);
+            CP0_CHECK(ctx->perf);
+            save_cpu_state(ctx, 1);
+            gen_helper_0e1i(mtc0_perfctl, arg, 1);
+            /* BS_STOP isn't good enough here, hflags may have changed. */
+            gen_save_pc(ctx->pc + 4);
+            ctx->bstate = BS_EXCP;
             rn = "Performance2";
-//            break;
+            break;
         case 3:
-//            gen_helper_mtc0_performance3(cpu_env, arg);
+            CP0_CHECK(ctx->perf);
+            gen_helper_0e1i(mtc0_perfcnt, arg, 1);
             rn = "Performance3";
-//            break;
+            break;
         case 4:
 //            gen_helper_mtc0_performance4(cpu_env, arg);
             rn = "Performance4";
@@ -10436,10 +10739,35 @@ static inline void clear_branch_hflags(DisasContext *ctx)
     }
 }
 
+/* Whether a superblock can go on with the code at dest after a branch.
+   Its instructions must come in address order on its first page, so
+   that it covers them all, see tb_gen_superblock.  */
+static bool trace_can_follow(DisasContext *ctx, bool trace, int insn_bytes,
+                             target_ulong dest)
+{
+    target_ulong page_end = (ctx->tb->pc & TARGET_PAGE_MASK) +
+                            TARGET_PAGE_SIZE;
+
+    return trace && dest >= ctx->pc + insn_bytes && dest < page_end;
+}
+
+/* Go on with the code at dest, which trace_can_follow accepted */
+static inline void trace_follow(DisasContext *ctx, target_ulong dest)
+{
+    ctx->bstate = BS_NONE;
+    ctx->trace_pc = dest;
+}
+
 static void gen_branch(DisasContext *ctx, int insn_bytes)
 {
     if (ctx->hflags & MIPS_HFLAG_BMASK) {
         int proc_hflags = ctx->hflags & MIPS_HFLAG_BMASK;
+        /* A superblock stops at branches the delay slot already ends the
+           TB at, the CPU state is not known at translation time there */
+        bool trace = (ctx->tb->cflags & CF_SUPERBLOCK) &&
+                     !(ctx->tb->flags & MIPS_HFLAG_PERF) &&
+                     !(ctx->hflags & MIPS_HFLAG_M16) &&
+                     !ctx->singlestep_enabled && ctx->bstate == BS_NONE;
         /* Branches completion */
         clear_branch_hflags(ctx);
         ctx->bstate = BS_BRANCH;
@@ -10452,18 +10780,47 @@ static void gen_branch(DisasContext *ctx, int insn_bytes)
             /* unconditional branch */
             if (proc_hflags & MIPS_HFLAG_BX) {
                 tcg_gen_xori_i32(hflags, hflags, MIPS_HFLAG_M16);
+            } else if (trace_can_follow(ctx, trace, insn_bytes,
+                                        ctx->btarget)) {
+                trace_follow(ctx, ctx->btarget);
+                break;
             }
             gen_goto_tb(ctx, 0, ctx->btarget);
             break;
         case MIPS_HFLAG_BL:
             /* blikely taken case */
+            if (trace_can_follow(ctx, trace, insn_bytes, ctx->btarget)) {
+                trace_follow(ctx, ctx->btarget);
+                break;
+            }
             gen_goto_tb(ctx, 0, ctx->btarget);
             break;
         case MIPS_HFLAG_BC:
             /* Conditional branch */
             {
                 TCGLabel *l1 = gen_new_label();
-
+                target_ulong side = ctx->pc + insn_bytes;
+                target_ulong dest = ctx->btarget;
+                TCGCond cond = TCG_COND_NE;
+
+                /* A superblock goes on along the path that ran most.  The
+                   other one is the exception, it does without a jump slot
+                   so that both are left for where the superblock ends. */
+                if (trace_can_follow(ctx, trace, insn_bytes, side) &&
+                    trace_can_follow(ctx, trace, insn_bytes, dest)) {
+                    if (tb_hotness(ctx->cs, side, 0, ctx->hflags) >=
+                        tb_hotness(ctx->cs, dest, 0, ctx->hflags)) {
+                        side = ctx->btarget;
+                        dest = ctx->pc + insn_bytes;
+                        cond = TCG_COND_EQ;
+                    }
+                    tcg_gen_brcondi_tl(cond, bcond, 0, l1);
+                    gen_save_pc(side);
+                    gen_lookup_and_goto_ptr();
+                    gen_set_label(l1);
+                    trace_follow(ctx, dest);
+                    break;
+                }
                 tcg_gen_brcondi_tl(TCG_COND_NE, bcond, 0, l1);
                 gen_goto_tb(ctx, 1, ctx->pc + insn_bytes);
                 gen_set_label(l1);
@@ -10491,8 +10848,10 @@ static void gen_branch(DisasContext *ctx, int insn_bytes)
             if (ctx->singlestep_enabled) {
                 save_cpu_state(ctx, 0);
                 gen_helper_raise_exception_debug(cpu_env);
+                tcg_gen_exit_tb(0);
+            } else {
+                gen_lookup_and_goto_ptr();
             }
-            tcg_gen_exit_tb(0);
             break;
         default:
             fprintf(stderr, "unknown branch 0x%x\n", proc_hflags);
@@ -19586,6 +19945,184 @@ static void decode_opc(CPUMIPSState *env, DisasContext *ctx)
     }
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* Instructions counted by the performance counters, see perf_helper.c.
+   A TB translated with MIPS_HFLAG_PERF adds its length to perf_insns on
+   entry.  As for icount, the length is patched in at the end.  */
+static TCGArg *perf_insns_arg;
+
+static void gen_perf_insns_start(void)
+{
+    TCGv_i64 insns = tcg_temp_new_i64();
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i32 imm = tcg_temp_new_i32();
+    TCGLabel *l1 = gen_new_label();
+    int i;
+
+    tcg_gen_movi_i32(imm, 0xdeadbeef);
+    i = tcg_ctx.gen_last_op_idx;
+    i = tcg_ctx.gen_op_buf[i].args;
+    perf_insns_arg = &tcg_ctx.gen_opparam_buf[i + 1];
+    tcg_gen_extu_i32_i64(t0, imm);
+    tcg_temp_free_i32(imm);
+
+    tcg_gen_ld_i64(insns, cpu_env, offsetof(CPUMIPSState, perf_insns));
+    tcg_gen_add_i64(insns, insns, t0);
+    tcg_gen_st_i64(insns, cpu_env, offsetof(CPUMIPSState, perf_insns));
+    tcg_gen_ld_i64(t0, cpu_env, offsetof(CPUMIPSState, perf_insns_irq));
+    tcg_gen_brcond_i64(TCG_COND_LTU, insns, t0, l1);
+    gen_helper_perf_insns_irq(cpu_env);
+    gen_set_label(l1);
+    tcg_temp_free_i64(insns);
+    tcg_temp_free_i64(t0);
+}
+
+/* Idle loops.  A short loop back to the start of the block that does not
+   store and, besides CP0 Count and Status, only reads registers it does
+   not write itself cannot make progress other than by waiting for time
+   to pass or for an interrupt.  Such a block calls helper_idle_loop on
+   every iteration.  */
+#define IDLE_LOOP_MAX_INSNS 8
+
+enum {
+    IDLE_INSN_NONE,
+    IDLE_INSN_OP,
+    IDLE_INSN_BRANCH,
+};
+
+static int idle_loop_insn(uint32_t insn, target_ulong pc, uint32_t *uses,
+                          uint32_t *defs, target_ulong *target,
+                          bool *reads_count)
+{
+    int rs = (insn >> 21) & 0x1f;
+    int rt = (insn >> 16) & 0x1f;
+    int rd = (insn >> 11) & 0x1f;
+    target_long offset = (int16_t)insn << 2;
+
+    *uses = 0;
+    *defs = 0;
+    switch (MASK_OP_MAJOR(insn)) {
+    case OPC_SPECIAL:
+        switch (MASK_SPECIAL(insn)) {
+        case OPC_SLL:
+        case OPC_SRL:
+        case OPC_SRA:
+            *uses = 1 << rt;
+            *defs = 1 << rd;
+            return IDLE_INSN_OP;
+        case OPC_MOVZ:
+        case OPC_MOVN:
+            *uses = (1 << rs) | (1 << rt) | (1 << rd);
+            *defs = 1 << rd;
+            return IDLE_INSN_OP;
+        case OPC_SLLV:
+        case OPC_SRLV:
+        case OPC_SRAV:
+        case OPC_ADDU:
+        case OPC_SUBU:
+        case OPC_AND:
+        case OPC_OR:
+        case OPC_XOR:
+        case OPC_NOR:
+        case OPC_SLT:
+        case OPC_SLTU:
+            *uses = (1 << rs) | (1 << rt);
+            *defs = 1 << rd;
+            return IDLE_INSN_OP;
+        }
+        break;
+    case OPC_ADDIU:
+    case OPC_SLTI:
+    case OPC_SLTIU:
+    case OPC_ANDI:
+    case OPC_ORI:
+    case OPC_XORI:
+        *uses = 1 << rs;
+        *defs = 1 << rt;
+        return IDLE_INSN_OP;
+    case OPC_LUI:
+        if (rs == 0) {
+            *defs = 1 << rt;
+            return IDLE_INSN_OP;
+        }
+        break;
+    case OPC_CP0:
+        if ((MASK_CP0(insn)) == OPC_MFC0 && (insn & 7) == 0 &&
+            (rd == 9 || rd == 12)) {
+            *defs = 1 << rt;
+            *reads_count |= rd == 9;
+            return IDLE_INSN_OP;
+        }
+        break;
+    case OPC_BEQ:
+    case OPC_BNE:
+        *uses = (1 << rs) | (1 << rt);
+        *target = pc + 4 + offset;
+        return IDLE_INSN_BRANCH;
+    case OPC_BLEZ:
+    case OPC_BGTZ:
+        if (rt == 0) {
+            *uses = 1 << rs;
+            *target = pc + 4 + offset;
+            return IDLE_INSN_BRANCH;
+        }
+        break;
+    case OPC_REGIMM:
+        if ((MASK_REGIMM(insn)) == OPC_BLTZ ||
+            (MASK_REGIMM(insn)) == OPC_BGEZ) {
+            *uses = 1 << rs;
+            *target = pc + 4 + offset;
+            return IDLE_INSN_BRANCH;
+        }
+        break;
+    case OPC_J:
+        *target = ((pc + 4) & ~(target_ulong)0x0FFFFFFF) |
+                  ((insn & 0x03FFFFFF) << 2);
+        return IDLE_INSN_BRANCH;
+    }
+    return IDLE_INSN_NONE;
+}
+
+static bool is_idle_loop(CPUMIPSState *env, DisasContext *ctx,
+                         bool *reads_count)
+{
+    target_ulong pc = ctx->pc;
+    target_ulong target;
+    uint32_t uses, defs, live_in = 0, written = 0;
+    bool in_slot = false;
+    int i, kind;
+
+    *reads_count = false;
+    if (ctx->singlestep_enabled ||
+        (ctx->hflags & (MIPS_HFLAG_M16 | MIPS_HFLAG_BMASK))) {
+        return false;
+    }
+    for (i = 0; i < IDLE_LOOP_MAX_INSNS; i++, pc += 4) {
+        if ((pc & TARGET_PAGE_MASK) != (ctx->pc & TARGET_PAGE_MASK)) {
+            return false;
+        }
+        kind = idle_loop_insn(cpu_ldl_code(env, pc), pc, &uses, &defs,
+                              &target, reads_count);
+        if (kind == IDLE_INSN_NONE || (in_slot && kind != IDLE_INSN_OP)) {
+            return false;
+        }
+        live_in |= uses & ~written;
+        written |= defs & ~1;
+        if (in_slot) {
+            /* no state may be carried from one iteration to the next */
+            return !(live_in & written);
+        }
+        if (kind == IDLE_INSN_BRANCH) {
+            if (target != ctx->pc) {
+                return false;
+            }
+            in_slot = true;
+        }
+    }
+    return false;
+}
+#endif
+
 void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
 {
     MIPSCPU *cpu = mips_env_get_cpu(env);
@@ -19597,6 +20134,10 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
     int max_insns;
     int insn_bytes;
     int is_slot;
+    int end_reason = TB_END_UNKNOWN;
+#if !defined(CONFIG_USER_ONLY)
+    bool reads_count;
+#endif
 
     pc_start = tb->pc;
     next_page_start = (pc_start & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
@@ -19619,8 +20160,13 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
     /* Restore delay slot state from the tb context.  */
     ctx.hflags = (uint32_t)tb->flags; /* FIXME: maybe use 64 bits here? */
     ctx.ulri = (env->CP0_Config3 >> CP0C3_ULRI) & 1;
+    ctx.pw = (env->CP0_Config3 >> CP0C3_PW) & 1;
+    ctx.perf = env->perf_counters;
     ctx.ps = ((env->active_fpu.fcr0 >> FCR0_PS) & 1) ||
              (env->insn_flags & (INSN_LOONGSON2E | INSN_LOONGSON2F));
+    ctx.jmp_used = 0;
+    ctx.trace_pc = -1;
+    ctx.cs = cs;
     restore_cpu_state(env, &ctx);
 #ifdef CONFIG_USER_ONLY
         ctx.mem_idx = MIPS_HFLAG_UM;
@@ -19640,8 +20186,29 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
 
     LOG_DISAS("\ntb %p idx %d hflags %04x\n", tb, ctx.mem_idx, ctx.hflags);
     gen_tb_start(tb);
+#if !defined(CONFIG_USER_ONLY)
+    if (tb->flags & MIPS_HFLAG_PERF) {
+        gen_perf_insns_start();
+    }
+    if (cpu->idle_detect && is_idle_loop(env, &ctx, &reads_count)) {
+        TCGv_i32 t0 = tcg_const_i32(reads_count);
+
+        save_cpu_state(&ctx, 1);
+        /* Arming the idle timer reads the clock, a few instructions
+           early in icount mode */
+        if (reads_count && (tb->cflags & CF_USE_ICOUNT)) {
+            gen_io_start();
+        }
+        gen_helper_idle_loop(cpu_env, t0);
+        if (reads_count && (tb->cflags & CF_USE_ICOUNT)) {
+            gen_io_end();
+        }
+        tcg_temp_free_i32(t0);
+    }
+#endif
     while (ctx.bstate == BS_NONE) {
-        tcg_gen_insn_start(ctx.pc, ctx.hflags & MIPS_HFLAG_BMASK, ctx.btarget);
+        tcg_gen_insn_start(ctx.pc, ctx.hflags & MIPS_HFLAG_BMASK, ctx.btarget,
+                           num_insns);
         num_insns++;
 
         if (unlikely(cpu_breakpoint_test(cs, ctx.pc, BP_ANY))) {
@@ -19653,6 +20220,7 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
                properly cleared -- thus we increment the PC here so that
                the logic setting tb->size below does the right thing.  */
             ctx.pc += 4;
+            end_reason = TB_END_DEBUG;
             goto done_generating;
         }
 
@@ -19694,28 +20262,44 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
             gen_branch(&ctx, insn_bytes);
         }
         ctx.pc += insn_bytes;
+        if (ctx.trace_pc != -1) {
+            ctx.pc = ctx.trace_pc;
+            ctx.trace_pc = -1;
+        }
 
         /* Execute a branch and its delay slot as a single instruction.
            This is what GDB expects and is consistent with what the
            hardware does (e.g. if a delay slot instruction faults, the
            reported PC is the PC of the branch).  */
         if (cs->singlestep_enabled && (ctx.hflags & MIPS_HFLAG_BMASK) == 0) {
+            end_reason = TB_END_DEBUG;
             break;
         }
 
         if (ctx.pc >= next_page_start) {
+            end_reason = TB_END_PAGE;
             break;
         }
 
         if (tcg_op_buf_full()) {
+            end_reason = TB_END_FULL;
             break;
         }
 
-        if (num_insns >= max_insns)
+        if (num_insns >= max_insns) {
+            end_reason = (tb->cflags & CF_LAST_IO) ? TB_END_IO
+                                                   : TB_END_MAX_INSNS;
             break;
+        }
 
-        if (singlestep)
+        if (singlestep) {
+            end_reason = TB_END_DEBUG;
             break;
+        }
+    }
+    if (ctx.bstate != BS_NONE) {
+        end_reason = ctx.bstate == BS_STOP ? TB_END_STOP :
+                     ctx.bstate == BS_EXCP ? TB_END_EXCP : TB_END_BRANCH;
     }
     if (tb->cflags & CF_LAST_IO) {
         gen_io_end();
@@ -19742,9 +20326,15 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
     }
 done_generating:
     gen_tb_end(tb, num_insns);
+#if !defined(CONFIG_USER_ONLY)
+    if (tb->flags & MIPS_HFLAG_PERF) {
+        *perf_insns_arg = num_insns;
+    }
+#endif
 
     tb->size = ctx.pc - pc_start;
     tb->icount = num_insns;
+    tb->end_reason = end_reason;
 
 #ifdef DEBUG_DISAS
     LOG_DISAS("\n");
@@ -19901,6 +20491,12 @@ MIPSCPU *cpu_mips_init(const char *cpu_model)
     cpu = MIPS_CPU(object_new(TYPE_MIPS_CPU));
     env = &cpu->env;
     env->cpu_model = def;
+    if (cpu->page_walker && !def->page_walker) {
+        error_report("CPU model '%s' has no hardware page table walker",
+                     def->name);
+        object_unref(OBJECT(cpu));
+        return NULL;
+    }
 
 #ifndef CONFIG_USER_ONLY
     mmu_init(env, def);
@@ -19927,6 +20523,9 @@ void cpu_state_reset(CPUMIPSState *env)
     env->CP0_Config1 = env->cpu_model->CP0_Config1;
     env->CP0_Config2 = env->cpu_model->CP0_Config2;
     env->CP0_Config3 = env->cpu_model->CP0_Config3;
+    if (cpu->page_walker) {
+        env->CP0_Config3 |= 1 << CP0C3_PW;
+    }
     env->CP0_Config4 = env->cpu_model->CP0_Config4;
     env->CP0_Config4_rw_bitmask = env->cpu_model->CP0_Config4_rw_bitmask;
     env->CP0_Config5 = env->cpu_model->CP0_Config5;
@@ -19965,6 +20564,7 @@ void cpu_state_reset(CPUMIPSState *env)
     env->active_fpu.fcr0 = env->cpu_model->CP1_fcr0;
     env->msair = env->cpu_model->MSAIR;
     env->insn_flags = env->cpu_model->insn_flags;
+    env->perf_counters = env->cpu_model->perf_counters;
 
 #if defined(CONFIG_USER_ONLY)
     env->CP0_Status = (MIPS_HFLAG_UM << CP0St_KSU);
@@ -20013,8 +20613,12 @@ void cpu_state_reset(CPUMIPSState *env)
     }
     env->CP0_Status = (1 << CP0St_BEV) | (1 << CP0St_ERL);
     /* vectored interrupts not implemented, timer on int 7,
-       no performance counters. */
+       performance counters too if implemented. */
     env->CP0_IntCtl = 0xe0000000;
+    if (env->perf_counters) {
+        env->CP0_IntCtl |= 7 << CP0IntCtl_IPPC1;
+        env->CP0_PerfCtl[0] = 1U << CP0PfC_M;
+    }
     {
         int i;
 
@@ -20094,4 +20698,10 @@ void restore_state_to_opc(CPUMIPSState *env, TranslationBlock *tb,
         env->btarget = data[2];
         break;
     }
+#if !defined(CONFIG_USER_ONLY)
+    if (tb->flags & MIPS_HFLAG_PERF) {
+        /* The TB counted its instructions from data[3] on as run */
+        env->perf_insns -= tb->icount - data[3];
+    }
+#endif
 }
@@ -101,6 +101,8 @@ struct mips_def_t {
     int32_t CP0_PageGrain;
     int insn_flags;
     enum mips_mmu_types mmu_type;
+    bool perf_counters;         /* PerfCtl/PerfCnt pairs, see perf_helper.c */
+    bool page_walker;           /* may have Config3.PW, see page-walker */
 };
 
 /*****************************************************************************/
@@ -111,7 +113,7 @@ static const mips_def_t mips_defs[] =
         .name = "naive",
         .CP0_PRid = 0x00018000,
         .CP0_Config0 = MIPS_CONFIG0 | (MMU_TYPE_R4000 << CP0C0_MT),
-        .CP0_Config1 = (15 << CP0C1_MMU),
+        .CP0_Config1 = (15 << CP0C1_MMU) | (1 << CP0C1_PC),
         .CP0_Config2 = 0,
         .CP0_Config3 = 0,
         .CP0_LLAddr_rw_bitmask = 0,
@@ -123,6 +125,8 @@ static const mips_def_t mips_defs[] =
         .PABITS = 32,
         .insn_flags = CPU_MIPS32,
         .mmu_type = MMU_TYPE_R4000,
+        .perf_counters = true,
+        .page_walker = true,
     },
     {
         .name = "4Kc",
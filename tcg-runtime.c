@@ -23,12 +23,15 @@
  */
 #include <stdint.h>
 #include "qemu/host-utils.h"
+#include "qemu/timer.h"
 
 /* This file is compiled once, and thus we can't include the standard
    "exec/helper-proto.h", which has includes that are target specific.  */
 
 #include "exec/helper-head.h"
 
+#define DEF_HELPER_FLAGS_0(name, flags, ret) \
+  dh_ctype(ret) HELPER(name) (void);
 #define DEF_HELPER_FLAGS_2(name, flags, ret, t1, t2) \
   dh_ctype(ret) HELPER(name) (dh_ctype(t1), dh_ctype(t2));
 
@@ -107,3 +110,8 @@ int64_t HELPER(mulsh_i64)(int64_t arg1, int64_t arg2)
     muls64(&l, &h, arg1, arg2);
     return h;
 }
+
+int64_t HELPER(host_ticks)(void)
+{
+    return cpu_get_host_ticks();
+}
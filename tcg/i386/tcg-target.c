@@ -307,6 +307,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_ANDN        (0xf2 | P_EXT38)
 #define OPC_ADD_GvEv	(OPC_ARITH_GvEv | (ARITH_ADD << 3))
 #define OPC_BSWAP	(0xc8 | P_EXT)
+#define OPC_RDTSC	(0x31 | P_EXT)
 #define OPC_CALL_Jz	(0xe8)
 #define OPC_CMOVCC      (0x40 | P_EXT)  /* ... plus condition code */
 #define OPC_CMP_GvEv	(OPC_ARITH_GvEv | (ARITH_CMP << 3))
@@ -370,6 +371,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define SHIFT_SAR 7
 
 /* Group 3 opcode extensions for 0xf6, 0xf7.  To be used with OPC_GRP3.  */
+#define EXT3_TESTi 0
 #define EXT3_NOT   2
 #define EXT3_NEG   3
 #define EXT3_MUL   4
@@ -1102,6 +1104,17 @@ static void tcg_out_movcond64(TCGContext *s, TCGCond cond, TCGArg dest,
 static void tcg_out_branch(TCGContext *s, int call, tcg_insn_unit *dest)
 {
     intptr_t disp = tcg_pcrel_diff(s, dest) - 5;
+#if TCG_TARGET_HAS_call_table
+    void **slot = tcg_call_slot(s, dest);
+
+    if (slot) {
+        /* call/jmp *slot(%rip) */
+        tcg_out_opc(s, OPC_GRP5, 0, 0, 0);
+        tcg_out8(s, ((call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev) << 3) | 5);
+        tcg_out32(s, tcg_pcrel_diff(s, slot) - 4);
+        return;
+    }
+#endif
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
@@ -1251,6 +1264,71 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
                          offsetof(CPUTLBEntry, addend) - which);
 }
 
+#if defined(TARGET_DIRECT_RAM_MMU_IDX) && TARGET_LONG_BITS <= TCG_TARGET_REG_BITS
+#define TCG_DIRECT_RAM 1
+
+static tcg_insn_unit *tcg_out_jcc_fwd(TCGContext *s, int cond)
+{
+    tcg_insn_unit *ptr;
+
+    if (cond == JCC_JMP) {
+        tcg_out_opc(s, OPC_JMP_long, 0, 0, 0);
+    } else {
+        tcg_out_opc(s, OPC_JCC_long + cond, 0, 0, 0);
+    }
+    ptr = s->code_ptr;
+    s->code_ptr += 4;
+    return ptr;
+}
+
+/* Check that the address is in the direct RAM range of the CPU, see
+   CPUDirectRAM, and for a store that its page may be written directly.
+   L1 then holds the host address.  Otherwise one of the forward jumps
+   recorded in MISS_PTRS is taken, to the TLB lookup.  Return their
+   number.  */
+static int tcg_out_direct_ram(TCGContext *s, TCGReg addrlo, TCGMemOp opc,
+                              bool is_store, tcg_insn_unit **miss_ptrs)
+{
+    const TCGReg r0 = TCG_REG_L0;
+    const TCGReg r1 = TCG_REG_L1;
+    const TCGType ttype = TARGET_LONG_BITS == 64 ? TCG_TYPE_I64 : TCG_TYPE_I32;
+    const int trexw = TARGET_LONG_BITS == 64 ? P_REXW : 0;
+    const int hrexw = TCG_TARGET_REG_BITS == 64 ? P_REXW : 0;
+    int s_mask = (1 << (opc & MO_SIZE)) - 1;
+    int n = 0;
+
+    tcg_out_mov(s, ttype, r1, addrlo);
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + trexw, r1,
+                         TCG_AREG0, offsetof(CPUArchState, direct_ram.mask));
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_SUB << 3) + trexw, r1,
+                         TCG_AREG0, offsetof(CPUArchState, direct_ram.base));
+    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1,
+                         TCG_AREG0, offsetof(CPUArchState, direct_ram.size));
+    miss_ptrs[n++] = tcg_out_jcc_fwd(s, JCC_JAE);
+
+    /* misaligned accesses fault, in the TLB slow path */
+    if (s_mask) {
+        tcg_out_modrm(s, OPC_GRP3_Ev, EXT3_TESTi, r1);
+        tcg_out32(s, s_mask);
+        miss_ptrs[n++] = tcg_out_jcc_fwd(s, JCC_JNE);
+    }
+
+    if (is_store) {
+        tcg_out_mov(s, ttype, r0, r1);
+        tcg_out_shifti(s, SHIFT_SHR + trexw, r0, TARGET_PAGE_BITS);
+        tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r0,
+                             TCG_AREG0, offsetof(CPUArchState, direct_ram.dirty));
+        tcg_out_modrm_offset(s, OPC_MOVZBL, r0, r0, 0);
+        tcg_out_modrm(s, OPC_TESTL, r0, r0);
+        miss_ptrs[n++] = tcg_out_jcc_fwd(s, JCC_JE);
+    }
+
+    tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r1,
+                         TCG_AREG0, offsetof(CPUArchState, direct_ram.host));
+    return n;
+}
+#endif
+
 /*
  * Record the context of a call to the out of line helper code for the slow path
  * for a load or store, so that we can later generate the correct helper code
@@ -1557,6 +1635,10 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, bool is64)
 #if defined(CONFIG_SOFTMMU)
     int mem_index;
     tcg_insn_unit *label_ptr[2];
+#ifdef TCG_DIRECT_RAM
+    tcg_insn_unit *miss_ptrs[3], *done_ptr = NULL;
+    int i, n_miss;
+#endif
 #endif
 
     datalo = *args++;
@@ -1569,12 +1651,29 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, bool is64)
 #if defined(CONFIG_SOFTMMU)
     mem_index = get_mmuidx(oi);
 
+#ifdef TCG_DIRECT_RAM
+    if (mem_index == TARGET_DIRECT_RAM_MMU_IDX) {
+        n_miss = tcg_out_direct_ram(s, addrlo, opc, false, miss_ptrs);
+        tcg_out_qemu_ld_direct(s, datalo, datahi, TCG_REG_L1, -1, 0, 0, opc);
+        done_ptr = tcg_out_jcc_fwd(s, JCC_JMP);
+        for (i = 0; i < n_miss; i++) {
+            tcg_patch32(miss_ptrs[i], s->code_ptr - miss_ptrs[i] - 4);
+        }
+    }
+#endif
+
     tcg_out_tlb_load(s, addrlo, addrhi, mem_index, opc,
                      label_ptr, offsetof(CPUTLBEntry, addr_read));
 
     /* TLB Hit.  */
     tcg_out_qemu_ld_direct(s, datalo, datahi, TCG_REG_L1, -1, 0, 0, opc);
 
+#ifdef TCG_DIRECT_RAM
+    if (done_ptr) {
+        tcg_patch32(done_ptr, s->code_ptr - done_ptr - 4);
+    }
+#endif
+
     /* Record the current context of a load into ldst label */
     add_qemu_ldst_label(s, true, oi, datalo, datahi, addrlo, addrhi,
                         s->code_ptr, label_ptr);
@@ -1697,6 +1796,10 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #if defined(CONFIG_SOFTMMU)
     int mem_index;
     tcg_insn_unit *label_ptr[2];
+#ifdef TCG_DIRECT_RAM
+    tcg_insn_unit *miss_ptrs[3], *done_ptr = NULL;
+    int i, n_miss;
+#endif
 #endif
 
     datalo = *args++;
@@ -1709,12 +1812,29 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #if defined(CONFIG_SOFTMMU)
     mem_index = get_mmuidx(oi);
 
+#ifdef TCG_DIRECT_RAM
+    if (mem_index == TARGET_DIRECT_RAM_MMU_IDX) {
+        n_miss = tcg_out_direct_ram(s, addrlo, opc, true, miss_ptrs);
+        tcg_out_qemu_st_direct(s, datalo, datahi, TCG_REG_L1, 0, 0, opc);
+        done_ptr = tcg_out_jcc_fwd(s, JCC_JMP);
+        for (i = 0; i < n_miss; i++) {
+            tcg_patch32(miss_ptrs[i], s->code_ptr - miss_ptrs[i] - 4);
+        }
+    }
+#endif
+
     tcg_out_tlb_load(s, addrlo, addrhi, mem_index, opc,
                      label_ptr, offsetof(CPUTLBEntry, addr_write));
 
     /* TLB Hit.  */
     tcg_out_qemu_st_direct(s, datalo, datahi, TCG_REG_L1, 0, 0, opc);
 
+#ifdef TCG_DIRECT_RAM
+    if (done_ptr) {
+        tcg_patch32(done_ptr, s->code_ptr - done_ptr - 4);
+    }
+#endif
+
     /* Record the current context of a store into ldst label */
     add_qemu_ldst_label(s, false, oi, datalo, datahi, addrlo, addrhi,
                         s->code_ptr, label_ptr);
@@ -1754,6 +1874,18 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+/* Emit an n byte nop, 1 <= n <= 3: "xchg %eax,%eax" with operand size
+   prefixes, which all cores decode as a single instruction.  */
+static void tcg_out_nopn(TCGContext *s, int n)
+{
+    int i;
+
+    for (i = 1; i < n; i++) {
+        tcg_out8(s, 0x66);
+    }
+    tcg_out8(s, OPC_XCHG_ax_r32);
+}
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1776,7 +1908,13 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
-            /* direct jump method */
+            /* direct jump method, with the displacement aligned so that
+               tb_set_jmp_target1 patches it with a single store */
+            int gap = -(uintptr_t)(s->code_ptr + 1) & 3;
+
+            if (gap) {
+                tcg_out_nopn(s, gap);
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = tcg_current_code_size(s);
             tcg_out32(s, 0);
@@ -1787,6 +1925,14 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = tcg_current_code_size(s);
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp to the given host address (could be epilogue) */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
+    case INDEX_op_host_ticks:
+        /* into edx:eax, which the constraints ask for */
+        tcg_out_opc(s, OPC_RDTSC, 0, 0, 0);
+        break;
     case INDEX_op_br:
         tcg_out_jxx(s, JCC_JMP, arg_label(args[0]), 0);
         break;
@@ -2112,6 +2258,8 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
+    { INDEX_op_host_ticks, { "a", "d" } },
     { INDEX_op_br, { } },
     { INDEX_op_ld8u_i32, { "r", "r" } },
     { INDEX_op_ld8s_i32, { "r", "r" } },
@@ -2307,6 +2455,11 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* Return path for goto_ptr: set the return value to 0, as exit_tb
+       does, and fall through to the epilogue.  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -142,6 +142,26 @@ void tcg_gen_op6(TCGContext *ctx, TCGOpcode opc, TCGArg a1, TCGArg a2,
     tcg_emit_op(ctx, opc, pi);
 }
 
+void tcg_gen_op8(TCGContext *ctx, TCGOpcode opc, TCGArg a1, TCGArg a2,
+                 TCGArg a3, TCGArg a4, TCGArg a5, TCGArg a6,
+                 TCGArg a7, TCGArg a8)
+{
+    int pi = ctx->gen_next_parm_idx;
+
+    tcg_debug_assert(pi + 8 <= OPPARAM_BUF_SIZE);
+    ctx->gen_next_parm_idx = pi + 8;
+    ctx->gen_opparam_buf[pi + 0] = a1;
+    ctx->gen_opparam_buf[pi + 1] = a2;
+    ctx->gen_opparam_buf[pi + 2] = a3;
+    ctx->gen_opparam_buf[pi + 3] = a4;
+    ctx->gen_opparam_buf[pi + 4] = a5;
+    ctx->gen_opparam_buf[pi + 5] = a6;
+    ctx->gen_opparam_buf[pi + 6] = a7;
+    ctx->gen_opparam_buf[pi + 7] = a8;
+
+    tcg_emit_op(ctx, opc, pi);
+}
+
 /* 32 bit ops */
 
 void tcg_gen_addi_i32(TCGv_i32 ret, TCGv_i32 arg1, int32_t arg2)
@@ -1843,6 +1863,34 @@ void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Jump to the host code at ptr, which is either the start of a TB or
+   tcg_ctx.code_gen_epilogue.  Without backend support, return to the
+   main loop instead.  */
+void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        tcg_gen_op1(&tcg_ctx, INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
+/* Read the host cycle counter, as cpu_get_host_ticks() does.  */
+void tcg_gen_host_ticks_i64(TCGv_i64 ret)
+{
+    if (TCG_TARGET_HAS_host_ticks) {
+        TCGv_i32 lo = tcg_temp_new_i32();
+        TCGv_i32 hi = tcg_temp_new_i32();
+
+        tcg_gen_op2_i32(INDEX_op_host_ticks, lo, hi);
+        tcg_gen_concat_i32_i64(ret, lo, hi);
+        tcg_temp_free_i32(lo);
+        tcg_temp_free_i32(hi);
+    } else {
+        gen_helper_host_ticks(ret);
+    }
+}
+
 static inline TCGMemOp tcg_canonicalize_memop(TCGMemOp op, bool is64, bool st)
 {
     switch (op & MO_SIZE) {
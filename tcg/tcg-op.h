@@ -36,6 +36,8 @@ void tcg_gen_op5(TCGContext *, TCGOpcode, TCGArg, TCGArg, TCGArg,
                  TCGArg, TCGArg);
 void tcg_gen_op6(TCGContext *, TCGOpcode, TCGArg, TCGArg, TCGArg,
                  TCGArg, TCGArg, TCGArg);
+void tcg_gen_op8(TCGContext *, TCGOpcode, TCGArg, TCGArg, TCGArg,
+                 TCGArg, TCGArg, TCGArg, TCGArg, TCGArg);
 
 
 static inline void tcg_gen_op1_i32(TCGOpcode opc, TCGv_i32 a1)
@@ -744,6 +746,24 @@ static inline void tcg_gen_insn_start(target_ulong pc, target_ulong a1,
                 (uint32_t)a2, (uint32_t)(a2 >> 32));
 }
 # endif
+#elif TARGET_INSN_START_WORDS == 4
+# if TARGET_LONG_BITS <= TCG_TARGET_REG_BITS
+static inline void tcg_gen_insn_start(target_ulong pc, target_ulong a1,
+                                      target_ulong a2, target_ulong a3)
+{
+    tcg_gen_op4(&tcg_ctx, INDEX_op_insn_start, pc, a1, a2, a3);
+}
+# else
+static inline void tcg_gen_insn_start(target_ulong pc, target_ulong a1,
+                                      target_ulong a2, target_ulong a3)
+{
+    tcg_gen_op8(&tcg_ctx, INDEX_op_insn_start,
+                (uint32_t)pc, (uint32_t)(pc >> 32),
+                (uint32_t)a1, (uint32_t)(a1 >> 32),
+                (uint32_t)a2, (uint32_t)(a2 >> 32),
+                (uint32_t)a3, (uint32_t)(a3 >> 32));
+}
+# endif
 #else
 # error "Unhandled number of operands to insn_start"
 #endif
@@ -754,6 +774,8 @@ static inline void tcg_gen_exit_tb(uintptr_t val)
 }
 
 void tcg_gen_goto_tb(unsigned idx);
+void tcg_gen_goto_ptr(TCGv_ptr ptr);
+void tcg_gen_host_ticks_i64(TCGv_i64 ret);
 
 #if TARGET_LONG_BITS == 32
 #define TCGv TCGv_i32
@@ -371,14 +371,23 @@ void tcg_prologue_init(TCGContext *s)
     s->code_ptr = buf0;
     s->code_buf = buf0;
     s->code_gen_prologue = buf0;
+    s->code_gen_epilogue = NULL;
 
     /* Generate the prologue.  */
     tcg_target_qemu_prologue(s);
     buf1 = s->code_ptr;
     flush_icache_range((uintptr_t)buf0, (uintptr_t)buf1);
 
+    /* The call table follows, within reach of the generated code.  */
+    if (s->call_table_size) {
+        buf1 = (void *)ROUND_UP((uintptr_t)buf1, sizeof(void *));
+        s->call_table = buf1;
+        s->call_table_idx = g_hash_table_new(NULL, NULL);
+        buf1 += s->call_table_size * sizeof(void *);
+    }
+
     /* Deduct the prologue from the buffer.  */
-    prologue_size = tcg_current_code_size(s);
+    prologue_size = buf1 - buf0;
     s->code_gen_ptr = buf1;
     s->code_gen_buffer = buf1;
     s->code_buf = buf1;
@@ -406,6 +415,31 @@ void tcg_prologue_init(TCGContext *s)
 #endif
 }
 
+/* Return the slot of the call table that holds DEST, or NULL if the
+   call to DEST has to be emitted directly: there is no table, DEST is in
+   the code buffer or the table is full.  Going through the table keeps
+   the generated code independent of where the executable is loaded.  */
+void **tcg_call_slot(TCGContext *s, void *dest)
+{
+    gpointer idx;
+
+    if (!s->call_table ||
+        (dest >= s->code_gen_prologue &&
+         dest < s->code_gen_buffer + s->code_gen_buffer_size)) {
+        return NULL;
+    }
+    if (!g_hash_table_lookup_extended(s->call_table_idx, dest, NULL, &idx)) {
+        if (s->call_table_nb == s->call_table_size) {
+            s->call_table_full = true;
+            return NULL;
+        }
+        idx = GSIZE_TO_POINTER(s->call_table_nb);
+        s->call_table[s->call_table_nb++] = dest;
+        g_hash_table_insert(s->call_table_idx, dest, idx);
+    }
+    return s->call_table + GPOINTER_TO_SIZE(idx);
+}
+
 void tcg_set_frame(TCGContext *s, int reg, intptr_t start, intptr_t size)
 {
     s->frame_start = start;
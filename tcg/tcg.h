@@ -557,6 +557,7 @@ struct TCGContext {
        extension that allows arithmetic on void*.  */
     int code_gen_max_blocks;
     void *code_gen_prologue;
+    void *code_gen_epilogue;    /* returns 0 to cpu_exec, for goto_ptr */
     void *code_gen_buffer;
     size_t code_gen_buffer_size;
     void *code_gen_ptr;
@@ -564,6 +565,14 @@ struct TCGContext {
     /* Threshold to flush the translated code buffer.  */
     void *code_gen_highwater;
 
+    /* When set, calls from the generated code to functions outside of it
+       are made through this table, see tcg_call_slot.  */
+    void **call_table;
+    size_t call_table_size;
+    size_t call_table_nb;
+    bool call_table_full;
+    GHashTable *call_table_idx;
+
     TBContext tb_ctx;
 
     /* The TCGBackendData structure is private to tcg-target.c.  */
@@ -625,6 +634,7 @@ static inline void *tcg_malloc(int size)
 void tcg_context_init(TCGContext *s);
 void tcg_prologue_init(TCGContext *s);
 void tcg_func_start(TCGContext *s);
+void **tcg_call_slot(TCGContext *s, void *dest);
 
 int tcg_gen_code(TCGContext *s, tcg_insn_unit *gen_code_buf);
 
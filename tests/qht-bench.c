@@ -0,0 +1,217 @@
+/*
+ * Microbenchmark of the scalable hash table
+ *
+ * usage: qht-bench [-d secs] [-n threads] [-u update%] [-k keys]
+ *                  [-s initial size] [-R]
+ *
+ * Each thread looks random keys up, and with the given probability
+ * inserts the key instead when it is missing, or removes it when found.
+ * Half of the keys are in the table at the start.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <getopt.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+
+typedef struct BenchThread {
+    QemuThread thread;
+    uint64_t seed;
+    unsigned long lookups;
+    unsigned long updates;
+} BenchThread;
+
+static struct qht ht;
+static long *keys;
+static unsigned long n_keys = 4096;
+static unsigned int n_threads = 1;
+static unsigned int duration = 1;
+static unsigned int update_rate;
+static size_t init_size = 64;
+static unsigned int mode;
+
+static bool test_start;
+static bool test_stop;
+static unsigned int n_ready;
+
+static const char commands_string[] =
+    " -d = duration, in seconds\n"
+    " -n = number of threads\n"
+    " -u = update rate, in percent of the operations\n"
+    " -k = number of keys\n"
+    " -s = initial size of the hash table, in entries\n"
+    " -R = let the hash table grow\n";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s", commands_string);
+    exit(-1);
+}
+
+static uint32_t hash_key(long key)
+{
+    uint64_t h = key;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    return *(const long *)obj == *(const long *)userp;
+}
+
+/* xorshift64* */
+static inline uint64_t xorshift64star(uint64_t *x)
+{
+    *x ^= *x >> 12;
+    *x ^= *x << 25;
+    *x ^= *x >> 27;
+    return *x * 2685821657736338717ULL;
+}
+
+static void *thread_func(void *arg)
+{
+    BenchThread *info = arg;
+    uint64_t update_threshold = (UINT64_MAX / 100) * update_rate;
+    unsigned long lookups = 0, updates = 0;
+
+    rcu_register_thread();
+    atomic_inc(&n_ready);
+    while (!atomic_read(&test_start)) {
+        g_usleep(100);
+    }
+
+    rcu_read_lock();
+    while (!atomic_read(&test_stop)) {
+        long *key = &keys[xorshift64star(&info->seed) % n_keys];
+        uint32_t hash = hash_key(*key);
+        void *p;
+
+        p = qht_lookup(&ht, is_equal, key, hash);
+        if (update_rate && xorshift64star(&info->seed) < update_threshold) {
+            rcu_read_unlock();
+            if (p) {
+                qht_remove(&ht, key, hash);
+            } else {
+                qht_insert(&ht, key, hash);
+            }
+            rcu_read_lock();
+            updates++;
+        } else {
+            lookups++;
+        }
+        /* let the grace periods end once in a while */
+        if (((lookups + updates) & 0x3ff) == 0) {
+            rcu_read_unlock();
+            rcu_read_lock();
+        }
+    }
+    rcu_read_unlock();
+
+    info->lookups = lookups;
+    info->updates = updates;
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:n:u:k:s:R");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_threads = atoi(optarg);
+            break;
+        case 'u':
+            update_rate = MIN(atoi(optarg), 100);
+            break;
+        case 'k':
+            n_keys = atol(optarg);
+            break;
+        case 's':
+            init_size = atol(optarg);
+            break;
+        case 'R':
+            mode |= QHT_MODE_AUTO_RESIZE;
+            break;
+        case 'h':
+        default:
+            usage_complete(argc, argv);
+        }
+    }
+    if (!n_threads || !n_keys) {
+        usage_complete(argc, argv);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct qht_stats stats;
+    BenchThread *th;
+    unsigned long lookups = 0, updates = 0;
+    unsigned long i;
+
+    parse_args(argc, argv);
+
+    qht_init(&ht, init_size, mode);
+    keys = g_new(long, n_keys);
+    for (i = 0; i < n_keys; i++) {
+        keys[i] = i;
+        if (i & 1) {
+            qht_insert(&ht, &keys[i], hash_key(i));
+        }
+    }
+
+    th = g_new0(BenchThread, n_threads);
+    for (i = 0; i < n_threads; i++) {
+        th[i].seed = i + 1;
+        qemu_thread_create(&th[i].thread, "qht-bench", thread_func, &th[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    while (atomic_read(&n_ready) < n_threads) {
+        g_usleep(1000);
+    }
+    atomic_set(&test_start, true);
+    g_usleep(duration * G_USEC_PER_SEC);
+    atomic_set(&test_stop, true);
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&th[i].thread);
+        lookups += th[i].lookups;
+        updates += th[i].updates;
+    }
+
+    qht_statistics(&ht, &stats);
+    printf("threads %u, keys %lu, update rate %u%%, %s\n", n_threads, n_keys,
+           update_rate, (mode & QHT_MODE_AUTO_RESIZE) ? "resizable" : "fixed");
+    printf("lookups %lu, updates %lu: %.2f Mops/s\n", lookups, updates,
+           (double)(lookups + updates) / duration / 1e6);
+    printf("head buckets %zu/%zu used, entries %zu, chain avg %.2f max %zu, "
+           "resizes %u\n", stats.used_head_buckets, stats.head_buckets,
+           stats.entries, stats.used_head_buckets ?
+           (double)stats.chain_buckets / stats.used_head_buckets : 0,
+           stats.max_chain, stats.resizes);
+
+    qht_destroy(&ht);
+    g_free(keys);
+    g_free(th);
+    return 0;
+}
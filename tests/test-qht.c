@@ -0,0 +1,172 @@
+/*
+ * Test the scalable hash table
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+
+#define N 5000
+
+static struct qht ht;
+static int32_t arr[N * 2];
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const int32_t *a = obj;
+    const int32_t *b = userp;
+
+    return *a == *b;
+}
+
+/* A poor hash, so that the chains get long and the table grows */
+static uint32_t hash_of(int32_t key)
+{
+    return key >> 2;
+}
+
+static void insert(int a, int b)
+{
+    int i;
+
+    for (i = a; i < b; i++) {
+        arr[i] = i;
+        g_assert_true(qht_insert(&ht, &arr[i], hash_of(i)));
+    }
+}
+
+static void rm(int init, int end)
+{
+    int i;
+
+    for (i = init; i < end; i++) {
+        g_assert_true(qht_remove(&ht, &arr[i], hash_of(arr[i])));
+    }
+}
+
+static void check(int a, int b, bool expected)
+{
+    int i;
+
+    rcu_read_lock();
+    for (i = a; i < b; i++) {
+        void *p;
+
+        p = qht_lookup(&ht, is_equal, &i, hash_of(i));
+        if (expected) {
+            g_assert_true(p == &arr[i]);
+        } else {
+            g_assert_true(p == NULL);
+        }
+    }
+    rcu_read_unlock();
+}
+
+static void count_func(struct qht *ht, void *p, uint32_t hash, void *userp)
+{
+    size_t *count = userp;
+
+    g_assert_cmpuint(hash, ==, hash_of(*(int32_t *)p));
+    (*count)++;
+}
+
+static void check_n(size_t expected)
+{
+    struct qht_stats stats;
+    size_t count = 0;
+
+    qht_statistics(&ht, &stats);
+    g_assert_cmpuint(stats.entries, ==, expected);
+    qht_iter(&ht, count_func, &count);
+    g_assert_cmpuint(count, ==, expected);
+}
+
+static void qht_do_test(unsigned int mode, size_t init_entries)
+{
+    qht_init(&ht, init_entries, mode);
+
+    insert(0, N);
+    check(0, N, true);
+    check_n(N);
+    check(-N, -1, false);
+    g_assert_false(qht_insert(&ht, &arr[3], hash_of(3)));
+
+    /* removals move entries around the chains */
+    rm(101, 102);
+    check_n(N - 1);
+    insert(N, N * 2);
+    check_n(N + N - 1);
+    rm(N, N * 2);
+    check_n(N - 1);
+    insert(101, 102);
+    check_n(N);
+
+    rm(10, 200);
+    check_n(N - 190);
+    check(0, 10, true);
+    check(10, 200, false);
+    check(200, N, true);
+    g_assert_false(qht_remove(&ht, &arr[10], hash_of(10)));
+
+    qht_resize(&ht, N * 4);
+    check(0, 10, true);
+    check(200, N, true);
+    check_n(N - 190);
+    qht_resize(&ht, 1);
+    check(200, N, true);
+
+    qht_reset(&ht);
+    check(0, N, false);
+    check_n(0);
+
+    insert(0, N);
+    check_n(N);
+    qht_reset_size(&ht, N * 2);
+    check(0, N, false);
+    check_n(0);
+    insert(0, N);
+    check(0, N, true);
+
+    qht_destroy(&ht);
+}
+
+static void qht_test(unsigned int mode)
+{
+    qht_do_test(mode, 0);
+    qht_do_test(mode, 1);
+    qht_do_test(mode, 2);
+    qht_do_test(mode, 8);
+    qht_do_test(mode, 16);
+    qht_do_test(mode, 8192);
+}
+
+static void test_default(void)
+{
+    qht_test(0);
+}
+
+static void test_resize(void)
+{
+    struct qht_stats stats;
+
+    qht_test(QHT_MODE_AUTO_RESIZE);
+
+    qht_init(&ht, 0, QHT_MODE_AUTO_RESIZE);
+    insert(0, N);
+    qht_statistics(&ht, &stats);
+    g_assert_cmpuint(stats.resizes, >, 0);
+    g_assert_cmpuint(stats.head_buckets, >, 1);
+    qht_destroy(&ht);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/mode/default", test_default);
+    g_test_add_func("/qht/mode/resize", test_resize);
+    return g_test_run();
+}
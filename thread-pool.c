@@ -311,6 +311,23 @@ ThreadPool *thread_pool_new(AioContext *ctx)
     return pool;
 }
 
+/* Only the thread calling fork() survives in the child, which must start
+ * its own workers.  No request may be pending.
+ */
+void thread_pool_after_fork(ThreadPool *pool)
+{
+    assert(QTAILQ_EMPTY(&pool->request_list));
+
+    /* a worker of the parent may have held them */
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->worker_stopped);
+    qemu_sem_init(&pool->sem, 0);
+    pool->cur_threads = 0;
+    pool->idle_threads = 0;
+    pool->new_threads = 0;
+    pool->pending_threads = 0;
+}
+
 void thread_pool_free(ThreadPool *pool)
 {
     if (!pool) {
@@ -62,6 +62,12 @@
 #include "translate-all.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
+#include "qemu/error-report.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "hw/boards.h"
+#include "qemu/config-file.h"
+#include "exec/ram_addr.h"
+#endif
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -73,6 +79,13 @@
 #undef DEBUG_TB_CHECK
 #endif
 
+/* The persistent translation cache needs calls out of the generated code
+   to go through a table, see tb_cache_load.  */
+#if TCG_TARGET_HAS_call_table && defined(USE_DIRECT_JUMP) && \
+    !defined(CONFIG_USER_ONLY)
+#define USE_TB_CACHE
+#endif
+
 #define SMC_BITMAP_USE_THRESHOLD 10
 
 typedef struct PageDesc {
@@ -127,16 +140,21 @@ static void *l1_map[V_L1_SIZE];
 TCGContext tcg_ctx;
 
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
-#endif
 
+/* In system mode the lock is only needed with a thread per vCPU.  It
+   nests there, as the TLB and the memory write paths reach the TB
+   structures both from helpers and from the translator.  */
 void tb_lock(void)
 {
 #ifdef CONFIG_USER_ONLY
     assert(!have_tb_lock);
     qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
     have_tb_lock++;
+#else
+    if (qemu_tcg_mttcg_enabled() && have_tb_lock++ == 0) {
+        qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    }
 #endif
 }
 
@@ -146,22 +164,37 @@ void tb_unlock(void)
     assert(have_tb_lock);
     have_tb_lock--;
     qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+#else
+    if (qemu_tcg_mttcg_enabled() && --have_tb_lock == 0) {
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
 #endif
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
 }
 
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
+#ifdef USE_TB_CACHE
+static TranslationBlock *tb_cache_find(CPUState *cpu, target_ulong pc,
+                                       target_ulong cs_base, int flags,
+                                       int cflags, tb_page_addr_t phys_pc);
+static uint64_t tb_cache_src_hash(TranslationBlock *tb);
+static void tb_cache_drop(void);
+#endif
+
+/* File of the persistent translation cache, NULL if not used */
+const char *tb_cache_path;
+
+/* Executions after which a TB is made a superblock, 0 to never do it */
+unsigned int tb_superblock_threshold;
 
 void cpu_gen_init(void)
 {
@@ -307,6 +340,7 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(cpu, tb, retaddr);
@@ -316,8 +350,10 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
             tb_phys_invalidate(tb, -1);
             tb_free(tb);
         }
+        tb_unlock();
         return true;
     }
+    tb_unlock();
     return false;
 }
 
@@ -487,6 +523,20 @@ static inline PageDesc *page_find(tb_page_addr_t index)
 
 #define DEFAULT_CODE_GEN_BUFFER_SIZE_1 (32u * 1024 * 1024)
 
+/* Smallest code region worth splitting the buffer for, see
+   tb_evict_region */
+#define MIN_CODE_GEN_REGION_SIZE (1024 * 1024)
+
+/* Room left at the end of a region for the code of one TB, as
+   tcg_prologue_init does for the whole buffer */
+#define CODE_GEN_HIGHWATER (64 * 1024)
+
+/* Fixed address of the code buffer for the persistent translation cache,
+   the TBs follow the buffer.  */
+#define TB_CACHE_CODE_ADDR 0x200000000000ul
+/* Number of functions the generated code can call */
+#define TB_CACHE_CALLS 4096
+
 #define DEFAULT_CODE_GEN_BUFFER_SIZE \
   (DEFAULT_CODE_GEN_BUFFER_SIZE_1 < MAX_CODE_GEN_BUFFER_SIZE \
    ? DEFAULT_CODE_GEN_BUFFER_SIZE_1 : MAX_CODE_GEN_BUFFER_SIZE)
@@ -670,6 +720,15 @@ static inline void *alloc_code_gen_buffer(void)
 #  else
     start = 0x08000000ul;
 #  endif
+# endif
+# ifdef USE_TB_CACHE
+    /* The persistent translation cache keeps the code where it was.  */
+    if (tb_cache_path) {
+        start = TB_CACHE_CODE_ADDR;
+#  ifdef MAP_32BIT
+        flags &= ~MAP_32BIT;
+#  endif
+    }
 # endif
 
     buf = mmap((void *)start, size + qemu_real_host_page_size,
@@ -677,6 +736,13 @@ static inline void *alloc_code_gen_buffer(void)
     if (buf == MAP_FAILED) {
         return NULL;
     }
+# ifdef USE_TB_CACHE
+    if (tb_cache_path && buf != (void *)start) {
+        error_report("tb-cache: cannot map the code buffer at %p, "
+                     "not using %s", (void *)start, tb_cache_path);
+        tb_cache_path = NULL;
+    }
+# endif
 
 #ifdef __mips__
     if (cross_256mb(buf, size)) {
@@ -722,6 +788,53 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, WIN32, POSIX */
 
+/*
+ * Code regions.  The code buffer and the TBs are split in nb_regions
+ * regions, filled one after the other.  When the current one is full,
+ * tb_evict_region invalidates the TBs of the next one, the oldest, and
+ * goes on translating into it: the code of the other regions stays and
+ * only the jumps into the evicted TBs are unchained, instead of losing
+ * all of the translated code at once on each tb_flush.
+ */
+
+static inline size_t tb_region_size(void)
+{
+    return (tcg_ctx.code_gen_buffer_size / tcg_ctx.tb_ctx.nb_regions)
+           & -CODE_GEN_ALIGN;
+}
+
+static inline void *tb_region_start(int r)
+{
+    return tcg_ctx.code_gen_buffer + r * tb_region_size();
+}
+
+static inline TranslationBlock *tb_region_tbs(int r)
+{
+    return tcg_ctx.tb_ctx.tbs + r * tcg_ctx.tb_ctx.region_max_tbs;
+}
+
+/* Bytes of code generated in region r */
+static size_t tb_region_code_size(int r)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+
+    if (r == ctx->cur_region) {
+        return tcg_ctx.code_gen_ptr - tb_region_start(r);
+    }
+    return ctx->region_code_size[r];
+}
+
+/* Translate into region r from now on, after the code it has */
+static void tb_region_enter(int r)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+
+    ctx->cur_region = r;
+    tcg_ctx.code_gen_ptr = tb_region_start(r) + ctx->region_code_size[r];
+    tcg_ctx.code_gen_highwater =
+        tb_region_start(r) + tb_region_size() - CODE_GEN_HIGHWATER;
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -736,7 +849,43 @@ static inline void code_gen_alloc(size_t tb_size)
        but that's minimal and won't affect the estimate much.  */
     tcg_ctx.code_gen_max_blocks
         = tcg_ctx.code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tcg_ctx.tb_ctx.tbs = g_new(TranslationBlock, tcg_ctx.code_gen_max_blocks);
+#ifdef CONFIG_USER_ONLY
+    /* the prologue is only generated later, on the whole buffer */
+    tcg_ctx.tb_ctx.nb_regions = 1;
+#else
+    tcg_ctx.tb_ctx.nb_regions =
+        MAX(1, MIN(TB_REGIONS, tcg_ctx.code_gen_buffer_size /
+                               MIN_CODE_GEN_REGION_SIZE));
+#endif
+    tcg_ctx.tb_ctx.region_max_tbs =
+        tcg_ctx.code_gen_max_blocks / tcg_ctx.tb_ctx.nb_regions;
+#ifdef USE_TB_CACHE
+    /* The generated code points to its TB, so the TBs need a fixed
+       address too.  */
+    if (tb_cache_path) {
+        void *start = tcg_ctx.code_gen_buffer + tcg_ctx.code_gen_buffer_size
+                      + qemu_real_host_page_size;
+        size_t size = tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock);
+        void *tbs = mmap(start, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (tbs == start) {
+            tcg_ctx.tb_ctx.tbs = tbs;
+            tcg_ctx.call_table_size = TB_CACHE_CALLS;
+        } else {
+            if (tbs != MAP_FAILED) {
+                munmap(tbs, size);
+            }
+            error_report("tb-cache: cannot map the TBs at %p, not using %s",
+                         start, tb_cache_path);
+            tb_cache_path = NULL;
+        }
+    }
+#endif
+    if (!tcg_ctx.tb_ctx.tbs) {
+        tcg_ctx.tb_ctx.tbs = g_new(TranslationBlock,
+                                   tcg_ctx.code_gen_max_blocks);
+    }
 
     qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
 }
@@ -748,11 +897,14 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     page_init();
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE,
+             QHT_MODE_AUTO_RESIZE);
     code_gen_alloc(tb_size);
 #if defined(CONFIG_SOFTMMU)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
     tcg_prologue_init(&tcg_ctx);
+    tb_region_enter(0);
 #endif
 }
 
@@ -761,30 +913,40 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region.  Return NULL
+   if the region has too many translation blocks; the caller moves on to
+   the next one.  The TB is CF_INVALID until tb_link_page.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int r = ctx->cur_region;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+    if (ctx->region_nb_tbs[r] >= ctx->region_max_tbs) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &tb_region_tbs(r)[ctx->region_nb_tbs[r]++];
+    ctx->nb_tbs++;
     tb->pc = pc;
-    tb->cflags = 0;
+    tb->cflags = CF_INVALID;
+    tb->jmp_next[0] = NULL;
+    tb->jmp_next[1] = NULL;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int r = ctx->cur_region;
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (ctx->region_nb_tbs[r] > 0 &&
+            tb == &tb_region_tbs(r)[ctx->region_nb_tbs[r] - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        ctx->region_nb_tbs[r]--;
+        ctx->nb_tbs--;
     }
 }
 
@@ -829,8 +991,7 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+static void do_tb_flush(CPUState *cpu)
 {
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -844,75 +1005,171 @@ void tb_flush(CPUState *cpu)
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
     tcg_ctx.tb_ctx.nb_tbs = 0;
+    memset(tcg_ctx.tb_ctx.region_nb_tbs, 0,
+           sizeof(tcg_ctx.tb_ctx.region_nb_tbs));
+    memset(tcg_ctx.tb_ctx.region_code_size, 0,
+           sizeof(tcg_ctx.tb_ctx.region_code_size));
+#ifndef CONFIG_USER_ONLY
+    tcg_ctx.tb_ctx.nb_cross_page_jmps = 0;
+#endif
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
+#ifdef USE_TB_CACHE
+    tb_cache_drop();
+#endif
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
+    tb_region_enter(0);
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
 }
 
-#ifdef DEBUG_TB_CHECK
-
-static void tb_invalidate_check(target_ulong address)
+/* Invalidate the TBs of the region after the current one, which is full,
+   and translate into it from now on.  */
+static void do_tb_evict_region(void)
 {
-    TranslationBlock *tb;
-    int i;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int r = (ctx->cur_region + 1) % ctx->nb_regions;
+    TranslationBlock *tbs = tb_region_tbs(r);
+    int i, j, n = ctx->region_nb_tbs[r];
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
+    ctx->region_code_size[ctx->cur_region] =
+        tb_region_code_size(ctx->cur_region);
+    if (n) {
+#ifdef USE_TB_CACHE
+        /* loaded TBs not linked yet may be in the region */
+        tb_cache_drop();
+#endif
+        for (i = 0; i < n; i++) {
+            if (!(tbs[i].cflags & CF_INVALID)) {
+                tb_phys_invalidate(&tbs[i], -1);
             }
         }
+#ifndef CONFIG_USER_ONLY
+        for (i = j = 0; i < ctx->nb_cross_page_jmps; i++) {
+            TBCrossPageJump *jmp = &ctx->cross_page_jmps[i];
+
+            if (jmp->tb < tbs || jmp->tb >= tbs + n) {
+                ctx->cross_page_jmps[j++] = *jmp;
+            }
+        }
+        ctx->nb_cross_page_jmps = j;
+#endif
+        ctx->nb_tbs -= n;
+        ctx->region_nb_tbs[r] = 0;
+        ctx->tb_evict_count++;
+        ctx->tb_evicted_count += n;
     }
+    ctx->region_code_size[r] = 0;
+    tb_region_enter(r);
+    /* Don't forget to invalidate previous TB info.  */
+    ctx->tb_invalidated_flag = 1;
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+/* With a thread per vCPU the other vCPUs may be running code from the
+   buffer: flushes and evictions are only requested here, and done by the
+   first vCPU thread to see the request once it stopped all the others.
+   Every vCPU checks for it before going back to translated code.  */
+#define TB_FLUSH_ALL    1
+#define TB_FLUSH_REGION 2
+
+static int tb_flush_requested;
+
+static void tb_flush_request(int what)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
+    CPUState *cpu;
+
+    atomic_or(&tb_flush_requested, what);
+    CPU_FOREACH(cpu) {
+        cpu_exit(cpu);
     }
 }
 
-#endif
+void tb_flush(CPUState *cpu)
+{
+    if (qemu_tcg_mttcg_enabled()) {
+        tb_flush_request(TB_FLUSH_ALL);
+        return;
+    }
+    do_tb_flush(cpu);
+}
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+/* Make room for new code when the current region is full.  Returns false
+   if the eviction is left to tb_flush_exclusive.  */
+static bool tb_evict_region(void)
 {
-    TranslationBlock *tb1;
+    if (qemu_tcg_mttcg_enabled()) {
+        tb_flush_request(TB_FLUSH_REGION);
+        return false;
+    }
+    do_tb_evict_region();
+    return true;
+}
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+bool tb_flush_pending(void)
+{
+    return atomic_read(&tb_flush_requested);
+}
+
+/* Called with no vCPU executing translated code */
+void tb_flush_exclusive(CPUState *cpu)
+{
+    int what = atomic_xchg(&tb_flush_requested, 0);
+
+    if (what & TB_FLUSH_ALL) {
+        do_tb_flush(cpu);
+    } else if (what & TB_FLUSH_REGION) {
+        do_tb_evict_region();
+    }
+}
+
+#ifdef DEBUG_TB_CHECK
+
+static void do_tb_invalidate_check(struct qht *ht, void *p, uint32_t hash,
+                                   void *userp)
+{
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
+
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
     }
 }
 
+static void tb_invalidate_check(target_ulong address)
+{
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
+}
+
+static void do_tb_page_check(struct qht *ht, void *p, uint32_t hash,
+                             void *userp)
+{
+    TranslationBlock *tb = p;
+    int flags1, flags2;
+
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
+    }
+}
+
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -971,14 +1228,21 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     CPUState *cpu;
     PageDesc *p;
-    unsigned int h, n1;
+    unsigned int n1;
+    uint32_t h;
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
+    /* a lookup racing with the removal does not return the TB; one that
+       returned it just before does not keep it in the jump cache, see
+       tb_find_slow */
+    atomic_set(&tb->cflags, tb->cflags | CF_INVALID);
+    smp_mb();
+
+    /* remove the TB from the hash table */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb, h);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -997,8 +1261,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -1024,6 +1288,49 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
 
+/* Chain jump n of tb to tb_next.  A TB is only looked up for the current
+   mapping of its own page, so a jump within that page stays valid for as
+   long as the TB itself.  A jump to another page also depends on the
+   mapping of the destination page: unless the target flagged it as fixed,
+   it is recorded so that tb_reset_cross_page_jumps() can undo it when the
+   TLB drops that mapping.  The TBs are shared by all CPUs: a single
+   thread running them in turn resets the list when it moves to another
+   CPU, but with a thread per vCPU another CPU could follow the jump with
+   a different mapping at any time, so such jumps are not chained at all.
+   In user mode the mapping never changes without the TBs being
+   invalidated.  An invalidated TB is not chained, its code may be reused
+   once evicted; tb_next may have been invalidated since it was looked up
+   without tb_lock.  */
+void tb_chain_jump(TranslationBlock *tb, int n, TranslationBlock *tb_next)
+{
+#ifndef CONFIG_USER_ONLY
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    target_ulong page = tb_next->pc & TARGET_PAGE_MASK;
+#endif
+
+    if ((tb->cflags | tb_next->cflags) & CF_INVALID) {
+        return;
+    }
+#ifndef CONFIG_USER_ONLY
+    if (tb->jmp_next[n]) {
+        return;
+    }
+    if ((tb->pc & TARGET_PAGE_MASK) != page && !(tb->jmp_fixed & (1 << n))) {
+        TBCrossPageJump *jmp;
+
+        if (qemu_tcg_mttcg_enabled() ||
+            ctx->nb_cross_page_jmps >= TB_CROSS_PAGE_JMPS) {
+            return;
+        }
+        jmp = &ctx->cross_page_jmps[ctx->nb_cross_page_jmps++];
+        jmp->tb = tb;
+        jmp->n = n;
+        jmp->page = page;
+    }
+#endif
+    tb_add_jump(tb, n, tb_next);
+}
+
 static void build_page_bitmap(PageDesc *p)
 {
     int n, tb_start, tb_end;
@@ -1072,24 +1379,43 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount && !(cflags & CF_IGNORE_ICOUNT)) {
         cflags |= CF_USE_ICOUNT;
     }
+#ifdef TARGET_SUPPORTS_SUPERBLOCKS
+    if (tb_superblock_threshold &&
+        !(cflags & (CF_NOCACHE | CF_USE_ICOUNT | CF_SUPERBLOCK))) {
+        cflags |= CF_COUNT_HOT;
+    }
+#endif
+#ifdef USE_TB_CACHE
+    if (!(cflags & CF_NOCACHE)) {
+        tb = tb_cache_find(cpu, pc, cs_base, flags, cflags, phys_pc);
+        if (tb) {
+            return tb;
+        }
+    }
+#endif
 
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        /* the region is full, an aborted TB stays CF_INVALID in it */
+        if (!tb_evict_region()) {
+            /* the eviction happens once every vCPU left cpu_exec */
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         assert(tb != NULL);
-        /* Don't forget to invalidate previous TB info.  */
-        tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
     }
 
     gen_code_buf = tcg_ctx.code_gen_ptr;
     tb->tc_ptr = gen_code_buf;
     tb->cs_base = cs_base;
     tb->flags = flags;
-    tb->cflags = cflags;
+    tb->cflags = cflags | CF_INVALID;
+    tb->end_reason = TB_END_UNKNOWN;
+    tb->exec_count = 0;
+    tb->hot_count = tb_superblock_threshold;
 
 #ifdef CONFIG_PROFILER
     tcg_ctx.tb_count1++; /* includes aborted translations because of
@@ -1106,6 +1432,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     /* generate machine code */
     tb->tb_next_offset[0] = 0xffff;
     tb->tb_next_offset[1] = 0xffff;
+    tb->jmp_fixed = 0;
     tcg_ctx.tb_next_offset = tb->tb_next_offset;
 #ifdef USE_DIRECT_JUMP
     tcg_ctx.tb_jmp_offset = tb->tb_jmp_offset;
@@ -1162,9 +1489,67 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+#ifdef USE_TB_CACHE
+    if (tcg_ctx.call_table) {
+        tb->src_hash = tb_cache_src_hash(tb);
+    }
+#endif
     return tb;
 }
 
+/*
+ * Superblocks.  With CF_COUNT_HOT, the TB counts its executions down from
+ * tb_superblock_threshold and leaves to cpu_exec when done.  It is then
+ * translated again with CF_SUPERBLOCK: instead of ending at a direct
+ * branch, the target goes on with its code on the same page, along the
+ * path that ran most according to tb_hotness, and only leaves the block
+ * on the other paths.  The instructions that used to be in different
+ * TBs are optimized together, and skip the jumps between them.  A
+ * superblock covers the range from its first to its last instruction,
+ * so that writes to the code in between invalidate it too.
+ */
+
+/* Replace tb, which just ran out of hot_count, by its superblock.
+   Called with tb_lock held.  */
+void tb_gen_superblock(CPUState *cpu, TranslationBlock *tb)
+{
+    TranslationBlock *tb1;
+
+    /* another vCPU may have invalidated it meanwhile */
+    if (tb->cflags & CF_INVALID) {
+        return;
+    }
+
+    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+    tb1 = tb_gen_code(cpu, tb->pc, tb->cs_base, tb->flags, CF_SUPERBLOCK);
+    if (!tcg_ctx.tb_ctx.tb_invalidated_flag) {
+        /* the jumps to tb are chained to the superblock again */
+        tb_phys_invalidate(tb, -1);
+    }
+    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(tb1->pc)] = tb1;
+    tcg_ctx.tb_ctx.superblock_count++;
+}
+
+/* Executions counted for the TB of this state in the jump cache of cpu,
+   or -1 if there is none.  Tells the translator of a superblock which
+   way a branch goes most.  */
+int64_t tb_hotness(CPUState *cpu, target_ulong pc, target_ulong cs_base,
+                   uint64_t flags)
+{
+    TranslationBlock *tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+
+    if (!tb || tb->pc != pc || tb->cs_base != cs_base || tb->flags != flags) {
+        return -1;
+    }
+    if (tb->cflags & CF_SUPERBLOCK) {
+        return tb_superblock_threshold;
+    }
+    if (!(tb->cflags & CF_COUNT_HOT)) {
+        return 0;
+    }
+    return tb_superblock_threshold - tb->hot_count;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1475,14 +1860,12 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
+    uint32_t h;
 
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    /* add in the hash table, from where it can be looked up at once */
+    tb->cflags &= ~CF_INVALID;
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb, h);
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1513,23 +1896,27 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    int m_min, m_max, m, r;
     uintptr_t v;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *tbs;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    /* the TBs of a region are in the order of their code */
+    r = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / tb_region_size();
+    if (r >= tcg_ctx.tb_ctx.nb_regions ||
+        tc_ptr - (uintptr_t)tb_region_start(r) >= tb_region_code_size(r) ||
+        tcg_ctx.tb_ctx.region_nb_tbs[r] <= 0) {
         return NULL;
     }
+    tbs = tb_region_tbs(r);
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = tcg_ctx.tb_ctx.region_nb_tbs[r] - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1539,7 +1926,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1558,7 +1945,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
     }
     ram_addr = (memory_region_get_ram_addr(mr) & TARGET_PAGE_MASK)
         + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -1673,10 +2062,38 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
            TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
+/* Unchain the cross page jumps into the virtual pages from start to last
+   included, because they lost their mapping.  */
+void tb_reset_cross_page_jumps(target_ulong start, target_ulong last)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int i, j;
+
+    tb_lock();
+    start &= TARGET_PAGE_MASK;
+    for (i = j = 0; i < ctx->nb_cross_page_jmps; i++) {
+        TBCrossPageJump *jmp = &ctx->cross_page_jmps[i];
+
+        if (jmp->page - start > last - start) {
+            ctx->cross_page_jmps[j++] = *jmp;
+            continue;
+        }
+        /* the jump may have been unchained already by tb_phys_invalidate */
+        if (jmp->tb->jmp_next[jmp->n]) {
+            tb_jmp_remove(jmp->tb, jmp->n);
+            tb_reset_jump(jmp->tb, jmp->n);
+        }
+    }
+    ctx->nb_cross_page_jmps = j;
+    tb_unlock();
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, r, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    size_t code_size = 0;
+    struct qht_stats hst;
     TranslationBlock *tb;
 
     target_code_size = 0;
@@ -1684,39 +2101,41 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for (r = 0; r < tcg_ctx.tb_ctx.nb_regions; r++) {
+        code_size += tb_region_code_size(r);
+        for (i = 0; i < tcg_ctx.tb_ctx.region_nb_tbs[r]; i++) {
+            tb = &tb_region_tbs(r)[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n", code_size,
+                tcg_ctx.code_gen_buffer_size);
+    cpu_fprintf(f, "code region         %d/%d (%zd bytes each)\n",
+                tcg_ctx.tb_ctx.cur_region + 1, tcg_ctx.tb_ctx.nb_regions,
+                tb_region_size());
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+                target_code_size ? (double) code_size /
                                              target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
@@ -1728,14 +2147,627 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+    cpu_fprintf(f, "cross page jumps    %d/%d\n",
+                tcg_ctx.tb_ctx.nb_cross_page_jmps, TB_CROSS_PAGE_JMPS);
+    qht_statistics(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.1f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ? (double)hst.used_head_buckets * 100 /
+                                   hst.head_buckets : 0);
+    cpu_fprintf(f, "TB hash entries     %zu (%0.2f per used bucket)\n",
+                hst.entries, hst.chain_buckets ? (double)hst.entries /
+                                                 hst.chain_buckets : 0);
+    cpu_fprintf(f, "TB hash avg chain   %0.2f buckets max=%zu\n",
+                hst.used_head_buckets ? (double)hst.chain_buckets /
+                                        hst.used_head_buckets : 0,
+                hst.max_chain);
+    cpu_fprintf(f, "TB hash resizes     %u\n", hst.resizes);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "region evictions    %d (%d TBs)\n",
+            tcg_ctx.tb_ctx.tb_evict_count, tcg_ctx.tb_ctx.tb_evicted_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "superblock count    %d\n",
+            tcg_ctx.tb_ctx.superblock_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+/* Start or stop counting TB executions.  The counters are incremented
+   by the generated code, so all TBs are retranslated; this also resets
+   the counts.  */
+void tb_profile_enable(CPUState *cpu, bool enable)
+{
+    tcg_ctx.tb_ctx.profile = enable;
+    tb_flush(cpu);
+}
+
+static const char * const tb_end_names[TB_END_NB] = {
+    [TB_END_UNKNOWN] = "unknown",
+    [TB_END_BRANCH] = "branch",
+    [TB_END_PAGE] = "page",
+    [TB_END_FULL] = "full",
+    [TB_END_MAX_INSNS] = "maxinsns",
+    [TB_END_IO] = "io",
+    [TB_END_STOP] = "stop",
+    [TB_END_EXCP] = "excp",
+    [TB_END_DEBUG] = "debug",
+};
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    const TranslationBlock *ta = *(TranslationBlock * const *)a;
+    const TranslationBlock *tb = *(TranslationBlock * const *)b;
+
+    if (ta->exec_count == tb->exec_count) {
+        return ta->pc < tb->pc ? -1 : ta->pc > tb->pc;
+    }
+    return ta->exec_count > tb->exec_count ? -1 : 1;
+}
+
+/* Print the executed TBs, hottest first, at most max of them if max > 0.
+   For each TB, "chained" is the number of direct jumps currently linked
+   to another TB over the number of direct jumps.  */
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf, int max)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TranslationBlock **tbs;
+    uint64_t end_execs[TB_END_NB] = { 0 };
+    int end_tbs[TB_END_NB] = { 0 };
+    uint64_t execs = 0, insns = 0;
+    int i, n, r;
+
+    if (!ctx->profile) {
+        cpu_fprintf(f, "TB profiling is off\n");
+        return;
+    }
+
+    tbs = g_new(TranslationBlock *, ctx->nb_tbs);
+    n = 0;
+    for (r = 0; r < ctx->nb_regions; r++) {
+        for (i = 0; i < ctx->region_nb_tbs[r]; i++) {
+            TranslationBlock *tb = &tb_region_tbs(r)[i];
+
+            tbs[n++] = tb;
+            execs += tb->exec_count;
+            insns += tb->exec_count * tb->icount;
+            end_execs[tb->end_reason] += tb->exec_count;
+            end_tbs[tb->end_reason]++;
+        }
+    }
+    qsort(tbs, ctx->nb_tbs, sizeof(*tbs), tb_profile_cmp);
+
+    cpu_fprintf(f, "TB count            %d\n", ctx->nb_tbs);
+    cpu_fprintf(f, "TB executions       %" PRIu64 "\n", execs);
+    cpu_fprintf(f, "guest insns         %" PRIu64 " (%0.1f per TB)\n", insns,
+                execs ? (double)insns / execs : 0);
+    cpu_fprintf(f, "\nend reason     TBs   executions\n");
+    for (i = 0; i < TB_END_NB; i++) {
+        if (end_tbs[i]) {
+            cpu_fprintf(f, "%-9s %8d %12" PRIu64 " (%d%%)\n",
+                        tb_end_names[i], end_tbs[i], end_execs[i],
+                        execs ? (int)(end_execs[i] * 100 / execs) : 0);
+        }
+    }
+
+    n = max > 0 && max < ctx->nb_tbs ? max : ctx->nb_tbs;
+    cpu_fprintf(f, "\n%-*s %-16s %5s %5s %12s %-8s %s\n",
+                TARGET_LONG_SIZE * 2, "pc", "flags", "insns", "bytes",
+                "executions", "end", "chained");
+    for (i = 0; i < n && tbs[i]->exec_count; i++) {
+        TranslationBlock *tb = tbs[i];
+        int jumps = 0, chained = 0, j;
+
+        for (j = 0; j < 2; j++) {
+            if (tb->tb_next_offset[j] != 0xffff) {
+                jumps++;
+                chained += tb->jmp_next[j] != NULL;
+            }
+        }
+        cpu_fprintf(f, TARGET_FMT_lx " %016" PRIx64 " %5d %5d %12" PRIu64
+                    " %-8s %d/%d\n", tb->pc, tb->flags, tb->icount,
+                    tb->size, tb->exec_count, tb_end_names[tb->end_reason],
+                    chained, jumps);
+    }
+    g_free(tbs);
+}
+
+/* Persistent translation cache.
+ *
+ * With -tb-cache FILE, the translated code is written to FILE on exit and
+ * loaded back by the next run, which then does not translate again the
+ * blocks of guest code that did not change.  The code is not relocated:
+ * the code buffer and the TBs, which the code points to, are mapped at
+ * the same address in each run, and calls out of the generated code go
+ * through the call table of TCGContext, filled in again on loading.  A
+ * loaded TB is linked when a lookup misses with the same pc, flags and
+ * physical pages, and the guest code hashes to the same value.  A file
+ * written by another executable or machine configuration is ignored.
+ */
+#ifdef USE_TB_CACHE
+
+#define TB_CACHE_MAGIC 0x32434254554d4551ull        /* "QEMUTBC2" */
+
+/* Translators may look at a few instructions past the end of a block,
+   like the MIPS idle loop detection does; they are hashed too.  */
+#define TB_CACHE_LOOKAHEAD 32
+
+#define TB_CACHE_HASH_INIT 0xcbf29ce484222325ull
+
+typedef struct TBCacheHeader {
+    uint64_t magic;
+    uint64_t fingerprint;
+    uint64_t code_gen_buffer;
+    uint64_t code_gen_buffer_size;
+    uint64_t tbs;
+    uint64_t prologue_size;     /* prologue and call table */
+    uint64_t code_size;
+    uint64_t region_code_size[TB_REGIONS];
+    uint32_t nb_calls;
+    uint32_t nb_tbs;
+    uint32_t nb_regions;
+    uint32_t cur_region;
+    uint32_t region_nb_tbs[TB_REGIONS];
+} TBCacheHeader;
+
+/* The file holds the header, the prologue, the call table as offsets
+   from tb_cache_load, one record per TB, region after region, and the
+   code up to the end of the last region used.  */
+typedef struct TBCacheRecord {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint64_t page_addr[2];
+    uint64_t src_hash;
+    uint32_t tc_offset;         /* from code_gen_buffer */
+    uint32_t search_offset;     /* from tc_offset */
+    uint32_t cflags;
+    uint16_t size;
+    uint16_t icount;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint8_t jmp_fixed;
+    uint8_t end_reason;
+    uint8_t live;               /* TB may be linked */
+    uint8_t pad[5];
+} TBCacheRecord;
+
+static struct {
+    /* loaded TBs not linked yet, by physical pc: index + 1 of the first
+       one, the others follow through next */
+    GHashTable *pending;
+    int *next;
+} tb_cache;
+
+static uint64_t tb_cache_hash(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        h = (h ^ *p++) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint64_t tb_cache_src_hash(TranslationBlock *tb)
+{
+    target_ulong offset = tb->pc & ~TARGET_PAGE_MASK;
+    target_ulong len = TARGET_PAGE_SIZE - offset;
+    uint64_t h;
+
+    if (tb->page_addr[1] == -1) {
+        len = MIN(len, tb->size + TB_CACHE_LOOKAHEAD);
+    }
+    h = tb_cache_hash(TB_CACHE_HASH_INIT,
+                      qemu_get_ram_ptr(tb->page_addr[0] + offset), len);
+    if (tb->page_addr[1] != -1) {
+        h = tb_cache_hash(h, qemu_get_ram_ptr(tb->page_addr[1]),
+                          tb->size - len);
+    }
+    return h;
+}
+
+static int tb_cache_add_global(void *opaque, QemuOpts *opts, Error **errp)
+{
+    g_string_append_printf(opaque, " %s.%s=%s",
+                           qemu_opt_get(opts, "driver"),
+                           qemu_opt_get(opts, "property"),
+                           qemu_opt_get(opts, "value"));
+    return 0;
+}
+
+/* Append the values of the properties of obj, sorted by name.  Links
+   and children only name other objects.  */
+static void tb_cache_add_props(GString *str, Object *obj)
+{
+    ObjectPropertyIterator *iter = object_property_iter_init(obj);
+    ObjectProperty *prop;
+    GSList *list = NULL, *l;
+
+    while ((prop = object_property_iter_next(iter))) {
+        char *value;
+
+        if (!prop->get || strstart(prop->type, "link<", NULL) ||
+            strstart(prop->type, "child<", NULL)) {
+            continue;
+        }
+        value = object_property_print(obj, prop->name, false, NULL);
+        if (value) {
+            list = g_slist_prepend(list, g_strdup_printf(" %s=%s",
+                                                         prop->name, value));
+            g_free(value);
+        }
+    }
+    object_property_iter_free(iter);
+
+    list = g_slist_sort(list, (GCompareFunc)strcmp);
+    for (l = list; l; l = l->next) {
+        g_string_append(str, l->data);
+    }
+    g_slist_free_full(list, g_free);
+}
+
+/* Identify the executable and the configuration of the machine, which
+   the generated code depends on.  */
+static uint64_t tb_cache_fingerprint(void)
+{
+    GString *str = g_string_new(QEMU_VERSION " " TARGET_NAME);
+    struct stat st;
+    uint64_t h;
+
+    if (stat("/proc/self/exe", &st) == 0) {
+        g_string_append_printf(str, " %lld %lld", (long long)st.st_size,
+                               (long long)st.st_mtime);
+    }
+    g_string_append_printf(str, " %s %s " RAM_ADDR_FMT " %d %zu",
+                           MACHINE_GET_CLASS(current_machine)->name,
+                           current_machine->cpu_model ?: "", ram_size,
+                           singlestep, sizeof(TranslationBlock));
+    qemu_opts_foreach(qemu_find_opts("global"), tb_cache_add_global, str,
+                      NULL);
+    tb_cache_add_props(str, OBJECT(current_machine));
+    if (first_cpu) {
+        tb_cache_add_props(str, OBJECT(first_cpu));
+    }
+
+    h = tb_cache_hash(TB_CACHE_HASH_INIT, str->str, str->len);
+    g_string_free(str, true);
+    return h;
+}
+
+static inline gpointer tb_cache_key(TranslationBlock *tb)
+{
+    return (gpointer)(uintptr_t)(tb->page_addr[0] |
+                                 (tb->pc & ~TARGET_PAGE_MASK));
+}
+
+static TranslationBlock *tb_cache_find(CPUState *cpu, target_ulong pc,
+                                       target_ulong cs_base, int flags,
+                                       int cflags, tb_page_addr_t phys_pc)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_page2;
+    target_ulong virt_page2;
+    gpointer key = (gpointer)(uintptr_t)phys_pc;
+    int i, prev = -1;
+
+    if (!tb_cache.pending) {
+        return NULL;
+    }
+    i = GPOINTER_TO_INT(g_hash_table_lookup(tb_cache.pending, key)) - 1;
+    for (; i >= 0; prev = i, i = tb_cache.next[i] - 1) {
+        tb = &tcg_ctx.tb_ctx.tbs[i];
+        if (tb->pc != pc || tb->cs_base != cs_base || tb->flags != flags ||
+            (tb->cflags & ~CF_INVALID) != cflags) {
+            continue;
+        }
+        virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
+        phys_page2 = -1;
+        if ((pc & TARGET_PAGE_MASK) != virt_page2) {
+            phys_page2 = get_page_addr_code(env, virt_page2);
+        }
+        if (phys_page2 != tb->page_addr[1] ||
+            tb_cache_src_hash(tb) != tb->src_hash) {
+            continue;
+        }
+
+        if (prev >= 0) {
+            tb_cache.next[prev] = tb_cache.next[i];
+        } else if (tb_cache.next[i]) {
+            g_hash_table_insert(tb_cache.pending, key,
+                                GINT_TO_POINTER(tb_cache.next[i]));
+        } else {
+            g_hash_table_remove(tb_cache.pending, key);
+        }
+        tb_link_page(tb, phys_pc, phys_page2);
+        return tb;
+    }
+    return NULL;
+}
+
+static void tb_cache_drop(void)
+{
+    if (tb_cache.pending) {
+        g_hash_table_destroy(tb_cache.pending);
+        g_free(tb_cache.next);
+        tb_cache.pending = NULL;
+        tb_cache.next = NULL;
+    }
+}
+
+/* The regions of the file have the layout of this buffer, and hold
+   its code and TBs */
+static bool tb_cache_regions_ok(TBCacheHeader *hdr)
+{
+    uint64_t nb_tbs = 0, size;
+    int r;
+
+    if (hdr->nb_regions != tcg_ctx.tb_ctx.nb_regions ||
+        hdr->cur_region >= hdr->nb_regions) {
+        return false;
+    }
+    for (r = 0; r < hdr->nb_regions; r++) {
+        size = tb_region_size();
+        if (r == hdr->cur_region) {
+            size -= CODE_GEN_HIGHWATER;
+        }
+        if (hdr->region_nb_tbs[r] > tcg_ctx.tb_ctx.region_max_tbs ||
+            hdr->region_code_size[r] > size ||
+            (hdr->region_code_size[r] &&
+             tb_region_start(r) - tcg_ctx.code_gen_buffer +
+                 hdr->region_code_size[r] > hdr->code_size)) {
+            return false;
+        }
+        nb_tbs += hdr->region_nb_tbs[r];
+    }
+    return nb_tbs == hdr->nb_tbs;
+}
+
+/* Load the cache before the machine starts */
+void tb_cache_load(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBCacheHeader *hdr;
+    TBCacheRecord *rec;
+    int64_t *calls;
+    void *file, *prologue, *code;
+    size_t prologue_size = tcg_ctx.code_gen_buffer - tcg_ctx.code_gen_prologue;
+    struct stat st;
+    int fd, i, j, r;
+
+    if (!tb_cache_path || !tcg_ctx.call_table) {
+        return;
+    }
+    fd = open(tb_cache_path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return;
+    }
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        return;
+    }
+
+    hdr = file;
+    prologue = hdr + 1;
+    calls = prologue + ROUND_UP(prologue_size, 8);
+    rec = (TBCacheRecord *)(calls + hdr->nb_calls);
+    code = rec + hdr->nb_tbs;
+    if (hdr->magic != TB_CACHE_MAGIC ||
+        hdr->fingerprint != tb_cache_fingerprint() ||
+        hdr->code_gen_buffer != (uintptr_t)tcg_ctx.code_gen_buffer ||
+        hdr->code_gen_buffer_size != tcg_ctx.code_gen_buffer_size ||
+        hdr->tbs != (uintptr_t)tcg_ctx.tb_ctx.tbs ||
+        hdr->prologue_size != prologue_size ||
+        hdr->nb_calls > tcg_ctx.call_table_size ||
+        hdr->code_size > tcg_ctx.code_gen_buffer_size ||
+        !tb_cache_regions_ok(hdr) ||
+        code + hdr->code_size != file + st.st_size ||
+        memcmp(prologue, tcg_ctx.code_gen_prologue,
+               (void *)tcg_ctx.call_table - tcg_ctx.code_gen_prologue)) {
+        error_report("tb-cache: %s does not match this machine, ignored",
+                     tb_cache_path);
+        goto out;
+    }
+
+    for (i = 0; i < hdr->nb_calls; i++) {
+        void *dest = (void *)tb_cache_load + calls[i];
+
+        tcg_ctx.call_table[i] = dest;
+        g_hash_table_insert(tcg_ctx.call_table_idx, dest, GINT_TO_POINTER(i));
+    }
+    tcg_ctx.call_table_nb = hdr->nb_calls;
+
+    memcpy(tcg_ctx.code_gen_buffer, code, hdr->code_size);
+    flush_icache_range((uintptr_t)tcg_ctx.code_gen_buffer,
+                       (uintptr_t)tcg_ctx.code_gen_buffer + hdr->code_size);
+
+    tb_cache.pending = g_hash_table_new(NULL, NULL);
+    tb_cache.next = g_new0(int, tcg_ctx.code_gen_max_blocks);
+    for (r = 0; r < hdr->nb_regions; r++) {
+        for (j = 0; j < hdr->region_nb_tbs[r]; j++, rec++) {
+            TranslationBlock *tb = &tb_region_tbs(r)[j];
+            gpointer key;
+
+            /* CF_INVALID until tb_cache_find links it */
+            memset(tb, 0, sizeof(*tb));
+            tb->pc = rec->pc;
+            tb->cs_base = rec->cs_base;
+            tb->flags = rec->flags;
+            tb->size = rec->size;
+            tb->icount = rec->icount;
+            tb->cflags = rec->cflags | CF_INVALID;
+            tb->tc_ptr = tcg_ctx.code_gen_buffer + rec->tc_offset;
+            tb->tc_search = tb->tc_ptr + rec->search_offset;
+            tb->page_addr[0] = rec->page_addr[0];
+            tb->page_addr[1] = rec->page_addr[1];
+            tb->tb_next_offset[0] = rec->tb_next_offset[0];
+            tb->tb_next_offset[1] = rec->tb_next_offset[1];
+            tb->tb_jmp_offset[0] = rec->tb_jmp_offset[0];
+            tb->tb_jmp_offset[1] = rec->tb_jmp_offset[1];
+            tb->jmp_fixed = rec->jmp_fixed;
+            tb->end_reason = rec->end_reason;
+            tb->src_hash = rec->src_hash;
+            tb->hot_count = tb_superblock_threshold;
+            if (rec->live) {
+                i = tb - ctx->tbs;
+                key = tb_cache_key(tb);
+                tb_cache.next[i] = GPOINTER_TO_INT(
+                    g_hash_table_lookup(tb_cache.pending, key));
+                g_hash_table_insert(tb_cache.pending, key,
+                                    GINT_TO_POINTER(i + 1));
+            }
+        }
+        ctx->region_nb_tbs[r] = hdr->region_nb_tbs[r];
+        ctx->region_code_size[r] = hdr->region_code_size[r];
+    }
+    ctx->nb_tbs = hdr->nb_tbs;
+    tb_region_enter(hdr->cur_region);
+
+out:
+    munmap(file, st.st_size);
+}
+
+static void tb_cache_mark_live(struct qht *ht, void *p, uint32_t hash,
+                               void *userp)
+{
+    uint8_t *live = userp;
+
+    live[(TranslationBlock *)p - tcg_ctx.tb_ctx.tbs] = 1;
+}
+
+/* Write the cache, once the CPUs are stopped for good */
+void tb_cache_save(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBCacheHeader hdr;
+    TBCacheRecord rec;
+    TranslationBlock *tb;
+    size_t prologue_size = tcg_ctx.code_gen_buffer - tcg_ctx.code_gen_prologue;
+    uint8_t pad[8] = { 0 };
+    uint8_t *live;
+    char *tmp;
+    FILE *f;
+    int i, j, r;
+    bool ok;
+
+    if (!tb_cache_path || !tcg_ctx.call_table) {
+        return;
+    }
+    if (tcg_ctx.call_table_full || ctx->profile) {
+        error_report("tb-cache: not writing %s, the code cannot be reused",
+                     tb_cache_path);
+        return;
+    }
+
+    /* TBs in the hash table, or loaded and not linked yet */
+    live = g_new0(uint8_t, tcg_ctx.code_gen_max_blocks);
+    qht_iter(&ctx->htable, tb_cache_mark_live, live);
+    if (tb_cache.pending) {
+        GHashTableIter iter;
+        gpointer value;
+
+        g_hash_table_iter_init(&iter, tb_cache.pending);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            for (i = GPOINTER_TO_INT(value) - 1; i >= 0;
+                 i = tb_cache.next[i] - 1) {
+                live[i] = 1;
+            }
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TB_CACHE_MAGIC;
+    hdr.fingerprint = tb_cache_fingerprint();
+    hdr.code_gen_buffer = (uintptr_t)tcg_ctx.code_gen_buffer;
+    hdr.code_gen_buffer_size = tcg_ctx.code_gen_buffer_size;
+    hdr.tbs = (uintptr_t)ctx->tbs;
+    hdr.prologue_size = prologue_size;
+    hdr.nb_calls = tcg_ctx.call_table_nb;
+    hdr.nb_tbs = ctx->nb_tbs;
+    hdr.nb_regions = ctx->nb_regions;
+    hdr.cur_region = ctx->cur_region;
+    for (r = 0; r < ctx->nb_regions; r++) {
+        hdr.region_nb_tbs[r] = ctx->region_nb_tbs[r];
+        hdr.region_code_size[r] = tb_region_code_size(r);
+        if (hdr.region_code_size[r]) {
+            hdr.code_size = tb_region_start(r) - tcg_ctx.code_gen_buffer +
+                            hdr.region_code_size[r];
+        }
+    }
+
+    tmp = g_strdup_printf("%s.%d", tb_cache_path, (int)getpid());
+    f = fopen(tmp, "wb");
+    if (!f) {
+        error_report("tb-cache: cannot write %s: %s", tmp, strerror(errno));
+        goto out;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+         fwrite(tcg_ctx.code_gen_prologue, prologue_size, 1, f) == 1 &&
+         fwrite(pad, ROUND_UP(prologue_size, 8) - prologue_size, 1, f) <= 1;
+    for (i = 0; ok && i < tcg_ctx.call_table_nb; i++) {
+        int64_t offset = tcg_ctx.call_table[i] - (void *)tb_cache_load;
+
+        ok = fwrite(&offset, sizeof(offset), 1, f) == 1;
+    }
+    for (r = 0; ok && r < ctx->nb_regions; r++) {
+        for (j = 0; ok && j < ctx->region_nb_tbs[r]; j++) {
+            tb = &tb_region_tbs(r)[j];
+            memset(&rec, 0, sizeof(rec));
+            rec.pc = tb->pc;
+            rec.cs_base = tb->cs_base;
+            rec.flags = tb->flags;
+            rec.page_addr[0] = tb->page_addr[0];
+            rec.page_addr[1] = tb->page_addr[1];
+            rec.src_hash = tb->src_hash;
+            rec.tc_offset = tb->tc_ptr - tcg_ctx.code_gen_buffer;
+            rec.search_offset = tb->tc_search - (uint8_t *)tb->tc_ptr;
+            rec.cflags = tb->cflags & ~CF_INVALID;
+            rec.size = tb->size;
+            rec.icount = tb->icount;
+            rec.tb_next_offset[0] = tb->tb_next_offset[0];
+            rec.tb_next_offset[1] = tb->tb_next_offset[1];
+            rec.tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+            rec.tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+            rec.jmp_fixed = tb->jmp_fixed;
+            rec.end_reason = tb->end_reason;
+            rec.live = live[tb - ctx->tbs] && !(tb->cflags & CF_NOCACHE);
+            ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+        }
+    }
+    ok = ok && fwrite(tcg_ctx.code_gen_buffer, hdr.code_size, 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, tb_cache_path) < 0) {
+        error_report("tb-cache: cannot write %s", tb_cache_path);
+        unlink(tmp);
+    }
+
+out:
+    g_free(tmp);
+    g_free(live);
+}
+
+#else
+
+void tb_cache_load(void)
+{
+    if (tb_cache_path) {
+        error_report("tb-cache: not supported on this host");
+    }
+}
+
+void tb_cache_save(void)
+{
+}
+
+#endif /* USE_TB_CACHE */
+
 void dump_opcount_info(FILE *f, fprintf_function cpu_fprintf)
 {
     tcg_dump_op_count(f, cpu_fprintf);
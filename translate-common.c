@@ -29,8 +29,7 @@ static void tcg_handle_interrupt(CPUState *cpu, int mask)
 {
     int old_mask;
 
-    old_mask = cpu->interrupt_request;
-    cpu->interrupt_request |= mask;
+    old_mask = atomic_fetch_or(&cpu->interrupt_request, mask);
 
     /*
      * If called from iothread context, wake the target cpu in
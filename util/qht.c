@@ -0,0 +1,522 @@
+/*
+ * Scalable hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * The entries of a chain of buckets are kept packed at its front: the
+ * first empty slot ends the chain, and a removal moves the last entry of
+ * the chain into the slot it frees.  A writer holds the lock of the head
+ * bucket and makes its sequence number odd while it changes the chain,
+ * so that a lookup that ran meanwhile knows to retry.
+ *
+ * A resize locks all the head buckets of the old map, copies the entries
+ * to a new map and publishes it before unlocking; a writer that locked a
+ * bucket of a map that is not current anymore retries with the new map,
+ * which ht->lock gives.  Lookups still walking the old map see its last
+ * contents, it is freed after an RCU grace period.
+ */
+
+#include "qemu-common.h"
+#include <assert.h>
+#include "qemu/qht.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+
+#if HOST_LONG_BITS == 32
+#define QHT_BUCKET_ENTRIES 6
+#else
+#define QHT_BUCKET_ENTRIES 4
+#endif
+
+#define QHT_BUCKET_ALIGN 64
+
+/* Grow once this many head buckets in eight had to be chained to */
+#define QHT_ADDED_BUCKETS_THRESHOLD_DIV 8
+
+struct qht_bucket {
+    QemuSpin lock;
+    unsigned int sequence;
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    struct qht_bucket *next;
+} __attribute__((__aligned__(QHT_BUCKET_ALIGN)));
+
+QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
+
+struct qht_map {
+    struct rcu_head rcu;
+    struct qht_bucket *buckets;
+    size_t n_buckets;
+    size_t n_added_buckets;
+    size_t n_added_buckets_threshold;
+};
+
+static inline void bucket_write_begin(struct qht_bucket *head)
+{
+    atomic_set(&head->sequence, head->sequence + 1);
+    smp_wmb();
+}
+
+static inline void bucket_write_end(struct qht_bucket *head)
+{
+    smp_wmb();
+    atomic_set(&head->sequence, head->sequence + 1);
+}
+
+static inline unsigned int bucket_read_begin(struct qht_bucket *head)
+{
+    unsigned int ret = atomic_read(&head->sequence);
+
+    smp_rmb();
+    return ret & ~1;
+}
+
+static inline bool bucket_read_retry(struct qht_bucket *head,
+                                     unsigned int start)
+{
+    smp_rmb();
+    return atomic_read(&head->sequence) != start;
+}
+
+static inline size_t qht_elems_to_buckets(size_t n_elems)
+{
+    return pow2ceil(MAX(n_elems / QHT_BUCKET_ENTRIES, 1));
+}
+
+static inline struct qht_bucket *qht_map_to_bucket(struct qht_map *map,
+                                                   uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+static inline bool qht_map_needs_resize(struct qht_map *map)
+{
+    return atomic_read(&map->n_added_buckets) >
+           map->n_added_buckets_threshold;
+}
+
+static struct qht_map *qht_map_create(size_t n_buckets)
+{
+    struct qht_map *map = g_new(struct qht_map, 1);
+
+    map->n_buckets = n_buckets;
+    map->n_added_buckets = 0;
+    map->n_added_buckets_threshold =
+        MAX(n_buckets / QHT_ADDED_BUCKETS_THRESHOLD_DIV, 1);
+    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
+                                 sizeof(*map->buckets) * n_buckets);
+    memset(map->buckets, 0, sizeof(*map->buckets) * n_buckets);
+    return map;
+}
+
+static void qht_map_destroy(struct qht_map *map)
+{
+    struct qht_bucket *b, *next;
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        for (b = map->buckets[i].next; b; b = next) {
+            next = b->next;
+            qemu_vfree(b);
+        }
+    }
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+static void qht_map_lock_buckets(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qemu_spin_lock(&map->buckets[i].lock);
+    }
+}
+
+static void qht_map_unlock_buckets(struct qht_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        qemu_spin_unlock(&map->buckets[i].lock);
+    }
+}
+
+/* Empty the chains of map, whose buckets are locked */
+static void qht_map_reset__all_locked(struct qht_map *map)
+{
+    struct qht_bucket *head, *b;
+    size_t i;
+    int j;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        head = &map->buckets[i];
+        bucket_write_begin(head);
+        for (b = head; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                b->hashes[j] = 0;
+                atomic_set(&b->pointers[j], NULL);
+            }
+        }
+        bucket_write_end(head);
+    }
+}
+
+void qht_init(struct qht *ht, size_t n_elems, unsigned int mode)
+{
+    ht->mode = mode;
+    ht->resizes = 0;
+    qemu_mutex_init(&ht->lock);
+    ht->map = qht_map_create(qht_elems_to_buckets(n_elems));
+}
+
+void qht_destroy(struct qht *ht)
+{
+    qht_map_destroy(ht->map);
+    qemu_mutex_destroy(&ht->lock);
+    memset(ht, 0, sizeof(*ht));
+}
+
+/*
+ * Lock the head bucket of hash in the current map, which goes to *pmap.
+ * Called in an RCU read-side critical section.
+ */
+static struct qht_bucket *qht_bucket_lock(struct qht *ht, uint32_t hash,
+                                          struct qht_map **pmap)
+{
+    struct qht_map *map = atomic_rcu_read(&ht->map);
+    struct qht_bucket *b = qht_map_to_bucket(map, hash);
+
+    qemu_spin_lock(&b->lock);
+    if (likely(atomic_read(&ht->map) == map)) {
+        *pmap = map;
+        return b;
+    }
+
+    /* A resize swapped the map, it is done by the time ht->lock is free */
+    qemu_spin_unlock(&b->lock);
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    b = qht_map_to_bucket(map, hash);
+    qemu_spin_lock(&b->lock);
+    qemu_mutex_unlock(&ht->lock);
+    *pmap = map;
+    return b;
+}
+
+static void *qht_do_lookup(struct qht_bucket *head, qht_lookup_func_t func,
+                           const void *userp, uint32_t hash)
+{
+    struct qht_bucket *b;
+    void *p;
+    int i;
+
+    for (b = head; b; b = atomic_rcu_read(&b->next)) {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (atomic_read(&b->hashes[i]) == hash) {
+                p = atomic_rcu_read(&b->pointers[i]);
+                if (likely(p) && likely(func(p, userp))) {
+                    return p;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void *qht_lookup(struct qht *ht, qht_lookup_func_t func, const void *userp,
+                 uint32_t hash)
+{
+    struct qht_bucket *head;
+    unsigned int version;
+    void *ret;
+
+    head = qht_map_to_bucket(atomic_rcu_read(&ht->map), hash);
+    do {
+        version = bucket_read_begin(head);
+        ret = qht_do_lookup(head, func, userp, hash);
+    } while (bucket_read_retry(head, version));
+    return ret;
+}
+
+/*
+ * Insert p in the chain of head, whose lock is held.  When a bucket had to
+ * be chained to head and needs_resize is not NULL, it tells whether map
+ * got too many of them.
+ */
+static bool qht_insert__locked(struct qht_map *map, struct qht_bucket *head,
+                               void *p, uint32_t hash, bool *needs_resize)
+{
+    struct qht_bucket *b = head, *prev = NULL, *new = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                goto found;
+            }
+            if (b->pointers[i] == p) {
+                return false;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    new = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*new));
+    memset(new, 0, sizeof(*new));
+    b = new;
+    i = 0;
+    atomic_inc(&map->n_added_buckets);
+    if (needs_resize && qht_map_needs_resize(map)) {
+        *needs_resize = true;
+    }
+
+ found:
+    bucket_write_begin(head);
+    if (new) {
+        atomic_rcu_set(&prev->next, new);
+    }
+    atomic_set(&b->hashes[i], hash);
+    atomic_rcu_set(&b->pointers[i], p);
+    bucket_write_end(head);
+    return true;
+}
+
+static void qht_do_resize(struct qht *ht, struct qht_map *new);
+
+static void qht_grow(struct qht *ht)
+{
+    struct qht_map *map;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    /* Another insertion may have grown the table meanwhile */
+    if (qht_map_needs_resize(map)) {
+        qht_do_resize(ht, qht_map_create(map->n_buckets * 2));
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+bool qht_insert(struct qht *ht, void *p, uint32_t hash)
+{
+    struct qht_bucket *head;
+    struct qht_map *map;
+    bool needs_resize = false;
+    bool ret;
+
+    assert(p);
+    rcu_read_lock();
+    head = qht_bucket_lock(ht, hash, &map);
+    ret = qht_insert__locked(map, head, p, hash, &needs_resize);
+    qemu_spin_unlock(&head->lock);
+    rcu_read_unlock();
+
+    if (unlikely(needs_resize) && (ht->mode & QHT_MODE_AUTO_RESIZE)) {
+        qht_grow(ht);
+    }
+    return ret;
+}
+
+/*
+ * Clear the entry at pos of orig, moving the last entry of the chain of
+ * head into it.
+ */
+static void qht_bucket_remove_entry(struct qht_bucket *head,
+                                    struct qht_bucket *orig, int pos)
+{
+    struct qht_bucket *b = orig, *prev = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                break;
+            }
+        }
+        if (i < QHT_BUCKET_ENTRIES) {
+            break;
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    /* The last entry is before the first empty slot, (b, i) */
+    if (b && i > 0) {
+        prev = b;
+        i--;
+    } else {
+        i = QHT_BUCKET_ENTRIES - 1;
+    }
+    if (prev == orig && i == pos) {
+        atomic_set(&orig->hashes[pos], 0);
+        atomic_set(&orig->pointers[pos], NULL);
+        return;
+    }
+    atomic_set(&orig->hashes[pos], prev->hashes[i]);
+    atomic_set(&orig->pointers[pos], prev->pointers[i]);
+    atomic_set(&prev->hashes[i], 0);
+    atomic_set(&prev->pointers[i], NULL);
+}
+
+static bool qht_remove__locked(struct qht_bucket *head, const void *p)
+{
+    struct qht_bucket *b;
+    int i;
+
+    for (b = head; b; b = b->next) {
+        for (i = 0; i < QHT_BUCKET_ENTRIES && b->pointers[i]; i++) {
+            if (b->pointers[i] == p) {
+                bucket_write_begin(head);
+                qht_bucket_remove_entry(head, b, i);
+                bucket_write_end(head);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
+{
+    struct qht_bucket *head;
+    struct qht_map *map;
+    bool ret;
+
+    rcu_read_lock();
+    head = qht_bucket_lock(ht, hash, &map);
+    ret = qht_remove__locked(head, p);
+    qemu_spin_unlock(&head->lock);
+    rcu_read_unlock();
+    return ret;
+}
+
+/* Move the entries to new and make it the current map; ht->lock held */
+static void qht_do_resize(struct qht *ht, struct qht_map *new)
+{
+    struct qht_map *old = ht->map;
+    struct qht_bucket *b;
+    size_t i;
+    int j;
+
+    qht_map_lock_buckets(old);
+    for (i = 0; i < old->n_buckets; i++) {
+        for (b = &old->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                qht_insert__locked(new, qht_map_to_bucket(new, b->hashes[j]),
+                                   b->pointers[j], b->hashes[j], NULL);
+            }
+        }
+    }
+    atomic_rcu_set(&ht->map, new);
+    qht_map_unlock_buckets(old);
+    call_rcu(old, qht_map_destroy, rcu);
+    atomic_set(&ht->resizes, ht->resizes + 1);
+}
+
+void qht_resize(struct qht *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+
+    qemu_mutex_lock(&ht->lock);
+    if (n_buckets != ht->map->n_buckets) {
+        qht_do_resize(ht, qht_map_create(n_buckets));
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_reset(struct qht *ht)
+{
+    struct qht_map *map;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    qht_map_lock_buckets(map);
+    qht_map_reset__all_locked(map);
+    qht_map_unlock_buckets(map);
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_reset_size(struct qht *ht, size_t n_elems)
+{
+    size_t n_buckets = qht_elems_to_buckets(n_elems);
+    struct qht_map *old;
+
+    qemu_mutex_lock(&ht->lock);
+    old = ht->map;
+    qht_map_lock_buckets(old);
+    if (n_buckets == old->n_buckets) {
+        qht_map_reset__all_locked(old);
+        qht_map_unlock_buckets(old);
+    } else {
+        atomic_rcu_set(&ht->map, qht_map_create(n_buckets));
+        qht_map_unlock_buckets(old);
+        call_rcu(old, qht_map_destroy, rcu);
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
+{
+    struct qht_map *map;
+    struct qht_bucket *b;
+    size_t i;
+    int j;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    qht_map_lock_buckets(map);
+    for (i = 0; i < map->n_buckets; i++) {
+        for (b = &map->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                func(ht, b->pointers[j], b->hashes[j], userp);
+            }
+        }
+    }
+    qht_map_unlock_buckets(map);
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_statistics(struct qht *ht, struct qht_stats *stats)
+{
+    struct qht_map *map;
+    struct qht_bucket *head, *b;
+    unsigned int version;
+    size_t i, entries, buckets;
+    int j;
+
+    memset(stats, 0, sizeof(*stats));
+    rcu_read_lock();
+    map = atomic_rcu_read(&ht->map);
+    stats->head_buckets = map->n_buckets;
+    stats->resizes = atomic_read(&ht->resizes);
+    for (i = 0; i < map->n_buckets; i++) {
+        head = &map->buckets[i];
+        do {
+            version = bucket_read_begin(head);
+            entries = 0;
+            buckets = 0;
+            for (b = head; b; b = atomic_rcu_read(&b->next)) {
+                for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                    if (!atomic_read(&b->pointers[j])) {
+                        break;
+                    }
+                    entries++;
+                }
+                if (j == 0) {
+                    break;
+                }
+                buckets++;
+            }
+        } while (bucket_read_retry(head, version));
+
+        if (entries) {
+            stats->used_head_buckets++;
+            stats->entries += entries;
+            stats->chain_buckets += buckets;
+            stats->max_chain = MAX(stats->max_chain, buckets);
+        }
+    }
+    rcu_read_unlock();
+}
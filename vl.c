@@ -2973,6 +2973,7 @@ int main(int argc, char **argv, char **envp)
     const char *kernel_filename, *kernel_cmdline;
     const char *boot_order = NULL;
     const char *boot_once = NULL;
+    const char *tcg_threads = NULL;
     DisplayState *ds;
     int cyls, heads, secs, translation;
     QemuOpts *hda_opts = NULL, *opts, *machine_opts, *icount_opts = NULL;
@@ -3867,6 +3868,15 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_tb_cache:
+                tb_cache_path = optarg;
+                break;
+            case QEMU_OPTION_tb_superblocks:
+                tb_superblock_threshold = strtoul(optarg, NULL, 0);
+                break;
+            case QEMU_OPTION_tcg_threads:
+                tcg_threads = optarg;
+                break;
             case QEMU_OPTION_icount:
                 icount_opts = qemu_opts_parse_noisily(qemu_find_opts("icount"),
                                                       optarg, true);
@@ -4417,6 +4427,10 @@ int main(int argc, char **argv, char **envp)
         qemu_opts_del(icount_opts);
     }
 
+    if (tcg_threads) {
+        qemu_tcg_configure(tcg_threads, &error_fatal);
+    }
+
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
 
@@ -4654,6 +4668,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     qdev_prop_check_globals();
+    tb_cache_load();
     if (vmstate_dump_file) {
         /* dump and exit */
         dump_vmstate_json_to_file(vmstate_dump_file);
@@ -4686,6 +4701,7 @@ int main(int argc, char **argv, char **envp)
 
     bdrv_close_all();
     pause_all_vcpus();
+    tb_cache_save();
     res_free();
 #ifdef CONFIG_TPM
     tpm_cleanup();